@@ -0,0 +1,317 @@
+/*
+ * throughput and latency benchmark for csf_read, csf_write and csf_seek.
+ *
+ * sweeps page size, i/o size, access pattern (sequential/random), read/write mix and file size,
+ * each with encryption on and off (ctx->encrypted = 0), so paging cost can be told apart from
+ * cipher cost. every case works on a fresh file, filled first with csf_write.
+ *
+ * output is one CSV line per case and operation:
+ *   encrypted,page_sz,io_sz,pattern,mix,file_sz,op,count,MBps,p50_us,p99_us
+ * for op=seek MBps is 0. the file is left in the OS page cache, so this measures csfio and the
+ * cipher rather than the disk.
+ *
+ * with -T, measures concurrent writers instead: each of n threads writes whole pages to a file of
+ * its own through its own context, with page IVs derived from a write counter (the default),
+ * then with random IVs from the OpenSSL RNG (CSF_CONFIG.random_iv). one CSV line per case:
+ *   threads,random_iv,page_sz,pages,MBps,ns_per_page
+ *
+ * build: cc -O2 -D_FILE_OFFSET_BITS=64 -o bench_csfio bench_csfio.c csfio.c -lcrypto -lpthread
+ * usage: bench_csfio [-q] [-m] [-D] [-c cipher] [-d dir] [-r pages] [-S durability] [-t tracefile] [-T threads]
+ *   -q      quick run: fewer sizes, smaller files
+ *   -m      mmap mode: decrypt pages straight from the mapped file (CSF_CONFIG.mmap)
+ *   -D      O_DIRECT mode (CSF_CONFIG.direct): the file stays out of the OS page cache, so this
+ *           measures the disk too. dir must be on a file system that supports O_DIRECT
+ *   -c n    page cipher, CSF_CONFIG.cipher: 0 AES-256-CBC (default), 1 CTR, 2 XTS, 3 GCM
+ *   -d dir  where to create the benchmark file (default /tmp)
+ *   -r n    read ahead n pages for sequential reads (CSF_CONFIG.readahead_pages, default 0)
+ *   -S n    durability, CSF_CONFIG.durability: 0 none (default), 1 sync every write, 2 group commit.
+ *           writes then measure the disk too
+ *   -t file record a csfio trace and dump it to file at the end, see csf_trace_decode.c.
+ *           only the last records of each thread are kept
+ *   -T n    concurrent write benchmark with 1 to n threads, in powers of 2
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include "csfio.h"
+
+#define MIX_READ  0
+#define MIX_WRITE 1
+#define MIX_RW    2    // 70% reads, 30% writes
+
+#define MAX_OPS   20000
+#define OP_BYTES  (64 * 1024 * 1024)  // stop a case after moving this many bytes
+
+typedef struct {
+    long long *ns;
+    int count;
+    long long bytes;
+} SAMPLES;
+
+static unsigned long long rng_state = 88172645463325252ULL;
+static CSF_CONFIG config;
+
+static unsigned long long rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static void report(int encrypted, int page_sz, int io_sz, const char *pattern, const char *mix, long long file_sz, const char *op, SAMPLES *s) {
+    long long total = 0;
+    int i;
+
+    if(s->count == 0)
+        return;
+    for(i = 0; i < s->count; i++)
+        total += s->ns[i];
+    qsort(s->ns, s->count, sizeof(long long), cmp_ll);
+    printf("%d,%d,%d,%s,%s,%lld,%s,%d,%.1f,%.2f,%.2f\n", encrypted, page_sz, io_sz, pattern, mix, file_sz, op, s->count,
+           total ? s->bytes / (total / 1e9) / 1e6 : 0.0,
+           s->ns[s->count / 2] / 1e3, s->ns[(int)((s->count - 1) * 0.99)] / 1e3);
+    fflush(stdout);
+}
+
+static void bench_case(const char *dir, int encrypted, int page_sz, int io_sz, int random, int mix, long long file_sz) {
+    static const char *mix_names[] = { "read", "write", "rw70" };
+    char path[1024];
+    unsigned char *buf = malloc(io_sz);
+    SAMPLES rd = { malloc(MAX_OPS * sizeof(long long)), 0, 0 };
+    SAMPLES wr = { malloc(MAX_OPS * sizeof(long long)), 0, 0 };
+    SAMPLES sk = { malloc(MAX_OPS * sizeof(long long)), 0, 0 };
+    long long slots = file_sz / io_sz, pos = 0, moved = 0;
+    CSF_CTX *ctx;
+    int fd, i;
+
+    snprintf(path, sizeof(path), "%s/bench_csfio.XXXXXX", dir);
+    fd = mkstemp(path);
+    if(fd < 0 || buf == NULL || rd.ns == NULL || wr.ns == NULL || sk.ns == NULL) {
+        perror("bench_csfio");
+        exit(1);
+    }
+    unlink(path);
+    for(i = 0; i < io_sz; i++)
+        buf[i] = rng();
+
+    if(csf_ctx_init_ex(&ctx, fd, (unsigned char *)"012345678901234567890123456789012", 32, page_sz, O_RDWR, &config) < 0) {
+        perror("bench_csfio: csf_ctx_init_ex");
+        exit(1);
+    }
+    ctx->encrypted = encrypted;
+    for(pos = 0; pos < file_sz; pos += io_sz)
+        csf_write(ctx, buf, (file_sz - pos < io_sz) ? file_sz - pos : io_sz);
+    csf_flush(ctx);
+
+    for(i = 0, pos = 0; i < MAX_OPS && moved < OP_BYTES; i++) {
+        int write = (mix == MIX_WRITE) || (mix == MIX_RW && rng() % 10 < 3);
+        long long offset, t0, t1, t2;
+
+        if(random) {
+            offset = (rng() % slots) * io_sz;
+        } else {
+            offset = pos;
+            pos = (pos + io_sz + io_sz > file_sz) ? 0 : pos + io_sz;
+        }
+
+        t0 = now_ns();
+        csf_seek(ctx, offset, SEEK_SET);
+        t1 = now_ns();
+        if(write)
+            csf_write(ctx, buf, io_sz);
+        else
+            csf_read(ctx, buf, io_sz);
+        t2 = now_ns();
+
+        sk.ns[sk.count++] = t1 - t0;
+        if(write) {
+            wr.ns[wr.count++] = t2 - t1;
+            wr.bytes += io_sz;
+        } else {
+            rd.ns[rd.count++] = t2 - t1;
+            rd.bytes += io_sz;
+        }
+        moved += io_sz;
+    }
+    csf_ctx_destroy(ctx);
+    close(fd);
+
+    report(encrypted, page_sz, io_sz, random ? "random" : "seq", mix_names[mix], file_sz, "read", &rd);
+    report(encrypted, page_sz, io_sz, random ? "random" : "seq", mix_names[mix], file_sz, "write", &wr);
+    report(encrypted, page_sz, io_sz, random ? "random" : "seq", mix_names[mix], file_sz, "seek", &sk);
+    free(rd.ns);
+    free(wr.ns);
+    free(sk.ns);
+    free(buf);
+}
+
+#define WRITER_BYTES (32 * 1024 * 1024)  // written by each thread of the concurrent write benchmark
+
+typedef struct {
+    const char *dir;
+    int page_sz;
+    CSF_CONFIG config;
+    pthread_barrier_t *start;
+    long long pages;
+} WRITER;
+
+/* write WRITER_BYTES to a new file in runs of 16 pages, after all writers are ready */
+static void *writer_main(void *arg) {
+    WRITER *w = arg;
+    char path[1024];
+    CSF_CTX *ctx;
+    unsigned char *buf;
+    int fd, len, i;
+    long long pos;
+
+    snprintf(path, sizeof(path), "%s/bench_csfio.XXXXXX", w->dir);
+    fd = mkstemp(path);
+    if(fd < 0 || csf_ctx_init_ex(&ctx, fd, (unsigned char *)"012345678901234567890123456789012", 32, w->page_sz, O_RDWR, &w->config) < 0) {
+        perror("bench_csfio");
+        exit(1);
+    }
+    unlink(path);
+    len = ctx->data_sz * 16;
+    buf = malloc(len);
+    for(i = 0; i < len; i++)
+        buf[i] = i;
+    pthread_barrier_wait(w->start);
+    for(pos = 0; pos + len <= WRITER_BYTES; pos += len) {
+        csf_pwrite(ctx, buf, len, pos);
+        w->pages += 16;
+    }
+    csf_ctx_destroy(ctx);
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+static void bench_writers(const char *dir, int max_threads) {
+    int page_sizes[] = { 512, 4096, 65536 };
+    int threads, random_iv, p, i;
+
+    printf("threads,random_iv,page_sz,pages,MBps,ns_per_page\n");
+    for(p = 0; p < 3; p++)
+        for(threads = 1; threads <= max_threads; threads *= 2)
+            for(random_iv = 0; random_iv <= 1; random_iv++) {
+                WRITER *w = calloc(threads, sizeof(WRITER));
+                pthread_t *tids = calloc(threads, sizeof(pthread_t));
+                pthread_barrier_t start;
+                long long pages = 0, t0, t;
+
+                pthread_barrier_init(&start, NULL, threads + 1);
+                for(i = 0; i < threads; i++) {
+                    w[i].dir = dir;
+                    w[i].page_sz = page_sizes[p];
+                    w[i].config = config;
+                    w[i].config.random_iv = random_iv;
+                    w[i].start = &start;
+                    pthread_create(&tids[i], NULL, writer_main, &w[i]);
+                }
+                pthread_barrier_wait(&start);
+                t0 = now_ns();
+                for(i = 0; i < threads; i++) {
+                    pthread_join(tids[i], NULL);
+                    pages += w[i].pages;
+                }
+                t = now_ns() - t0;
+                printf("%d,%d,%d,%lld,%.1f,%.1f\n", threads, random_iv, page_sizes[p], pages,
+                       (double)threads * WRITER_BYTES / (t / 1e9) / 1e6, (double)t * threads / pages);
+                fflush(stdout);
+                pthread_barrier_destroy(&start);
+                free(w);
+                free(tids);
+            }
+}
+
+int main(int argc, char **argv) {
+    int page_sizes[] = { 512, 4096, 16384, 65536 };
+    int io_sizes[] = { 64, 4096, 65536, 1048576 };
+    long long file_sizes[] = { 1 << 20, 64 << 20 };
+    int npage = 4, nio = 4, nfile = 2;
+    const char *dir = "/tmp";
+    const char *trace = NULL;
+    int encrypted, p, io, random, mix, f, c;
+    int writers = 0;
+
+    csf_config_init(&config);
+    while((c = getopt(argc, argv, "qmDc:d:r:S:t:T:")) != -1) {
+        switch(c) {
+            case 'q':
+                page_sizes[1] = 65536;
+                npage = 2;
+                io_sizes[1] = 65536;
+                nio = 2;
+                nfile = 1;
+                break;
+            case 'm':
+                config.mmap = 1;
+                break;
+            case 'D':
+                config.direct = 1;
+                break;
+            case 'c':
+                config.cipher = atoi(optarg);
+                break;
+            case 'd':
+                dir = optarg;
+                break;
+            case 'r':
+                config.readahead_pages = atoi(optarg);
+                break;
+            case 'S':
+                config.durability = atoi(optarg);
+                break;
+            case 't':
+                trace = optarg;
+                csf_trace_enable(1);
+                break;
+            case 'T':
+                writers = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: bench_csfio [-q] [-m] [-D] [-c cipher] [-d dir] [-r pages] [-S durability] [-t tracefile] [-T threads]\n");
+                return 1;
+        }
+    }
+    if(writers > 0) {
+        bench_writers(dir, writers);
+        return 0;
+    }
+
+    printf("encrypted,page_sz,io_sz,pattern,mix,file_sz,op,count,MBps,p50_us,p99_us\n");
+    for(encrypted = 1; encrypted >= 0; encrypted--)
+        for(f = 0; f < nfile; f++)
+            for(p = 0; p < npage; p++)
+                for(io = 0; io < nio; io++) {
+                    if(io_sizes[io] > file_sizes[f])
+                        continue;
+                    for(random = 0; random <= 1; random++)
+                        for(mix = MIX_READ; mix <= MIX_RW; mix++)
+                            bench_case(dir, encrypted, page_sizes[p], io_sizes[io], random, mix, file_sizes[f]);
+                }
+    if(trace) {
+        int fd = open(trace, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+        if(fd < 0 || csf_trace_dump(fd) < 0) {
+            perror(trace);
+            return 1;
+        }
+        close(fd);
+    }
+    return 0;
+}
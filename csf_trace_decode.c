@@ -0,0 +1,66 @@
+/*
+ * decode a trace written by csf_trace_dump into CSV, one line per record, in time order:
+ *   ts_us,thread,fh,event,pgno,size,result,duration_us
+ * ts_us is relative to the first record. see CSF_TRACE_ in csfio.h for what pgno, size and
+ * result hold for each event. the dump is in host byte order, so decode it on the same kind
+ * of machine that wrote it.
+ *
+ * build: cc -O2 -D_FILE_OFFSET_BITS=64 -o csf_trace_decode csf_trace_decode.c
+ * usage: csf_trace_decode [tracefile]   (reads stdin without a file)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "csfio.h"
+
+static const char *event_names[] = {
+    "?", "read_page", "write_page", "seek", "pread", "pwrite",
+    "batch_read", "batch_write", "partial_read", "flush", "truncate", "sync"
+};
+
+static int cmp_ts(const void *a, const void *b) {
+    const CSF_TRACE_RECORD *x = a, *y = b;
+    return (x->ts_ns > y->ts_ns) - (x->ts_ns < y->ts_ns);
+}
+
+int main(int argc, char **argv) {
+    FILE *in = stdin;
+    CSF_TRACE_FILE_HEADER hdr;
+    CSF_TRACE_RECORD *recs;
+    uint64_t i, n;
+
+    if(argc > 1 && (in = fopen(argv[1], "rb")) == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    if(fread(&hdr, sizeof(hdr), 1, in) != 1 || hdr.magic != CSF_TRACE_MAGIC) {
+        fprintf(stderr, "csf_trace_decode: not a csfio trace\n");
+        return 1;
+    }
+    if(hdr.version != CSF_TRACE_VERSION || hdr.record_sz != sizeof(CSF_TRACE_RECORD)) {
+        fprintf(stderr, "csf_trace_decode: trace version %u, record size %u not supported\n", hdr.version, hdr.record_sz);
+        return 1;
+    }
+    recs = malloc((hdr.count ? hdr.count : 1) * sizeof(CSF_TRACE_RECORD));
+    if(recs == NULL) {
+        perror("csf_trace_decode");
+        return 1;
+    }
+    n = fread(recs, sizeof(CSF_TRACE_RECORD), hdr.count, in);
+    if(n < hdr.count)
+        fprintf(stderr, "csf_trace_decode: trace cut short, %llu of %llu records\n", (unsigned long long)n, (unsigned long long)hdr.count);
+    qsort(recs, n, sizeof(CSF_TRACE_RECORD), cmp_ts);
+
+    printf("ts_us,thread,fh,event,pgno,size,result,duration_us\n");
+    for(i = 0; i < n; i++) {
+        CSF_TRACE_RECORD *r = &recs[i];
+        const char *name = (r->event < sizeof(event_names) / sizeof(event_names[0])) ? event_names[r->event] : "?";
+
+        printf("%.3f,%u,%d,%s,%lld,%lld,%lld,%.3f\n", (r->ts_ns - recs[0].ts_ns) / 1e3, r->thread, r->fh, name,
+               (long long)r->pgno, (long long)r->size, (long long)r->result, r->duration_ns / 1e3);
+    }
+    free(recs);
+    if(in != stdin)
+        fclose(in);
+    return 0;
+}
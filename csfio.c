@@ -33,12 +33,42 @@
 
 //#pragma GCC diagnostic ignored
 
+/* O_DIRECT and statx */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+/* io_uring for csf_aio, where the kernel headers have it. liburing is not needed */
+#if !defined(CSF_IO_URING) && defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define CSF_IO_URING 1
+#endif
+#endif
+#ifndef CSF_IO_URING
+#define CSF_IO_URING 0
+#endif
+#if CSF_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
 #include "csfio.h"
 #include <arpa/inet.h>
 
@@ -65,22 +95,134 @@
 #define TRACE7(X,Y,Z,W,V,U,T)
 #endif
 
+/*
+ csf_trace_enable turns on a binary record of csf calls and page i/o, kept in a ring buffer
+ per thread, see csf_trace_dump. built in unless CSF_TRACE is defined to 0. while it is off,
+ a traced function only tests a flag on entry.
+ */
+#ifndef CSF_TRACE
+#define CSF_TRACE 1
+#endif
+#if CSF_TRACE
+#define TRACE_START(T)     uint64_t T = __atomic_load_n(&csf_trace_on, __ATOMIC_RELAXED) ? csf_now_ns() : 0
+#define TRACE_EVENT(T,EV,CTX,PGNO,SIZE,RESULT)     do { if(T) csf_trace_record(EV, (CTX)->fh, PGNO, SIZE, RESULT, T); } while(0)
+static int csf_trace_on;
+static void csf_trace_record(int event, int fh, int64_t pgno, int64_t size, int64_t result, uint64_t start);
+#else
+#define TRACE_START(T)
+#define TRACE_EVENT(T,EV,CTX,PGNO,SIZE,RESULT)
+#endif
+
 #define RETRYCOUNT 3
 
+#define CSF_PGNO_MAX ((off_t)INT64_MAX)
+
+#define CSF_AES_BLOCK_SZ 16   // the AES block, and the CTR counter step, whatever block size EVP reports for the mode
+
+#define CSF_GCM_TAG_SZ 16     // authentication tag at the end of each GCM page
+#define CSF_AAD_SZ (8 + CSF_FILE_ID_SZ) // associated data of a GCM page: page number, file id
+
+#define CSF_PAGE_BAD -1       // csf_decrypt_page: the page failed authentication
+
+#define CSF_CIPHER_COUNT 4    // CSF_CIPHER_ values are 0 up to this
+
+/* csf_pread of at most data_sz / CSF_PARTIAL_READ_RATIO bytes within one uncached page decrypts only the blocks it needs */
+#define CSF_PARTIAL_READ_RATIO 4
+
 static void *csf_malloc(int sz);
 static void csf_free(void * buf, int sz);
-static size_t csf_read_page(CSF_CTX *ctx, int pgno, void *data);
-static size_t csf_write_page(CSF_CTX *ctx, int pgno, void *data, size_t data_sz);
-static off_t csf_pageno_for_offset(CSF_CTX *ctx, int offset);
-static int csf_page_count_for_length(CSF_CTX *ctx, int length);
-static int csf_page_count_for_file(CSF_CTX *ctx);
+static int csf_read_page(CSF_CTX *ctx, off_t pgno, void *data);
+static size_t csf_write_page(CSF_CTX *ctx, off_t pgno, void *data, size_t data_sz);
+static int csf_decrypt_page(CSF_CTX *ctx, EVP_CIPHER_CTX *dctx, off_t pgno, const unsigned char *raw, unsigned char *scratch, void *data);
+static int csf_check_page_header(CSF_CTX *ctx, unsigned char *scratch);
+static int csf_read_partial(CSF_CTX *ctx, off_t pgno, unsigned char *out, int start, int len);
+static void csf_encrypt_page(CSF_CTX *ctx, EVP_CIPHER_CTX *ectx, off_t pgno, const void *data, size_t data_sz, unsigned char *scratch, unsigned char *raw);
+static void csf_page_aad(CSF_CTX *ctx, off_t pgno, unsigned char *aad);
+static void csf_page_iv(CSF_CTX *ctx, off_t pgno, unsigned char *iv);
+static ssize_t csf_read_raw(CSF_CTX *ctx, off_t start_offset, unsigned char *raw, size_t len);
+static ssize_t csf_sys_pread(CSF_CTX *ctx, void *buf, size_t len, off_t offset);
+static ssize_t csf_fd_pread(CSF_CTX *ctx, void *buf, size_t len, off_t offset);
+static ssize_t csf_fd_pwrite(CSF_CTX *ctx, const void *buf, size_t len, off_t offset);
+static int csf_direct_init(CSF_CTX *ctx);
+static void *csf_malloc_io(CSF_CTX *ctx, int sz);
+static void *csf_buf_get(CSF_CTX *ctx, size_t sz);
+static void csf_buf_put(CSF_CTX *ctx, void *buf, size_t sz);
+static int csf_lend(CSF_CTX *ctx);
+static void csf_return(CSF_CTX *ctx);
+static void csf_batch_release(CSF_CTX *ctx);
+static ssize_t csf_sys_pwrite(CSF_CTX *ctx, const void *buf, size_t len, off_t offset);
+static uint64_t csf_now_ns(void);
+static ssize_t csf_write_raw(CSF_CTX *ctx, off_t start_offset, unsigned char *raw, size_t len);
+static int csf_extend_raw(CSF_CTX *ctx, off_t len);
+static int csf_cipher_init(CSF_CTX *ctx);
+static void csf_ctr_iv(unsigned char *out, const unsigned char *iv, uint64_t blk);
+static int csf_map_update(CSF_CTX *ctx);
+static void csf_map_release(CSF_CTX *ctx);
+static const unsigned char *csf_map_range(CSF_CTX *ctx, off_t offset, size_t len);
+static int csf_page_is_hole(const unsigned char *raw, size_t len);
+static void csf_cache_update(CSF_CTX *ctx, off_t pgno, const void *data, int data_sz);
+static off_t csf_pageno_for_offset(CSF_CTX *ctx, off_t offset);
+static off_t csf_page_count_for_length(CSF_CTX *ctx, off_t length);
+static off_t csf_page_count_for_file(CSF_CTX *ctx);
 
 static void print_iv(unsigned char *iv, int pgno);
 static void print_header(unsigned char *header, int pgno);
 static size_t lower_cutoff(size_t req_end, size_t page_end, size_t file_end);
 
-static size_t csf_write_header(CSF_CTX *ctx);
+static size_t csf_write_header(CSF_CTX *ctx, int size_valid);
 static int csf_read_header(CSF_CTX *ctx, CSF_FILE_HEADER *cfh);
+static int csf_load_header(CSF_CTX *ctx);
+static int csf_header_modify(CSF_CTX *ctx);
+static int csf_lock(CSF_CTX *ctx, off_t offset, size_t nbyte, int mode);
+static int csf_unlock(CSF_CTX *ctx);
+static int csf_mp_range(CSF_CTX *ctx, int type, off_t start, off_t len);
+static int csf_mp_lock(CSF_CTX *ctx, off_t offset, size_t nbyte, int mode);
+static int csf_mp_unlock(CSF_CTX *ctx);
+static void csf_mp_release(CSF_CTX *ctx);
+static int csf_shared_modify(CSF_CTX *ctx);
+static int csf_shared_flush(CSF_CTX *ctx);
+static int csf_file_release(CSF_FILE *file);
+static int csf_write_gap(CSF_CTX *ctx, off_t start_page, off_t file_sz, off_t page_count);
+static int csf_flush_dirty(CSF_CTX *ctx);
+static ssize_t csf_pwrite_all(CSF_CTX *ctx, off_t start_offset, const unsigned char *raw, size_t len);
+static int csf_sys_sync(CSF_CTX *ctx, int fd, int mode);
+static int csf_epoch_sync(CSF_CTX *ctx);
+static int csf_durable(CSF_CTX *ctx, size_t nbyte);
+static struct csf_group *csf_group_new(const CSF_CONFIG *config);
+static struct csf_group *csf_group_ref(struct csf_group *group);
+static void csf_group_free(struct csf_group *group);
+static int csf_group_commit(CSF_CTX *ctx, size_t nbyte);
+static int csf_journal_init(CSF_CTX *ctx, int fd);
+static int csf_journal_destroy(CSF_CTX *ctx);
+static int csf_journal_wanted(CSF_CTX *ctx, size_t nbyte, off_t offset);
+static int csf_journal_begin(CSF_CTX *ctx);
+static int csf_journal_capturing(CSF_CTX *ctx);
+static int csf_journal_add(CSF_CTX *ctx, off_t start_offset, const unsigned char *raw, size_t len);
+static int csf_journal_extend(CSF_CTX *ctx, off_t len);
+static int csf_journal_end(CSF_CTX *ctx, int ok);
+static int csf_journal_guard(CSF_CTX *ctx, off_t from, off_t to);
+
+static int csf_cache_init(CSF_CTX *ctx, int cache_pages, int cache_policy);
+static void csf_cache_destroy(CSF_CTX *ctx);
+static CSF_CACHE_ENTRY *csf_cache_lookup(CSF_CTX *ctx, off_t pgno);
+static CSF_CACHE_ENTRY *csf_cache_insert(CSF_CTX *ctx, off_t pgno);
+static void csf_cache_invalidate(CSF_CTX *ctx, off_t from_pgno, off_t to_pgno);
+static int csf_fetch_page(CSF_CTX *ctx, off_t pgno, unsigned char **data_out);
+static unsigned char *csf_blank_page(CSF_CTX *ctx, off_t pgno);
+static int csf_mark_dirty(CSF_CTX *ctx, off_t pgno, int data_sz);
+
+static int csf_pool_init(CSF_CTX *ctx, int workers);
+static void csf_pool_destroy(CSF_CTX *ctx);
+static int csf_ra_init(CSF_CTX *ctx, int window);
+static void csf_ra_destroy(CSF_CTX *ctx);
+static void csf_ra_note(CSF_CTX *ctx, off_t first, off_t last, off_t page_count);
+static int csf_ra_streaming(CSF_CTX *ctx);
+static int csf_ra_take(CSF_CTX *ctx, off_t pgno, unsigned char *data);
+static void csf_ra_invalidate(CSF_CTX *ctx, off_t from_pgno, off_t to_pgno);
+static int csf_batch_alloc(CSF_CTX *ctx);
+static void csf_batch_free(CSF_CTX *ctx);
+static int csf_batch_read(CSF_CTX *ctx, off_t pgno, int n, unsigned char *out, long long out_base, size_t out_len);
+static int csf_batch_write(CSF_CTX *ctx, off_t pgno, const unsigned char *data, int n);
 
 static void print_iv(unsigned char *iv, int pgno) {
     int i = 0;
@@ -108,6 +250,78 @@ static void print_header(unsigned char *hdr, int pgno) {
 }
 
 
+/* default settings used by csf_ctx_init */
+void csf_config_init(CSF_CONFIG *config) {
+    memset(config, 0, sizeof(CSF_CONFIG));
+    config->cache_pages = CSF_CACHE_DEFAULT;
+    config->cache_policy = CSF_CACHE_LRU;
+    config->parallel_pages = CSF_PARALLEL_DEFAULT_PAGES;
+    config->batch_pages = CSF_BATCH_DEFAULT_PAGES;
+    config->journal_fd = -1;
+}
+
+/*
+ * a key shared by reference between contexts. it keeps a keyed encrypt and decrypt context for
+ * each cipher it has been used with, which contexts copy. csf_cipher_init keys them on first use
+ */
+struct csf_key {
+    int refs;
+    int key_sz;                   // as given to csf_key_new
+    unsigned char key[64];        // the key, cut or zero padded to 32 bytes, then the XTS tweak key derived from it
+    pthread_mutex_t lock;         // guards ectx and dctx
+    EVP_CIPHER_CTX *ectx[CSF_CIPHER_COUNT];
+    EVP_CIPHER_CTX *dctx[CSF_CIPHER_COUNT];
+};
+
+/*
+ * a key for csf_ctx_init_key, made from key_sz bytes of keydata, of which the first 32 are used.
+ * XTS takes a second AES-256 key for the tweak, which is derived from the first with SHA-256,
+ * so that one 32 byte key opens files of any cipher.
+ * the key holds one reference, dropped with csf_key_free. it may be used from any thread.
+ * returns NULL if it could not be made
+ */
+CSF_KEY *csf_key_new(const unsigned char *keydata, int key_sz) {
+    CSF_KEY *key = csf_malloc(sizeof(CSF_KEY));
+    static const char label[] = "csfio xts tweak key";
+    EVP_MD_CTX *md;
+
+    if(key == NULL)
+        return NULL;
+    key->refs = 1;
+    key->key_sz = key_sz;
+    memcpy(key->key, keydata, (key_sz < 32) ? key_sz : 32);
+    pthread_mutex_init(&key->lock, NULL);
+    md = EVP_MD_CTX_new();
+    if(md == NULL || !EVP_DigestInit_ex(md, EVP_sha256(), NULL) || !EVP_DigestUpdate(md, label, sizeof(label) - 1) ||
+       !EVP_DigestUpdate(md, key->key, 32) || !EVP_DigestFinal_ex(md, key->key + 32, NULL)) {
+        EVP_MD_CTX_free(md);
+        csf_key_free(key);
+        return NULL;
+    }
+    EVP_MD_CTX_free(md);
+    return key;
+}
+
+/* take another reference to key. returns key */
+CSF_KEY *csf_key_ref(CSF_KEY *key) {
+    __atomic_add_fetch(&key->refs, 1, __ATOMIC_RELAXED);
+    return key;
+}
+
+/* drop a reference to key. the last one frees it */
+void csf_key_free(CSF_KEY *key) {
+    int i;
+
+    if(key == NULL || __atomic_sub_fetch(&key->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    for(i = 0; i < CSF_CIPHER_COUNT; i++) {
+        EVP_CIPHER_CTX_free(key->ectx[i]);
+        EVP_CIPHER_CTX_free(key->dctx[i]);
+    }
+    pthread_mutex_destroy(&key->lock);
+    csf_free(key, sizeof(CSF_KEY));
+}
+
 /*
  * create a CSF context - initialize enc state and bounds for page, data, header sizes
  * given:
@@ -117,112 +331,808 @@ static void print_header(unsigned char *hdr, int pgno) {
  *  page size
  */
 int csf_ctx_init(CSF_CTX **ctx_out, int fh, unsigned char *keydata, int key_sz, int page_sz, int flags) {
-    EVP_CIPHER_CTX ectx;
+    return csf_ctx_init_ex(ctx_out, fh, keydata, key_sz, page_sz, flags, NULL);
+}
+
+/*
+ * as csf_ctx_init, with optional settings for the page cache.
+ * config may be NULL, in which case the csf_config_init defaults apply
+ */
+int csf_ctx_init_ex(CSF_CTX **ctx_out, int fh, unsigned char *keydata, int key_sz, int page_sz, int flags, const CSF_CONFIG *config) {
+    CSF_KEY *key = csf_key_new(keydata, key_sz);
+    CSF_CONFIG defaults;
+    int rc;
+
+    if(key == NULL)
+        return -1;
+    // a context with a key of its own keeps a cache by default
+    if(config == NULL || config->cache_pages == CSF_CACHE_DEFAULT) {
+        if(config)
+            defaults = *config;
+        else
+            csf_config_init(&defaults);
+        defaults.cache_pages = CSF_CACHE_DEFAULT_PAGES;
+        config = &defaults;
+    }
+    rc = csf_ctx_init_key(ctx_out, fh, key, page_sz, flags, config);
+    csf_key_free(key);
+    return rc;
+}
+
+/*
+ * as csf_ctx_init_ex, with a key from csf_key_new. the context takes a reference to the key,
+ * so the caller may free its own once this returns. it has no page cache unless
+ * config->cache_pages asks for one, see CSF_CACHE_DEFAULT
+ */
+int csf_ctx_init_key(CSF_CTX **ctx_out, int fh, CSF_KEY *key, int page_sz, int flags, const CSF_CONFIG *config) {
     CSF_CTX *ctx;
+    CSF_CONFIG defaults;
+    int rc, cache_pages;
+
+    if(config == NULL) {
+        csf_config_init(&defaults);
+        config = &defaults;
+    }
+    /* multi_process mode does without what would keep pages or the size past a call, or outside its locks */
+    if(config->multi_process) {
+        defaults = *config;
+        defaults.write_back = 0;
+        defaults.readahead_pages = 0;
+        defaults.mmap = 0;
+        defaults.direct = 0;
+        config = &defaults;
+    }
+    /* nor would a page held back in write back mode be durable, or journaled, when its write returns */
+    if(config->write_back && (config->durability != CSF_DURABLE_NONE || config->journal_fd >= 0)) {
+        if(config != &defaults)
+            defaults = *config;
+        defaults.write_back = 0;
+        config = &defaults;
+    }
+    // a replay could undo what other processes wrote since
+    if(config->multi_process && config->journal_fd >= 0) {
+        errno = EINVAL;
+        return -1;
+    }
 
     TRACE2("in csf_ctx_init fh=%d\n", fh);
     ctx = csf_malloc(sizeof(CSF_CTX));
     ctx->seek_ptr = ctx->file_sz = 0;
     ctx->fh = fh;
 
-    ctx->key_sz = key_sz;
-    ctx->key_data = csf_malloc(ctx->key_sz);
-    memcpy(ctx->key_data, keydata, ctx->key_sz);
-
-    EVP_EncryptInit(&ectx, CIPHER, ctx->key_data, NULL);
-    ctx->block_sz = EVP_CIPHER_CTX_block_size(&ectx);
-    ctx->iv_sz = EVP_CIPHER_CTX_iv_length(&ectx);
+    ctx->key = csf_key_ref(key);
+    ctx->key_sz = key->key_sz;
 
     /* the combined page size includes the size of the initialization
      vector, an integer for the count of bytes on page, and the data block */
     ctx->page_sz = page_sz;
 
-    /* ensure the page header allocation ends on an even block alignment */
-    ctx->page_header_sz = (sizeof(CSF_PAGE_HEADER) % ctx->block_sz == 0) ?
-    (sizeof(CSF_PAGE_HEADER) / ctx->block_sz) :
-    (sizeof(CSF_PAGE_HEADER) / ctx->block_sz) + ctx->block_sz;
+    /* in O_DIRECT mode the buffers pages are read into and written from are aligned for it */
+    if(config->direct && csf_direct_init(ctx) < 0) {
+        csf_ctx_destroy(ctx);
+        return -1;
+    }
+
+    /* a new file gets the configured cipher and header version, an existing one keeps those of its header */
+    ctx->cipher = config->cipher;
+    ctx->hdr_version = config->random_iv ? 0 : VERSION_1004;
+    /* in multi_process mode a new file gets its header at once, under the header lock, so that
+       every process loads the same one. the size is taken from the header at the first call */
+    ctx->multi_process = config->multi_process;
+    ctx->lock_from = -1;
+    if(ctx->multi_process && csf_mp_range(ctx, F_WRLCK, 0, HDR_SZ) < 0) {
+        csf_ctx_destroy(ctx);
+        return -1;
+    }
+    csf_load_header(ctx);
+    /* O_DIRECT transfers are whole blocks: the pages of the file must start on one */
+    if(ctx->direct_align && ctx->hdr_sz % ctx->direct_align != 0) {
+        TRACE3("csf_ctx_init(%d), pages at %d not block aligned for O_DIRECT\n", fh, ctx->hdr_sz);
+        csf_ctx_destroy(ctx);
+        errno = EINVAL;
+        return -1;
+    }
+    if(ctx->multi_process) {
+        if(!ctx->hdr_size_field)
+            errno = EINVAL;
+        rc = (ctx->hdr_size_field && (ctx->file_header_check || (int)csf_write_header(ctx, 1) == HDR_SZ)) ? 0 : -1;
+        csf_mp_range(ctx, F_UNLCK, 0, HDR_SZ);
+        ctx->file_sz = -1;
+        if(rc < 0) {
+            csf_ctx_destroy(ctx);
+            return -1;
+        }
+    }
+    /* a write the journal holds is made again before anything is read */
+    if(config->journal_fd >= 0 && csf_journal_init(ctx, config->journal_fd) < 0) {
+        csf_ctx_destroy(ctx);
+        return -1;
+    }
+    if(csf_cipher_init(ctx) < 0) {
+        csf_ctx_destroy(ctx);
+        return -1;
+    }
+    ctx->block_sz = EVP_CIPHER_CTX_block_size(ctx->ectx);
+    ctx->iv_sz = EVP_CIPHER_CTX_iv_length(ctx->ectx);
+
+    if(ctx->cipher == CSF_CIPHER_AES_256_GCM) {
+        /* the tag at the end of the page stands in for the magic: the page header is data_sz only */
+        ctx->tag_sz = CSF_GCM_TAG_SZ;
+        ctx->page_header_sz = sizeof(int32_t);
+    } else {
+        /* ensure the page header allocation ends on an even block alignment.
+           CTR and XTS have a block size of 1: the page header takes its own 8 bytes */
+        ctx->page_header_sz = (sizeof(CSF_PAGE_HEADER) % ctx->block_sz == 0) ?
+        (sizeof(CSF_PAGE_HEADER) / ctx->block_sz) :
+        (sizeof(CSF_PAGE_HEADER) / ctx->block_sz) + ctx->block_sz;
+    }
 
     /* determine unused space avaliable for data */
-    ctx->data_sz = ctx->page_sz - ctx->iv_sz - ctx->page_header_sz;
+    ctx->data_sz = ctx->page_sz - ctx->iv_sz - ctx->page_header_sz - ctx->tag_sz;
 
     assert(ctx->iv_sz %  ctx->block_sz == 0);
     assert(ctx->page_header_sz %  ctx->block_sz == 0);
     assert(ctx->data_sz %  ctx->block_sz == 0);
     assert(ctx->page_sz %  ctx->block_sz == 0);
 
-    ctx->page_buffer = csf_malloc(ctx->page_sz);
-    ctx->csf_buffer = csf_malloc(ctx->page_sz);
-    ctx->scratch_buffer = csf_malloc(ctx->page_sz);
-
-    EVP_CIPHER_CTX_cleanup(&ectx);
-
     ctx->encrypted=1;
-    ctx->file_header_check=0;
 
     ctx->fileFlag = flags;
     ctx->seekPastEndOfFile = 0;
 
+    /* write back keeps the dirty page in the cache, so it needs at least one slot */
+    ctx->write_back = config->write_back;
+    ctx->dirty_slot = -1;
+    ctx->partial_pgno = -1;
+    cache_pages = (config->cache_pages == CSF_CACHE_DEFAULT) ? 0 : config->cache_pages;
+    if(csf_cache_init(ctx, (ctx->write_back && cache_pages < 1) ? 1 : cache_pages, config->cache_policy) < 0) {
+        csf_ctx_destroy(ctx);
+        return -1;
+    }
+
+    ctx->durability = config->durability;
+    if(ctx->durability == CSF_DURABLE_GROUP && (ctx->group = csf_group_new(config)) == NULL) {
+        csf_ctx_destroy(ctx);
+        return -1;
+    }
+
+    ctx->parallel_pages = config->parallel_pages > 0 ? config->parallel_pages : 1;
+    ctx->batch_pages = config->batch_pages > 0 ? config->batch_pages : 1;
+    if(config->workers > 0 && csf_pool_init(ctx, config->workers) < 0) {
+        csf_ctx_destroy(ctx);
+        return -1;
+    }
+
+    /* a file that cannot be mapped, say one opened write only, is read with pread */
+    ctx->map_mode = config->mmap;
+    if(ctx->map_mode)
+        csf_map_update(ctx);
+
+    if(config->readahead_pages > 0 && csf_ra_init(ctx, config->readahead_pages) < 0) {
+        csf_ctx_destroy(ctx);
+        return -1;
+    }
+
     TRACE7("csf_init() ctx->page_header_sz=%d ctx->data_sz=%d, ctx->page_sz=%d, ctx->block_sz=%d, ctx->iv_sz=%d, ctx->key_sz=%d\n", ctx->page_header_sz, ctx->data_sz, ctx->page_sz, ctx->block_sz, ctx->iv_sz, ctx->key_sz);
 
     *ctx_out = ctx;
     return 0;
 }
 
+/* the EVP cipher for a CSF_CIPHER_ value, NULL if it is not known */
+static const EVP_CIPHER *csf_cipher_evp(int cipher) {
+    switch(cipher) {
+        case CSF_CIPHER_AES_256_CBC: return CIPHER;
+        case CSF_CIPHER_AES_256_CTR: return EVP_aes_256_ctr();
+        case CSF_CIPHER_AES_256_XTS: return EVP_aes_256_xts();
+        case CSF_CIPHER_AES_256_GCM: return EVP_aes_256_gcm();
+        default: return NULL;
+    }
+}
+
+/*
+ * set up the encrypt and decrypt contexts for ctx->cipher, once for each direction: pages only
+ * set a new IV. they are copies of the contexts the key keeps for the cipher, which are keyed
+ * by the first context to open a file of that cipher with the key, so the key schedule is
+ * expanded once. a VERSION_1004 file also gets the context that derives its page IVs, keyed
+ * with SHA-256 of a label, the key and the file id.
+ * returns 0, or -1 if the cipher is not known or could not be set up
+ */
+static int csf_cipher_init(CSF_CTX *ctx) {
+    CSF_KEY *key = ctx->key;
+    const EVP_CIPHER *cipher = csf_cipher_evp(ctx->cipher);
+    unsigned char iv_key[32];
+    static const char iv_label[] = "csfio iv key";
+    int rc = -1;
+
+    if(cipher == NULL) {
+        TRACE3("csf_cipher_init(%d), unknown cipher %d\n", ctx->fh, ctx->cipher);
+        errno = EINVAL;
+        return -1;
+    }
+    if(ctx->hdr_version == VERSION_1004) {
+        EVP_MD_CTX *md = EVP_MD_CTX_new();
+        if(md == NULL || !EVP_DigestInit_ex(md, EVP_sha256(), NULL) || !EVP_DigestUpdate(md, iv_label, sizeof(iv_label) - 1) ||
+           !EVP_DigestUpdate(md, key->key, 32) || !EVP_DigestUpdate(md, ctx->file_id, CSF_FILE_ID_SZ) ||
+           !EVP_DigestFinal_ex(md, iv_key, NULL)) {
+            EVP_MD_CTX_free(md);
+            goto done;
+        }
+        EVP_MD_CTX_free(md);
+        ctx->iv_ctx = EVP_CIPHER_CTX_new();
+        if(ctx->iv_ctx == NULL || !EVP_EncryptInit_ex(ctx->iv_ctx, EVP_aes_256_ecb(), NULL, iv_key, NULL))
+            goto done;
+        EVP_CIPHER_CTX_set_padding(ctx->iv_ctx, 0);
+    }
+
+    ctx->ectx = EVP_CIPHER_CTX_new();
+    ctx->dctx = EVP_CIPHER_CTX_new();
+    if(ctx->ectx == NULL || ctx->dctx == NULL)
+        goto done;
+    pthread_mutex_lock(&key->lock);
+    if(key->ectx[ctx->cipher] == NULL) {
+        EVP_CIPHER_CTX *ectx = EVP_CIPHER_CTX_new();
+        EVP_CIPHER_CTX *dctx = EVP_CIPHER_CTX_new();
+
+        if(ectx && dctx && EVP_CipherInit_ex(ectx, cipher, NULL, key->key, NULL, 1) && EVP_CipherInit_ex(dctx, cipher, NULL, key->key, NULL, 0)) {
+            EVP_CIPHER_CTX_set_padding(ectx, 0);
+            EVP_CIPHER_CTX_set_padding(dctx, 0);
+            key->ectx[ctx->cipher] = ectx;
+            key->dctx[ctx->cipher] = dctx;
+        } else {
+            EVP_CIPHER_CTX_free(ectx);
+            EVP_CIPHER_CTX_free(dctx);
+        }
+    }
+    if(key->ectx[ctx->cipher] && EVP_CIPHER_CTX_copy(ctx->ectx, key->ectx[ctx->cipher]) &&
+       EVP_CIPHER_CTX_copy(ctx->dctx, key->dctx[ctx->cipher]))
+        rc = 0;
+    pthread_mutex_unlock(&key->lock);
+
+done:
+    OPENSSL_cleanse(iv_key, sizeof(iv_key));
+    return rc;
+}
+
+/*
+ * a file shared by threads. each thread goes through a cursor of its own, a CSF_CTX with its own
+ * seek pointer, buffers and cipher contexts, which shares the plaintext size, the header state
+ * and the page IV counter with the other cursors of the file.
+ * calls that stay within the file size hold extent shared, and lock the pages they touch, readers
+ * shared and writers exclusive, in CSF_FILE_LOCKS stripes of pages pgno % CSF_FILE_LOCKS. readers
+ * of any pages and writers of different pages go ahead together. calls that change the size,
+ * writes past the end, truncate and flush, hold extent exclusive.
+ * cursors have no page cache, write back, readahead, mmap or O_DIRECT, which would each need to
+ * be kept coherent between cursors: a page written through one is read from the file by the others
+ */
+#define CSF_FILE_LOCKS 64
+
+#define CSF_LOCK_READ  0
+#define CSF_LOCK_WRITE 1
+#define CSF_LOCK_FILE  2
+
+struct csf_file {
+    int refs;                     // the opener's, and one for each cursor
+    CSF_CTX *ctx;                 // loaded the header at open. writes it out when the last reference goes
+    CSF_CONFIG config;            // for the cursors
+    pthread_rwlock_t extent;
+    pthread_rwlock_t pages[CSF_FILE_LOCKS];
+    pthread_mutex_t lock;         // guards the first header write after a flush
+    off_t file_sz;                // plaintext size. changes under extent exclusive only
+    int hdr_dirty;                // as CSF_CTX.hdr_dirty, for the file
+    unsigned int generation;      // CSF_FILE_HEADER.generation, as last written by a cursor
+    uint64_t iv_gen;              // the next page IV generation, epoch << 32 | count, see csf_page_iv
+};
+
+/*
+ * open a file of fh for sharing between threads, with a key from csf_key_new and config as for
+ * csf_ctx_init_key, less the settings cursors do without. a new file gets its header now, so
+ * that all cursors load the same file id. reads and writes go through cursors from
+ * csf_cursor_open, and csf_file_close drops the caller's reference: the file is closed, and
+ * its header written with the size, once the last cursor is destroyed.
+ * returns NULL if the file could not be opened
+ */
+CSF_FILE *csf_file_open(int fh, CSF_KEY *key, int page_sz, int flags, const CSF_CONFIG *config) {
+    CSF_FILE *file = csf_malloc(sizeof(CSF_FILE));
+    int i;
+
+    if(file == NULL)
+        return NULL;
+    // fcntl locks don't tell the threads of one process apart, and cursors would share the journal
+    if(config && (config->multi_process || config->journal_fd >= 0)) {
+        csf_free(file, sizeof(CSF_FILE));
+        errno = EINVAL;
+        return NULL;
+    }
+    if(config)
+        file->config = *config;
+    else
+        csf_config_init(&file->config);
+    file->config.cache_pages = 0;
+    file->config.write_back = 0;
+    file->config.readahead_pages = 0;
+    file->config.mmap = 0;
+    file->config.direct = 0;
+    if(csf_ctx_init_key(&file->ctx, fh, key, page_sz, flags, &file->config) < 0) {
+        csf_free(file, sizeof(CSF_FILE));
+        return NULL;
+    }
+    if((file->ctx->hdr_size_field && !file->ctx->file_header_check && (int)csf_write_header(file->ctx, 1) < HDR_SZ) ||
+       csf_file_size(file->ctx) < 0) {
+        csf_ctx_destroy(file->ctx);
+        csf_free(file, sizeof(CSF_FILE));
+        return NULL;
+    }
+    file->refs = 1;
+    file->file_sz = file->ctx->file_sz;
+    file->iv_gen = (uint64_t)file->ctx->iv_epoch << 32;
+    file->generation = file->ctx->generation;
+    pthread_rwlock_init(&file->extent, NULL);
+    for(i = 0; i < CSF_FILE_LOCKS; i++)
+        pthread_rwlock_init(&file->pages[i], NULL);
+    pthread_mutex_init(&file->lock, NULL);
+    return file;
+}
+
+/*
+ * a new cursor of file, for one thread at a time. it is used as any other context, and
+ * destroyed with csf_ctx_destroy. its seek pointer starts at 0.
+ * returns 0, or -1 if it could not be made
+ */
+int csf_cursor_open(CSF_CTX **ctx_out, CSF_FILE *file) {
+    CSF_CTX *ctx;
+
+    if(csf_ctx_init_key(&ctx, file->ctx->fh, file->ctx->key, file->ctx->page_sz, file->ctx->fileFlag, &file->config) < 0)
+        return -1;
+    // the cursors of a file commit together
+    if(ctx->group) {
+        csf_group_free(ctx->group);
+        ctx->group = csf_group_ref(file->ctx->group);
+    }
+    __atomic_add_fetch(&file->refs, 1, __ATOMIC_RELAXED);
+    ctx->shared = file;
+    *ctx_out = ctx;
+    return 0;
+}
+
+/* drop the reference csf_file_open gave. returns -1 if this closed the file, and its header could not be written */
+int csf_file_close(CSF_FILE *file) {
+    return file ? csf_file_release(file) : 0;
+}
+
+static int csf_file_release(CSF_FILE *file) {
+    CSF_CTX *ctx = file->ctx;
+    int i, rc = 0;
+
+    if(__atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return 0;
+    // no cursors are left: record the size in the header, as csf_flush does
+    ctx->file_sz = file->file_sz;
+    ctx->iv_epoch = file->iv_gen >> 32;
+    ctx->generation = file->generation;
+    if(file->hdr_dirty && (int)csf_write_header(ctx, 1) < HDR_SZ)
+        rc = -1;
+    if(csf_ctx_destroy(ctx) < 0)
+        rc = -1;
+    pthread_rwlock_destroy(&file->extent);
+    for(i = 0; i < CSF_FILE_LOCKS; i++)
+        pthread_rwlock_destroy(&file->pages[i]);
+    pthread_mutex_destroy(&file->lock);
+    csf_free(file, sizeof(CSF_FILE));
+    return rc;
+}
+
+/*
+ * take the locks for a call on a cursor, reading (CSF_LOCK_READ) or writing (CSF_LOCK_WRITE)
+ * nbyte bytes at plaintext offset, or on the whole file (CSF_LOCK_FILE). a write past the end
+ * of file takes the whole file. ctx->file_sz is the file's, for the length of the call.
+ * calls nest: only the outermost one locks. does nothing for a context of its own
+ */
+static int csf_lock(CSF_CTX *ctx, off_t offset, size_t nbyte, int mode) {
+    CSF_FILE *file = ctx->shared;
+    off_t end = offset + nbyte, pgno;
+    int i;
+
+    if(ctx->multi_process)
+        return csf_mp_lock(ctx, offset, nbyte, mode);
+    if(file == NULL || ctx->locked++ > 0)
+        return 0;
+    ctx->lock_mask = 0;
+    ctx->lock_excl = 0;
+    if(mode != CSF_LOCK_FILE) {
+        pthread_rwlock_rdlock(&file->extent);
+        if(mode == CSF_LOCK_WRITE && end > file->file_sz) {
+            pthread_rwlock_unlock(&file->extent);
+            mode = CSF_LOCK_FILE;
+        } else {
+            if(end > file->file_sz)
+                end = file->file_sz;
+            if(end > offset && (end - 1) / ctx->data_sz - offset / ctx->data_sz + 1 >= CSF_FILE_LOCKS) {
+                ctx->lock_mask = ~(uint64_t)0;
+            } else if(end > offset) {
+                for(pgno = offset / ctx->data_sz; pgno <= (end - 1) / ctx->data_sz; pgno++)
+                    ctx->lock_mask |= (uint64_t)1 << (pgno % CSF_FILE_LOCKS);
+            }
+            // in stripe order, so that calls over the same stripes can't deadlock
+            for(i = 0; i < CSF_FILE_LOCKS; i++) {
+                if(!(ctx->lock_mask & ((uint64_t)1 << i)))
+                    continue;
+                if(mode == CSF_LOCK_WRITE)
+                    pthread_rwlock_wrlock(&file->pages[i]);
+                else
+                    pthread_rwlock_rdlock(&file->pages[i]);
+            }
+        }
+    }
+    if(mode == CSF_LOCK_FILE) {
+        pthread_rwlock_wrlock(&file->extent);
+        ctx->lock_excl = 1;
+    }
+    ctx->file_sz = file->file_sz;
+    return 0;
+}
+
+/*
+ * the end of a call that started with csf_lock. a call that held the whole file passes on the size it left.
+ * returns 0, or -1 if the header could not be written in multi_process mode
+ */
+static int csf_unlock(CSF_CTX *ctx) {
+    CSF_FILE *file = ctx->shared;
+    int i;
+
+    if(ctx->multi_process)
+        return csf_mp_unlock(ctx);
+    if(file == NULL || --ctx->locked > 0)
+        return 0;
+    if(ctx->lock_excl)
+        file->file_sz = ctx->file_sz;
+    for(i = 0; i < CSF_FILE_LOCKS; i++)
+        if(ctx->lock_mask & ((uint64_t)1 << i))
+            pthread_rwlock_unlock(&file->pages[i]);
+    pthread_rwlock_unlock(&file->extent);
+    return 0;
+}
+
+/* csf_header_modify for a cursor: the first writer after a flush starts the new epoch and writes the header, for all */
+static int csf_shared_modify(CSF_CTX *ctx) {
+    CSF_FILE *file = ctx->shared;
+    int rc = 0;
+
+    if(!ctx->hdr_size_field || __atomic_load_n(&file->hdr_dirty, __ATOMIC_ACQUIRE))
+        return 0;
+    pthread_mutex_lock(&file->lock);
+    if(!file->hdr_dirty) {
+        uint64_t gen = __atomic_load_n(&file->iv_gen, __ATOMIC_RELAXED);
+
+        if(ctx->iv_ctx) {
+            gen = ((gen >> 32) + 1) << 32;
+            __atomic_store_n(&file->iv_gen, gen, __ATOMIC_RELAXED);
+        }
+        ctx->iv_epoch = gen >> 32;
+        ctx->generation = file->generation;
+        if((int)csf_write_header(ctx, 0) < HDR_SZ || csf_epoch_sync(ctx) < 0)
+            rc = -1;
+        else
+            __atomic_store_n(&file->hdr_dirty, 1, __ATOMIC_RELEASE);
+        file->generation = ctx->generation;
+    }
+    pthread_mutex_unlock(&file->lock);
+    return rc;
+}
+
+/* the header part of csf_flush for a cursor, which holds the whole file */
+static int csf_shared_flush(CSF_CTX *ctx) {
+    CSF_FILE *file = ctx->shared;
+
+    if(!file->hdr_dirty)
+        return 0;
+    ctx->iv_epoch = file->iv_gen >> 32;
+    ctx->generation = file->generation;
+    if((int)csf_write_header(ctx, 1) < HDR_SZ)
+        return -1;
+    file->generation = ctx->generation;
+    file->hdr_dirty = 0;
+    return 0;
+}
+
+/*
+ * multi_process mode. processes coordinate through fcntl locks on the file: the header bytes
+ * guard the size and the generation, and the bytes of each page guard the page. a call takes
+ * the header lock, checks the generation and takes the locks of its pages. calls that stay
+ * within the file size let go of the header then, once a writer has recorded its change: so
+ * readers of any pages and writers of different pages, in any process, go ahead together.
+ * writes past the end and truncate keep the header, and all pages from the end of file on,
+ * until they are done, and record the new size as they let go. every header write bumps the
+ * generation, so a context that finds it changed drops its cached pages and size.
+ * the locks are open file description locks where the system has them, so contexts of one
+ * process on files opened separately keep each other out as well
+ */
+#ifdef F_OFD_SETLKW
+#define CSF_SETLKW F_OFD_SETLKW
+#else
+#define CSF_SETLKW F_SETLKW
+#endif
+
+/* set an fcntl lock of type (F_RDLCK, F_WRLCK, or F_UNLCK) on len bytes of the file from start, to the end for len 0, waiting for it */
+static int csf_mp_range(CSF_CTX *ctx, int type, off_t start, off_t len) {
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = len;
+    ctx->stats.syscalls++;
+    while(fcntl(ctx->fh, CSF_SETLKW, &fl) < 0) {
+        if(errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+/* lock pages [from, to) of the file, to the end for CSF_PGNO_MAX, and note them for csf_mp_unlock */
+static int csf_mp_pages(CSF_CTX *ctx, int type, off_t from, off_t to) {
+    if(csf_mp_range(ctx, type, ctx->hdr_sz + from * ctx->page_sz, (to == CSF_PGNO_MAX) ? 0 : (to - from) * ctx->page_sz) < 0)
+        return -1;
+    ctx->lock_from = from;
+    ctx->lock_to = to;
+    return 0;
+}
+
+/*
+ * with the header lock held, see whether another context changed the file since this one last
+ * looked: if so, drop the cached pages, and take the size from the header. a header a context
+ * outside multi_process mode wrote without the size leaves it to be found from the last page,
+ * with all pages locked for reading.
+ * returns 0, or -1 if the header could not be read
+ */
+static int csf_mp_sync(CSF_CTX *ctx) {
+    CSF_FILE_HEADER cfh;
+
+    if(csf_read_header(ctx, &cfh) < HDR_SZ || cfh.magic != FILE_MAGIC_NUM) {
+        if(errno == 0)
+            errno = EIO;
+        return -1;
+    }
+    if(cfh.generation == ctx->generation && ctx->file_sz >= 0)
+        return 0;
+    if(ctx->file_sz >= 0)
+        ctx->stats.remote_changes++;
+    csf_cache_invalidate(ctx, 0, CSF_PGNO_MAX);
+    ctx->partial_pgno = -1;
+    ctx->generation = cfh.generation;
+    ctx->hdr_epoch = cfh.write_epoch;
+    if(cfh.flags & (CSF_HDR_SIZE_VALID | CSF_HDR_SIZE_SHARED)) {
+        ctx->file_sz = ((off_t)cfh.file_sz_hi << 32) | cfh.file_sz_lo;
+        return 0;
+    }
+    ctx->file_sz = -1;
+    if(csf_mp_pages(ctx, F_RDLCK, 0, CSF_PGNO_MAX) < 0)
+        return -1;
+    csf_file_size(ctx);
+    csf_mp_range(ctx, F_UNLCK, ctx->hdr_sz, 0);
+    ctx->lock_from = -1;
+    return (ctx->file_sz < 0) ? -1 : 0;
+}
+
+/*
+ * csf_lock in multi_process mode. a write within the file size is recorded in the header
+ * before it is made, one past the end once it is done, by csf_mp_unlock
+ */
+static int csf_mp_lock(CSF_CTX *ctx, off_t offset, size_t nbyte, int mode) {
+    off_t end = offset + nbyte, page_count;
+    int rc;
+
+    if(ctx->locked++ > 0)
+        return 0;
+    ctx->lock_excl = 0;
+    ctx->lock_from = -1;
+    if(csf_mp_range(ctx, (mode == CSF_LOCK_READ) ? F_RDLCK : F_WRLCK, 0, ctx->hdr_sz) < 0 || csf_mp_sync(ctx) < 0)
+        goto fail;
+    page_count = csf_page_count_for_length(ctx, ctx->file_sz);
+    if(mode == CSF_LOCK_WRITE && end > ctx->file_sz)
+        mode = CSF_LOCK_FILE;
+    if(mode == CSF_LOCK_FILE) {
+        // from the page holding offset, or the end page of the file that a write past it fills up
+        off_t from = csf_pageno_for_offset(ctx, offset);
+
+        if(from > page_count - 1)
+            from = (page_count > 0) ? page_count - 1 : 0;
+        ctx->lock_excl = 1;
+        if(csf_mp_pages(ctx, F_WRLCK, from, CSF_PGNO_MAX) < 0)
+            goto fail;
+        return 0;
+    }
+    if(end > ctx->file_sz)
+        end = ctx->file_sz;
+    if(end > offset && csf_mp_pages(ctx, (mode == CSF_LOCK_READ) ? F_RDLCK : F_WRLCK, offset / ctx->data_sz, (end - 1) / ctx->data_sz + 1) < 0)
+        goto fail;
+    if(mode == CSF_LOCK_WRITE) {
+        rc = ctx->hdr_dirty ? (((int)csf_write_header(ctx, 0) < HDR_SZ) ? -1 : 0) : csf_header_modify(ctx);
+        if(rc < 0)
+            goto fail;
+    }
+    csf_mp_range(ctx, F_UNLCK, 0, ctx->hdr_sz);
+    return 0;
+
+fail:
+    rc = errno;
+    ctx->lock_excl = 1;
+    csf_mp_release(ctx);
+    ctx->locked = 0;
+    errno = rc;
+    return -1;
+}
+
+/* let go of the page locks of the call, and of the header if it is still held */
+static void csf_mp_release(CSF_CTX *ctx) {
+    if(ctx->lock_from >= 0)
+        csf_mp_range(ctx, F_UNLCK, ctx->hdr_sz + ctx->lock_from * ctx->page_sz,
+                     (ctx->lock_to == CSF_PGNO_MAX) ? 0 : (ctx->lock_to - ctx->lock_from) * ctx->page_sz);
+    if(ctx->lock_excl)
+        csf_mp_range(ctx, F_UNLCK, 0, ctx->hdr_sz);
+    ctx->lock_from = -1;
+    ctx->lock_excl = 0;
+}
+
+/* csf_unlock in multi_process mode */
+static int csf_mp_unlock(CSF_CTX *ctx) {
+    int rc = 0;
+
+    if(--ctx->locked > 0)
+        return 0;
+    // a change made with the header held is recorded as it is let go. csf_flush has written its own
+    if(ctx->lock_excl && ctx->hdr_dirty && (int)csf_write_header(ctx, 0) < HDR_SZ)
+        rc = -1;
+    csf_mp_release(ctx);
+    return rc;
+}
+
+/* CSF_FILE_HEADER.cipher for a CSF_CIPHER_ value */
+static unsigned int csf_cipher_hex(int cipher) {
+    switch(cipher) {
+        case CSF_CIPHER_AES_256_CTR: return CIPHER_HEX_CTR;
+        case CSF_CIPHER_AES_256_XTS: return CIPHER_HEX_XTS;
+        case CSF_CIPHER_AES_256_GCM: return CIPHER_HEX_GCM;
+        default: return CIPHER_HEX_STRING;
+    }
+}
+
+/* the CSF_CIPHER_ value for CSF_FILE_HEADER.cipher, -1 if it is not known */
+static int csf_cipher_from_hex(unsigned int hex) {
+    switch(hex) {
+        case CIPHER_HEX_STRING: return CSF_CIPHER_AES_256_CBC;
+        case CIPHER_HEX_CTR: return CSF_CIPHER_AES_256_CTR;
+        case CIPHER_HEX_XTS: return CSF_CIPHER_AES_256_XTS;
+        case CIPHER_HEX_GCM: return CSF_CIPHER_AES_256_GCM;
+        default: return -1;
+    }
+}
+
+/* returns -1 if a dirty page could not be written out, or the journal not retired. the context is freed regardless */
 int csf_ctx_destroy(CSF_CTX *ctx) {
+    int rc = 0;
     if (ctx) {
-        csf_free(ctx->page_buffer, ctx->page_sz);
-        csf_free(ctx->csf_buffer, ctx->page_sz);
-        csf_free(ctx->scratch_buffer, ctx->page_sz);
-        csf_free(ctx->key_data, ctx->key_sz);
+        CSF_FILE *shared = ctx->shared;
+        if(ctx->cache || (ctx->multi_process && ctx->hdr_dirty))
+            rc = csf_flush(ctx);
+        if(csf_journal_destroy(ctx) < 0)
+            rc = -1;
+        csf_group_free(ctx->group);
+        csf_ra_destroy(ctx);
+        csf_pool_destroy(ctx);
+        csf_batch_free(ctx);
+        csf_cache_destroy(ctx);
+        csf_map_release(ctx);
+        csf_key_free(ctx->key);
+        // the file handle is the caller's: leave it as it was given
+        if(ctx->direct_align)
+            fcntl(ctx->fh, F_SETFL, fcntl(ctx->fh, F_GETFL) & ~O_DIRECT);
+        if(ctx->ectx)
+            EVP_CIPHER_CTX_free(ctx->ectx);
+        if(ctx->dctx)
+            EVP_CIPHER_CTX_free(ctx->dctx);
+        if(ctx->iv_ctx)
+            EVP_CIPHER_CTX_free(ctx->iv_ctx);
         csf_free(ctx, sizeof(CSF_CTX));
+        if(shared && csf_file_release(shared) < 0)
+            rc = -1;
     }
-    return 0;
+    return rc;
 }
 
-/* initialize a file header */
-static int csf_create_file_header(CSF_CTX *ctx, CSF_FILE_HEADER *header) {
-    header->version  = htonl(VERSION_1001);
+/*
+ * initialize a file header of ctx->hdr_version, with the current plaintext size if size_valid is
+ * set, or in multi_process mode, and the next generation
+ */
+static int csf_create_file_header(CSF_CTX *ctx, CSF_FILE_HEADER *header, int size_valid) {
+    int with_size = size_valid || ctx->multi_process;
+
+    header->version  = htonl(ctx->hdr_version);
     header->magic    = htonl(FILE_MAGIC_NUM);
-    header->cipher   = htonl(CIPHER_HEX_STRING);
+    header->cipher   = htonl(csf_cipher_hex(ctx->cipher));
     header->pagesize = htonl(ctx->page_sz);
+    header->flags    = htonl((size_valid ? CSF_HDR_SIZE_VALID : 0) | (ctx->multi_process ? CSF_HDR_SIZE_SHARED : 0) |
+                             (ctx->hdr_sz != HDR_SZ ? CSF_HDR_PADDED : 0));
+    header->file_sz_hi = htonl(with_size ? (uint64_t)ctx->file_sz >> 32 : 0);
+    header->file_sz_lo = htonl(with_size ? (uint64_t)ctx->file_sz & 0xFFFFFFFF : 0);
+    memcpy(header->file_id, ctx->file_id, CSF_FILE_ID_SZ);
+    // an epoch another process started may be ahead of this context's
+    header->write_epoch = htonl(ctx->iv_epoch > ctx->hdr_epoch ? ctx->iv_epoch : ctx->hdr_epoch);
+    header->generation = htonl(ctx->generation + 1);
     return 0;
 }
 
 /*
  * determine the original file size given an encrypted file
- * the last page needs to be decrypted to determine its size
+ * the size is kept in ctx, and comes from the file header when it holds a valid one.
+ * otherwise the last page needs to be decrypted to determine its size, once.
  * returns -1 on failure to read file (header mismatch or I/O error)
  */
 off_t csf_file_size(CSF_CTX *ctx) {
     TRACE1("in csf_file_size\n");
-    int page_count = csf_page_count_for_file(ctx);
-    int data_sz = csf_read_page(ctx, page_count-1, ctx->page_buffer);
+    // a cursor, or a context in multi_process mode, not in a call takes the size of its file
+    if((ctx->shared || ctx->multi_process) && ctx->locked == 0) {
+        off_t file_sz;
+
+        if(csf_lock(ctx, 0, 0, CSF_LOCK_READ) < 0)
+            return -1;
+        file_sz = ctx->file_sz;
+        csf_unlock(ctx);
+        return file_sz;
+    }
+    if(ctx->file_sz >= 0)
+        return ctx->file_sz;
+
+    if(csf_lend(ctx) < 0)
+        return -1;
+    off_t page_count = csf_page_count_for_file(ctx);
+    unsigned char *page;
+    int data_sz = csf_fetch_page(ctx, page_count-1, &page);
+    csf_return(ctx);
     if(data_sz<0)
         return -1;
 
     if (page_count ==0) {
-        return data_sz;
+        ctx->file_sz = data_sz;
+    } else {
+        ctx->file_sz = ((page_count - 1) * ctx->data_sz) + data_sz;
     }
-    return ((page_count - 1) * ctx->data_sz) + data_sz;
+    return ctx->file_sz;
 }
 
 /*
  * total number of csf pages in the encrypted file
- * save current seek pointer, seek to end of file to find length
- * reset the seek pointer to saved. what if someone else does read/write ?
+ * follows from the plaintext size once that is known. until then the length comes from fstat,
+ * so the fd seek pointer is left alone, or in mmap mode from the size of the mapping
  */
-static int csf_page_count_for_file(CSF_CTX *ctx) {
+static off_t csf_page_count_for_file(CSF_CTX *ctx) {
+    struct stat st;
+    off_t count = 0;
+
     TRACE1("in csf_page_count_for_file\n");
-    size_t cur_offset = lseek(ctx->fh, 0, SEEK_CUR);
-    size_t count = (lseek(ctx->fh, 0, SEEK_END) - HDR_SZ) / ctx->page_sz;
-    lseek(ctx->fh, cur_offset, SEEK_SET);
+    if(ctx->file_sz >= 0)
+        return csf_page_count_for_length(ctx, ctx->file_sz);
+
+    if(ctx->map) {
+        if(ctx->map_sz > ctx->hdr_sz)
+            count = (ctx->map_sz - ctx->hdr_sz) / ctx->page_sz;
+    } else {
+        ctx->stats.syscalls++;
+        if(fstat(ctx->fh, &st) == 0 && st.st_size > ctx->hdr_sz)
+            count = (st.st_size - ctx->hdr_sz) / ctx->page_sz;
+    }
+
+    // a dirty page appended in write back mode is not on disk yet
+    if(ctx->dirty_slot >= 0 && ctx->cache[ctx->dirty_slot].pgno >= count)
+        count = ctx->cache[ctx->dirty_slot].pgno + 1;
     return count;
 }
 
 /*
  * file offset -> csfio pageno in which it falls
  */
-static off_t csf_pageno_for_offset(CSF_CTX *ctx, int offset) {
+static off_t csf_pageno_for_offset(CSF_CTX *ctx, off_t offset) {
     TRACE1("in csf_pageno_for_offset\n");
     return (offset / ctx->data_sz);
 }
@@ -232,8 +1142,8 @@ static off_t csf_pageno_for_offset(CSF_CTX *ctx, int offset) {
  * extra page if not page aligned.
  * independant of initial offset.
  */
-static int csf_page_count_for_length(CSF_CTX *ctx, int length) {
-    int count = (length / ctx->data_sz);
+static off_t csf_page_count_for_length(CSF_CTX *ctx, off_t length) {
+    off_t count = (length / ctx->data_sz);
     TRACE1("in csf_page_count_for_length\n");
     if ( (length % ctx->data_sz) != 0 ) {
         count++;
@@ -242,13 +1152,73 @@ static int csf_page_count_for_length(CSF_CTX *ctx, int length) {
 }
 
 /*
- * is this correct ? it truncates the page numbers to the last page
- * but does it update the page size in the header ?
+ * set the plaintext size of the file to offset.
+ * shrinking drops the pages after the one holding the new end of file, and rewrites that page
+ * with its reduced data size. growing leaves a hole that reads as zeros, as a write past end
+ * of file does.
+ * returns 0 on success, -1 on failure
  */
-int csf_truncate(CSF_CTX *ctx, int offset) {
-    int true_offset = HDR_SZ + (csf_pageno_for_offset(ctx, offset) * ctx->page_sz);
-    TRACE4("csf_truncate(%d,%d), retval = %d\n", ctx->fh, offset, true_offset);
-    return ftruncate(ctx->fh, true_offset);
+static int csf_do_truncate(CSF_CTX *ctx, off_t offset) {
+    off_t pgno = csf_pageno_for_offset(ctx, offset);
+    int tail = offset % ctx->data_sz;
+    off_t file_sz = csf_file_size(ctx);
+    off_t true_offset;
+    int rc;
+    TRACE_START(tr);
+
+    if(file_sz < 0)
+        return -1;
+    if(offset > file_sz) {
+        unsigned char zero = 0;
+        rc = (csf_pwrite(ctx, &zero, 1, offset - 1) == 1) ? 0 : -1;
+        TRACE_EVENT(tr, CSF_TRACE_TRUNCATE, ctx, offset, 0, rc);
+        return rc;
+    }
+    if(csf_header_modify(ctx) < 0 || csf_flush_dirty(ctx) < 0)
+        return -1;
+
+    if(tail > 0) {
+        unsigned char *page;
+        if(csf_fetch_page(ctx, pgno, &page) < 0)
+            return -1;
+        memset(page + tail, 0, ctx->data_sz - tail);
+        if((int)csf_write_page(ctx, pgno, page, tail) < 0)
+            return -1;
+        pgno++;
+    }
+
+    true_offset = ctx->hdr_sz + (pgno * ctx->page_sz);
+    TRACE4("csf_truncate(%d,%lld), retval = %lld\n", ctx->fh, offset, true_offset);
+    csf_cache_invalidate(ctx, pgno, CSF_PGNO_MAX);
+    csf_ra_invalidate(ctx, pgno, CSF_PGNO_MAX);
+    ctx->file_sz = offset;
+    if(csf_journal_guard(ctx, true_offset, CSF_PGNO_MAX) < 0)
+        return -1;
+    ctx->stats.syscalls++;
+    rc = ftruncate(ctx->fh, true_offset);
+    // the mapping must not reach past the new end of file
+    if(ctx->map_mode)
+        csf_map_update(ctx);
+    TRACE_EVENT(tr, CSF_TRACE_TRUNCATE, ctx, offset, 0, rc);
+    return rc;
+}
+
+int csf_truncate(CSF_CTX *ctx, off_t offset) {
+    int rc;
+
+    if(csf_lend(ctx) < 0)
+        return -1;
+    if(csf_lock(ctx, offset, 0, CSF_LOCK_FILE) < 0) {
+        csf_return(ctx);
+        return -1;
+    }
+    rc = csf_do_truncate(ctx, offset);
+    if(csf_unlock(ctx) < 0)
+        rc = -1;
+    if(rc == 0 && csf_durable(ctx, 0) < 0)
+        rc = -1;
+    csf_return(ctx);
+    return rc;
 }
 
 /* FIXME - what happens when you seek past end of file? */
@@ -256,13 +1226,26 @@ int csf_truncate(CSF_CTX *ctx, int offset) {
 /* seek offset does not change in case of read error */
 off_t csf_seek(CSF_CTX *ctx, off_t offset, int whence) {
     off_t target_offset = 0;
-    int size=0;
+    off_t size=0;
+    int rc;
+    TRACE_START(tr);
 
     TRACE3("in csf_seek %ld %d\n", offset, whence);
-    switch(whence) {
-        case SEEK_SET:
-            target_offset = offset;
-            break;
+
+    // the writer is leaving its page; write it out. on failure the seek does not happen
+    if(csf_lend(ctx) < 0)
+        return -1;
+    rc = csf_flush_dirty(ctx);
+    csf_return(ctx);
+    if(rc < 0) {
+        TRACE_EVENT(tr, CSF_TRACE_SEEK, ctx, offset, whence, -1);
+        return -1;
+    }
+
+    switch(whence) {
+        case SEEK_SET:
+            target_offset = offset;
+            break;
         case SEEK_CUR:
             target_offset = ctx->seek_ptr + offset;
             break;
@@ -283,6 +1266,7 @@ off_t csf_seek(CSF_CTX *ctx, off_t offset, int whence) {
         ctx->seek_ptr = target_offset;
 
         TRACE5("csf_seek(%d,%lld,%d), ctx->seek_ptr = %lld\n", ctx->fh, offset, whence, ctx->seek_ptr);
+        TRACE_EVENT(tr, CSF_TRACE_SEEK, ctx, offset, whence, ctx->seek_ptr);
         return ctx->seek_ptr;
 //    }
 //    else {
@@ -301,36 +1285,37 @@ off_t csf_seek(CSF_CTX *ctx, off_t offset, int whence) {
  * first 16 bytes in the csf page is the IV
  * after that we have encrypted data, which includes both the page header and page data
  * page header is in the beginning of the decrypted buffer
+ * returns CSF_PAGE_BAD, with errno EBADMSG, if the page failed authentication
  */
-static size_t csf_read_page(CSF_CTX *ctx, int pgno, void *data) {
+static int csf_read_page(CSF_CTX *ctx, off_t pgno, void *data) {
 
     if (pgno < 0) {
         //If page number is negative that means file is empty.
         return 0;
     }
 
-    off_t start_offset = HDR_SZ + (pgno * ctx->page_sz);
-    off_t cur_offset =  lseek(ctx->fh, 0L, SEEK_CUR);
+    off_t start_offset = ctx->hdr_sz + (pgno * ctx->page_sz);
     int to_read = ctx->page_sz;
     size_t read_sz = 0;
-    CSF_PAGE_HEADER header;
+    int data_sz;
+    uint64_t start;
+    const unsigned char *raw = csf_map_range(ctx, start_offset, to_read);
+    TRACE_START(tr);
 
     TRACE1("in csf_read_page\n");
-    // go to right offset to read the page, if not already there
-    if(cur_offset != start_offset) {
-        cur_offset = lseek(ctx->fh, start_offset, SEEK_SET);
-    }
     int read_any_data = 0;
-    // read page in csf format
+    // in mmap mode the page is decrypted where it is mapped. otherwise
+    // read page in csf format, at its offset. the fd seek pointer is not used
     // error handling :
     // try three times. if we fail all three times, print error and return -1.
+    if(raw) {
+        read_sz = to_read;
+        ctx->stats.mapped_pages++;
+    } else {
+        raw = ctx->page_buffer;
+    }
     for(;read_sz < to_read;) {
-        ssize_t bytes_read;
-        int trycount = RETRYCOUNT;
-        errno = 0;
-        while( (bytes_read = read(ctx->fh, ctx->page_buffer + read_sz, to_read - read_sz)) <0 && trycount-- >0  ) {// try again
-            errno = 0;
-        }
+        ssize_t bytes_read = csf_sys_pread(ctx, ctx->page_buffer + read_sz, to_read - read_sz, start_offset + read_sz);
         if(bytes_read < 0) {
             // we have a read error after 3 tries.
             // if we have read partial data. there will be corruption on decryption.
@@ -356,35 +1341,95 @@ static size_t csf_read_page(CSF_CTX *ctx, int pgno, void *data) {
     // show the IV
     //print_iv(ctx->page_buffer, pgno);
 
-    if(ctx->encrypted) {
+    start = csf_now_ns();
+    data_sz = csf_decrypt_page(ctx, ctx->dctx, pgno, raw, ctx->scratch_buffer, data);
+    ctx->stats.cipher_ns += csf_now_ns() - start;
+    ctx->stats.pages_read++;
+    ctx->stats.pages_decrypted++;
+    if(data_sz == CSF_PAGE_BAD) {
+        ctx->stats.auth_failures++;
+        errno = EBADMSG;
+    }
 
-        EVP_CIPHER_CTX ectx;
-        void *out_ptr =  ctx->scratch_buffer;
-        int out_sz, cipher_sz = 0;
+    TRACE6("csf_read_page(%d,%lld,x), start_offset=%lld, read_sz=%ld, return=%ld\n", ctx->fh, pgno, start_offset, read_sz, data_sz);
+    TRACE_EVENT(tr, CSF_TRACE_READ_PAGE, ctx, pgno, data_sz, data_sz);
 
-        // pass in the cipher
-        EVP_CipherInit(&ectx, CIPHER, NULL, NULL, 0);
-        EVP_CIPHER_CTX_set_padding(&ectx, 0);
+    return data_sz;
+}
 
-        // pass in the key and IV, ask to decrypt
-        EVP_CipherInit(&ectx, NULL, ctx->key_data, ctx->page_buffer, 0);
+/*
+ * decrypt one csf page held in raw, page pgno of the file: the IV, then the encrypted page
+ * header and data, then for GCM the tag.
+ * dctx is a decrypt context already keyed for ctx. the header block is decrypted into scratch,
+ * and the whole data portion, ctx->data_sz bytes, straight into data. XTS takes the page as one
+ * data unit, so there the data goes through scratch too.
+ * a page that is all zeros is a hole left by a write past end of file: it is a full page of
+ * zeros and is not decrypted. GCM files have no holes, such a page fails authentication.
+ * bytes of data past the returned size are not meaningful.
+ * returns the data size from the page header, 0 if the header is not valid, or CSF_PAGE_BAD
+ * if a GCM page does not match its tag: it was changed, or belongs to another page or file.
+ * data is zeroed then. errno is left alone, as this runs on worker threads too
+ */
+static int csf_decrypt_page(CSF_CTX *ctx, EVP_CIPHER_CTX *dctx, off_t pgno, const unsigned char *raw, unsigned char *scratch, void *data) {
+    if(!ctx->tag_sz && csf_page_is_hole(raw, ctx->page_sz)) {
+        memset(data, 0, ctx->data_sz);
+        return ctx->data_sz;
+    }
+    if(ctx->encrypted && ctx->tag_sz) {
+        unsigned char aad[CSF_AAD_SZ];
+        int out_sz;
 
-        // output is in out_ptr, which is scratch_buffer; input is page_buffer+iv_sz of size (header_sz+data)
-        // printf("input is : %d ", ctx->page_header_sz + ctx->data_sz); print_iv(ctx->page_buffer + ctx->iv_sz, pgno);
-        EVP_CipherUpdate(&ectx, out_ptr + cipher_sz, &out_sz, ctx->page_buffer + ctx->iv_sz, ctx->page_header_sz + ctx->data_sz);
-        cipher_sz += out_sz;
-        EVP_CipherFinal(&ectx, out_ptr + cipher_sz, &out_sz);
-        cipher_sz += out_sz;
-        EVP_CIPHER_CTX_cleanup(&ectx);
+        // header and data are decrypted and authenticated in one pass, against the page number and file id
+        csf_page_aad(ctx, pgno, aad);
+        EVP_CipherInit_ex(dctx, NULL, NULL, NULL, raw, 0);
+        EVP_CipherUpdate(dctx, NULL, &out_sz, aad, CSF_AAD_SZ);
+        EVP_CipherUpdate(dctx, scratch, &out_sz, raw + ctx->iv_sz, ctx->page_header_sz);
+        EVP_CipherUpdate(dctx, data, &out_sz, raw + ctx->iv_sz + ctx->page_header_sz, ctx->data_sz);
+        EVP_CIPHER_CTX_ctrl(dctx, EVP_CTRL_GCM_SET_TAG, ctx->tag_sz, (void *)(raw + ctx->page_sz - ctx->tag_sz));
+        if(EVP_CipherFinal_ex(dctx, scratch + ctx->page_header_sz, &out_sz) <= 0) {
+            memset(data, 0, ctx->data_sz);
+            return CSF_PAGE_BAD;
+        }
+    } else if(ctx->encrypted) {
+        int out_sz, cipher_sz = 0;
+
+        // the decrypt context already has the cipher and key. pass in the page IV
+        EVP_CipherInit_ex(dctx, NULL, NULL, NULL, raw, 0);
+
+        if(ctx->cipher == CSF_CIPHER_AES_256_XTS) {
+            EVP_CipherUpdate(dctx, scratch, &out_sz, raw + ctx->iv_sz, ctx->page_header_sz + ctx->data_sz);
+            cipher_sz += out_sz;
+            memcpy(data, scratch + ctx->page_header_sz, ctx->data_sz);
+        } else {
+            // input is raw+iv_sz of size (header_sz+data). the CBC chain or CTR counter carries over from one update to the next
+            EVP_CipherUpdate(dctx, scratch, &out_sz, raw + ctx->iv_sz, ctx->page_header_sz);
+            cipher_sz += out_sz;
+            EVP_CipherUpdate(dctx, data, &out_sz, raw + ctx->iv_sz + ctx->page_header_sz, ctx->data_sz);
+            cipher_sz += out_sz;
+            EVP_CipherFinal_ex(dctx, (unsigned char *)data + out_sz, &out_sz);
+            cipher_sz += out_sz;
+        }
         assert(cipher_sz == (ctx->page_header_sz + ctx->data_sz));
     } else {
-        memcpy(ctx->scratch_buffer, ctx->page_buffer + ctx->iv_sz, ctx->page_header_sz + ctx->data_sz);
+        memcpy(scratch, raw + ctx->iv_sz, ctx->page_header_sz);
+        memcpy(data, raw + ctx->iv_sz + ctx->page_header_sz, ctx->data_sz);
     }
-    //printf("csf_read_page(%d,%d,x), cur_offset=%lld, read_sz=%ld, return_ds=%ld, sizeof(header)=%d s1=%d s2=%d\n", ctx->fh, pgno, cur_offset, read_sz, header.data_sz, sizeof(header), sizeof(header.data_sz), sizeof(header.magic));
 
-    //print_header(ctx->scratch_buffer, pgno);
+    return csf_check_page_header(ctx, scratch);
+}
+
+/* returns the data size from the decrypted page header at scratch, 0 if the header is not valid */
+static int csf_check_page_header(CSF_CTX *ctx, unsigned char *scratch) {
+    CSF_PAGE_HEADER header;
+
+    //print_header(scratch, pgno);
 
-    memcpy(&header, ctx->scratch_buffer, sizeof(header));
+    if(ctx->tag_sz) {
+        // GCM: data_sz only, authenticated with the page
+        memcpy(&header.data_sz, scratch, sizeof(header.data_sz));
+        return (header.data_sz >= 0 && header.data_sz <= ctx->data_sz) ? header.data_sz : 0;
+    }
+    memcpy(&header, scratch, sizeof(header));
 
     // handle incorrect headers (due to empty file or incorrect decryption - say invalid key)
     if(header.data_sz>ctx->data_sz) {
@@ -397,383 +1442,2586 @@ static size_t csf_read_page(CSF_CTX *ctx, int pgno, void *data) {
         header.data_sz = 0;
         //header.data_sz = ctx->data_sz;
     }
-    memcpy(data, ctx->scratch_buffer + ctx->page_header_sz, header.data_sz);
+    return header.data_sz;
+}
+
+/*
+ * true if the len raw bytes of a page are all zero. a written page starts with a random IV,
+ * so only a hole in the file reads back this way
+ */
+static int csf_page_is_hole(const unsigned char *raw, size_t len) {
+    return len == 0 || (raw[0] == 0 && memcmp(raw, raw + 1, len - 1) == 0);
+}
 
-    TRACE6("csf_read_page(%d,%d,x), cur_offset=%lld, read_sz=%ld, return=%ld\n", ctx->fh, pgno, cur_offset, read_sz, header.data_sz);
+/*
+ * read len bytes at offset start of the data on page pgno, for a small read. with CBC each
+ * block decrypts from its own ciphertext and the ciphertext block before it, so only the IV,
+ * the page header and the blocks holding the requested range (plus the one before them) are
+ * read and decrypted. with CTR the range decrypts on its own, from the counter of the block it
+ * starts in. XTS pages are only decrypted whole, and so are GCM pages, whose tag covers all
+ * of the page, and so are all pages in O_DIRECT mode. a hole reads as zeros.
+ * the page is not cached; a second read of the same page in a row is
+ * left to csf_fetch_page instead, so a page that is read piecemeal ends up in the cache.
+ * returns the number of bytes copied to out, or -1 if the page is cached, was the last page
+ * read this way, or could not be read, in which case the caller reads the whole page
+ */
+static int csf_read_partial(CSF_CTX *ctx, off_t pgno, unsigned char *out, int start, int len) {
+    off_t page_offset = ctx->hdr_sz + (off_t)pgno * ctx->page_sz;
+    int head = ctx->iv_sz + ctx->page_header_sz;                       // raw bytes before the data
+    int ctr = (ctx->cipher == CSF_CIPHER_AES_256_CTR);
+    int first_blk, from, to, skip;
+    const unsigned char *raw;
+    unsigned char *plain;
+    unsigned char iv[CSF_AES_BLOCK_SZ];
+    int data_sz, out_sz;
+    uint64_t t0;
+    TRACE_START(tr);
 
-    return header.data_sz;
+    if(ctx->cipher == CSF_CIPHER_AES_256_XTS || ctx->tag_sz || ctx->direct_align || pgno == ctx->partial_pgno ||
+       csf_cache_lookup(ctx, pgno)) {
+        ctx->partial_pgno = -1;
+        return -1;
+    }
+    if(ctr) {
+        // keystream blocks are counted from the page header. the range is decrypted from the start of its block
+        first_blk = (ctx->page_header_sz + start) / CSF_AES_BLOCK_SZ;
+        from = ctx->iv_sz + first_blk * CSF_AES_BLOCK_SZ;
+        to = head + start + len;
+        skip = 0;
+        plain = ctx->scratch_buffer + first_blk * CSF_AES_BLOCK_SZ;
+    } else {
+        int last_blk = (start + len - 1) / ctx->block_sz;
+        first_blk = start / ctx->block_sz;
+        from = head + (first_blk - 1) * ctx->block_sz;                 // the ciphertext block chained into first_blk
+        to = head + (last_blk + 1) * ctx->block_sz;
+        skip = ctx->block_sz;
+        plain = ctx->scratch_buffer + ctx->page_header_sz + first_blk * ctx->block_sz;
+    }
+    raw = csf_map_range(ctx, page_offset, to);
+
+    // IV and page header, then the blocks wanted, in one read if they follow on. nothing to read if mapped
+    if(raw) {
+        ctx->stats.mapped_pages++;
+    } else if(from <= head) {
+        if(csf_read_raw(ctx, page_offset, ctx->page_buffer, to) != to)
+            return -1;
+        raw = ctx->page_buffer;
+    } else {
+        if(csf_read_raw(ctx, page_offset, ctx->page_buffer, head) != head ||
+           csf_read_raw(ctx, page_offset + from, ctx->page_buffer + from, to - from) != to - from)
+            return -1;
+        raw = ctx->page_buffer;
+    }
+
+    ctx->stats.cache_misses++;
+    ctx->stats.partial_pages++;
+    ctx->partial_pgno = pgno;
+
+    if(csf_page_is_hole(raw, head) && csf_page_is_hole(raw + from, to - from)) {
+        data_sz = ctx->data_sz - start;
+        if(data_sz > len)
+            data_sz = len;
+        memset(out, 0, data_sz);
+        TRACE_EVENT(tr, CSF_TRACE_PARTIAL_READ, ctx, pgno, len, data_sz);
+        return data_sz;
+    }
+
+    t0 = csf_now_ns();
+    if(ctx->encrypted) {
+        EVP_CipherInit_ex(ctx->dctx, NULL, NULL, NULL, raw, 0);
+        EVP_CipherUpdate(ctx->dctx, ctx->scratch_buffer, &out_sz, raw + ctx->iv_sz, ctx->page_header_sz);
+        if(ctr)
+            csf_ctr_iv(iv, raw, first_blk);
+        EVP_CipherInit_ex(ctx->dctx, NULL, NULL, NULL, ctr ? iv : raw + from, 0);
+        EVP_CipherUpdate(ctx->dctx, plain, &out_sz, raw + from + skip, to - from - skip);
+        assert(out_sz == to - from - skip);
+    } else {
+        memcpy(ctx->scratch_buffer, raw + ctx->iv_sz, ctx->page_header_sz);
+        memcpy(plain, raw + from + skip, to - from - skip);
+    }
+    ctx->stats.cipher_ns += csf_now_ns() - t0;
+
+    data_sz = csf_check_page_header(ctx, ctx->scratch_buffer) - start;
+    if(data_sz < 0)
+        data_sz = 0;
+    if(data_sz > len)
+        data_sz = len;
+    memcpy(out, ctx->scratch_buffer + ctx->page_header_sz + start, data_sz);
+    TRACE6("csf_read_partial(%d,%lld,x,%d,%d), blocks %d..\n", ctx->fh, pgno, start, len, first_blk);
+    TRACE_EVENT(tr, CSF_TRACE_PARTIAL_READ, ctx, pgno, len, data_sz);
+    return data_sz;
 }
 
-/* writes single page (data of size data_sz, header of size page_header_sz)
- * to an encrypted file which in csf format, after the bitz header
- * pgno is the offset in csf pages
- * first 16 bytes in the csf page is the IV
- * after that we have encrypted data, consisting of both the page header and page data
- * seeks to the right csf page offset before writing
- *
- * encrypted write is all or none - if the write fails, the entire page write fails.
- * return -1 on failure
+/* the CTR counter of keystream block blk of a page: its IV as a 128 bit big endian number, plus blk */
+static void csf_ctr_iv(unsigned char *out, const unsigned char *iv, uint64_t blk) {
+    int i;
+
+    memcpy(out, iv, CSF_AES_BLOCK_SZ);
+    for(i = CSF_AES_BLOCK_SZ - 1; i >= 0 && blk; i--) {
+        uint64_t sum = out[i] + (blk & 0xff);
+        out[i] = sum & 0xff;
+        blk = (blk >> 8) + (sum >> 8);
+    }
+}
+
+/*
+ * encrypt one csf page into raw, page pgno of the file, which already starts with the page IV:
+ * a page header holding data_sz, followed by the data, encrypted after the IV. GCM pages end
+ * with the tag, over the page number and file id as well.
+ * ectx is an encrypt context already keyed for ctx, scratch takes the plain header+data.
  */
-static size_t csf_write_page(CSF_CTX *ctx, int pgno, void *data, size_t data_sz) {
-    off_t start_offset = HDR_SZ + (pgno * ctx->page_sz);
-    off_t cur_offset =  lseek(ctx->fh, 0L, SEEK_CUR);
-    int to_write = ctx->page_sz;
-    size_t write_sz = 0;
+static void csf_encrypt_page(CSF_CTX *ctx, EVP_CIPHER_CTX *ectx, off_t pgno, const void *data, size_t data_sz, unsigned char *scratch, unsigned char *raw) {
     CSF_PAGE_HEADER header;
 
-    TRACE1("in csf_write_page\n");
-    assert(data_sz <= ctx->data_sz);
-
     // create the header with data size
     header.data_sz = data_sz;
     header.magic = PAGE_MAGIC_NUM;
 
-    // create the random IV for the page, directly into page_buffer
-    int testing = 0;
-    if(testing)
-        bzero(ctx->page_buffer,  ctx->iv_sz);
+    // copy header and data to the scratch buffer. GCM takes data_sz only
+    if(ctx->tag_sz)
+        memcpy(scratch, &header.data_sz, sizeof(header.data_sz));
     else
-        RAND_pseudo_bytes(ctx->page_buffer, ctx->iv_sz);
+        memcpy(scratch, &header, sizeof(header));
+    memcpy(scratch + ctx->page_header_sz, data, data_sz);
+    // scratch comes from the buffer pool, and may hold another file's plaintext past data_sz
+    memset(scratch + ctx->page_header_sz + data_sz, 0, ctx->data_sz - data_sz);
+    //print_iv(scratch, pgno); // before encryption
 
-    //print_iv(ctx->page_buffer, pgno);
-
-    // copy header and data to the scratch buffer
-    memcpy(ctx->scratch_buffer, &header, sizeof(header));
-    memcpy(ctx->scratch_buffer + ctx->page_header_sz, data, data_sz);
-    //print_iv(ctx->scratch_buffer, pgno); // before encryption
-
-    // encrypt the scratch buffer (header+data) in memory only, into page_buffer, right after IV
+    // encrypt the scratch buffer (header+data) in memory only, into raw, right after IV
     if(ctx->encrypted) {
-        EVP_CIPHER_CTX ectx;
-        void *out_ptr =  ctx->page_buffer + ctx->iv_sz;
+        void *out_ptr =  raw + ctx->iv_sz;
         int out_sz, cipher_sz = 0;
 
-        // init the cipher
-        EVP_CipherInit(&ectx, CIPHER, NULL, NULL, 1);
-        EVP_CIPHER_CTX_set_padding(&ectx, 0);
-
-        // pass in the key and IV and ask to encrypt
-        EVP_CipherInit(&ectx, NULL, ctx->key_data, ctx->page_buffer, 1);
+        // the encrypt context already has the cipher and key. pass in the page IV
+        EVP_CipherInit_ex(ectx, NULL, NULL, NULL, raw, 1);
+        if(ctx->tag_sz) {
+            unsigned char aad[CSF_AAD_SZ];
+            csf_page_aad(ctx, pgno, aad);
+            EVP_CipherUpdate(ectx, NULL, &out_sz, aad, CSF_AAD_SZ);
+        }
 
-        // start output after page_buf+iv_sz
-        EVP_CipherUpdate(&ectx, out_ptr + cipher_sz, &out_sz, ctx->scratch_buffer, ctx->page_header_sz + ctx->data_sz);
+        // start output after raw+iv_sz
+        EVP_CipherUpdate(ectx, out_ptr + cipher_sz, &out_sz, scratch, ctx->page_header_sz + ctx->data_sz);
         cipher_sz += out_sz;
-        EVP_CipherFinal(&ectx, out_ptr + cipher_sz, &out_sz);
+        EVP_CipherFinal_ex(ectx, out_ptr + cipher_sz, &out_sz);
         cipher_sz += out_sz;
-        EVP_CIPHER_CTX_cleanup(&ectx);
         assert(cipher_sz == (ctx->page_header_sz + ctx->data_sz));
-        //printf(" encrypted val: "); print_iv(ctx->page_buffer+ctx->iv_sz, pgno);
+        if(ctx->tag_sz)
+            EVP_CIPHER_CTX_ctrl(ectx, EVP_CTRL_GCM_GET_TAG, ctx->tag_sz, raw + ctx->page_sz - ctx->tag_sz);
+        //printf(" encrypted val: "); print_iv(raw+ctx->iv_sz, pgno);
     } else {
-        memcpy(ctx->page_buffer + ctx->iv_sz, ctx->scratch_buffer, ctx->page_header_sz + ctx->data_sz);
+        memcpy(raw + ctx->iv_sz, scratch, ctx->page_header_sz + ctx->data_sz);
+        memset(raw + ctx->page_sz - ctx->tag_sz, 0, ctx->tag_sz);
     }
+}
 
-    // after encryption
-    //print_iv(ctx->page_buffer, pgno);
-
-    // if not already in proper position for page, seek there
-    if(cur_offset != start_offset) {
-        errno = 0;
-        cur_offset = lseek(ctx->fh, start_offset, SEEK_SET);
-        // check the above seek is valid.  else output is corrupted.
-        if(errno) {
-//            printf("error %d seeking to right offset %lld during write to fd=%d\n", errno, start_offset, ctx->fh);
-            return -1;
-        }
-    }
+/* the associated data of GCM page pgno: the page number as 64 bits big endian, then the file id */
+static void csf_page_aad(CSF_CTX *ctx, off_t pgno, unsigned char *aad) {
+    uint64_t n = pgno;
+    int i;
 
-    // write out entire page into the output file handle, on the seek location set at page boundary.
-    for(;write_sz < to_write;) { /* FIXME - error handling */
-        int trycount = RETRYCOUNT;
-        ssize_t bytes_write;
+    for(i = 7; i >= 0; i--, n >>= 8)
+        aad[i] = n & 0xff;
+    memcpy(aad + 8, ctx->file_id, CSF_FILE_ID_SZ);
+}
 
-        errno = 0;
-        while( ((bytes_write = write(ctx->fh, ctx->page_buffer + write_sz, to_write - write_sz)))<0 && trycount-- >0 ) {
-            errno = 0;
-        }
+/*
+ * the next write generation, epoch << 32 | IVs handed out in the epoch, into *gen. the cursors
+ * of a shared file take it from the file's counter.
+ * returns 0 if the epoch has run out of counts
+ */
+static int csf_iv_gen(CSF_CTX *ctx, uint64_t *gen) {
+    uint64_t g;
 
-        if(bytes_write < 0) { // we have a write error after 3 tries
-            if(errno) {
-//                printf("csf_write_page write received an error: %d\n", errno);
-            }
-            return -1;
-        }
-        write_sz += bytes_write;
+    if(ctx->shared == NULL) {
+        if(ctx->iv_count == UINT32_MAX)
+            return 0;
+        *gen = ((uint64_t)ctx->iv_epoch << 32) | ctx->iv_count++;
+        return 1;
     }
+    g = __atomic_load_n(&ctx->shared->iv_gen, __ATOMIC_RELAXED);
+    do {
+        if((uint32_t)g == UINT32_MAX)
+            return 0;
+    } while(!__atomic_compare_exchange_n(&ctx->shared->iv_gen, &g, g + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    *gen = g;
+    return 1;
+}
 
-    TRACE6("csf_write_page(%d,%d,x,%ld), cur_offset=%lld, write_sz= %ld\n", ctx->fh, pgno, data_sz, cur_offset, write_sz);
+/*
+ * the IV for a new write of page pgno, ctx->iv_sz bytes. in a VERSION_1004 file it is derived
+ * without the OpenSSL RNG: the page number and a write generation, epoch << 32 | IVs handed out
+ * in the epoch, each 64 bits big endian, encrypted as one block with ctx->iv_ctx. that is unique
+ * within the file while the epoch only goes up, and unpredictable without the key. GCM takes
+ * the first 12 bytes. other files, and an epoch that has run out of counts, get random IVs.
+ * the IV is stored at the start of the page as before, so readers never derive it
+ */
+static void csf_page_iv(CSF_CTX *ctx, off_t pgno, unsigned char *iv) {
+    unsigned char in[CSF_AES_BLOCK_SZ], out[CSF_AES_BLOCK_SZ];
+    uint64_t n = pgno, gen;
+    int i, out_sz;
 
-    return data_sz;
+    if(ctx->iv_ctx == NULL || !csf_iv_gen(ctx, &gen)) {
+        RAND_pseudo_bytes(iv, ctx->iv_sz);
+        return;
+    }
+    for(i = 7; i >= 0; i--, n >>= 8, gen >>= 8) {
+        in[i] = n & 0xff;
+        in[8 + i] = gen & 0xff;
+    }
+    EVP_EncryptUpdate(ctx->iv_ctx, out, &out_sz, in, CSF_AES_BLOCK_SZ);
+    memcpy(iv, out, ctx->iv_sz);
 }
 
-static size_t lower_cutoff(size_t req_end, size_t page_end, size_t file_end) {
-    size_t lowest = (req_end < page_end) ? req_end : page_end;
-    lowest = (lowest < file_end) ? lowest: file_end;
-    return lowest;
+static uint64_t csf_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-/* read from an encrypted file nbyte bytes of data into data buffer
- * max size of data returned is not data_sz or page_sz, it can be larger
- * it reads each csf page in which the data resides and copies them into one buffer
- * returns number of bytes read on success
- * returns -1 on failures
- *    - file header mismatch
- *    - page magic mismatch
+/*
+ * one pread, tried again up to RETRYCOUNT times on error, as all file i/o here is. not counted
+ * in ctx->stats, so threads other than the caller's can use it: the number of calls made goes
+ * in *calls. errno is left from the last failed try.
+ * returns what pread returned
  */
-size_t csf_read(CSF_CTX *ctx, void *databuf, size_t nbyte) {
-
-    TRACE1("csf_read()\n");
-    // starting point is the current seek pointer
-    // starting csf page
-    const int start_page = csf_pageno_for_offset(ctx, ctx->seek_ptr);
-
-    // starting offset translated to offset within the page
-    int start_offset = ctx->seek_ptr % ctx->data_sz;
-    //int first_start_offset = start_offset; // how much to subtract from last read
-
-    // this is the last byte to read, starting from current page, offset 0
-    // used to determine number of pages to iterate over in loop below
-    int lastbyte_to_read = nbyte + start_offset;
-    const int pages_to_read = csf_page_count_for_length(ctx, lastbyte_to_read);
-
-    // now lastbyte_to_read tracks the number of bytes left to read
-    // it is updated after every page read, relative to start of current page.
-    lastbyte_to_read = nbyte;
-
-    // total page count for file.
-    // used as bounds check over the loop, to avoid read past last page
-    // that check should really be for page_count minus start_page
-    int total_page_count = csf_page_count_for_file(ctx);
-    int page_count_to_EOF = total_page_count - start_page;
-    int i, data_offset = 0;
-    int total_bytes_read = 0;
-    CSF_FILE_HEADER cfh;
+static ssize_t csf_retry_pread(CSF_CTX *ctx, void *buf, size_t len, off_t offset, int *calls) {
+    int trycount = RETRYCOUNT;
+    ssize_t bytes_read;
 
-    // in case we do this for every read, we need to save the seek ptr to 0, then reset back
-    // optimization to do it only for file reads already at start.
-    int retval = 0;
-    if(ctx->seek_ptr==0 && total_page_count>0) {
-        retval = csf_read_header(ctx, &cfh);
-        if(retval<0) {
-//            printf("error reading header: %d\n",retval);
-            return retval;
-        }
+    errno = 0;
+    *calls = 1;
+    while( (bytes_read = csf_fd_pread(ctx, buf, len, offset)) <0 && trycount-- >0  ) {// try again
+        errno = 0;
+        (*calls)++;
     }
+    return bytes_read;
+}
 
-    // loop over csf pages to read, reading them in entirety using csf_read_page
-    // modifies ctx->fh->seek pointer to beginning of each page at the beginning of each read (prob with multiple reads ? no)
-    // modifies ctx->fh->seek pointer to last valid byte within each page after each iteration
-    // modifies ctx->seek_ptr to bytes moved forward
-    // printf("in csf_read (seek=%ld, size=%d)=>([startpage=%d startoff=%d], [pages_to_read=%d, lastbyteoff=%d])\n" ,
-    //    (unsigned int)(ctx->seek_ptr), nbyte,   start_page, start_offset,  pages_to_read, lastbyte_to_read);
-
-    for(i = 0; i < pages_to_read && i < total_page_count; i++) { /* dont read past end of file */
-
-        if(i > page_count_to_EOF) {
-//            printf("=========> reading page past EOF\n");
-            ctx->seekPastEndOfFile = 1;
-        }
-        //printf("=========>pgno=%d seekptr=%ld\n", start_page+i, (ctx->seek_ptr));
+/* csf_retry_pread, counted in ctx->stats */
+static ssize_t csf_sys_pread(CSF_CTX *ctx, void *buf, size_t len, off_t offset) {
+    uint64_t start = csf_now_ns();
+    ssize_t bytes_read;
+    int calls;
 
-        // read in the full page in csf_buffer, startng from page offset 0 to ctx->data_sz (not fh->seek)
-        // retval which indicates bytes available comes from the header value
-        // if it is less than data_sz, then that's the max amount of data we can read.
-        int data_bytes_in_page = csf_read_page(ctx, start_page + i, ctx->csf_buffer);
+    bytes_read = csf_retry_pread(ctx, buf, len, offset, &calls);
+    ctx->stats.syscalls += calls;
+    ctx->stats.retries += calls - 1;
+    ctx->stats.io_ns += csf_now_ns() - start;
+    if(bytes_read > 0)
+        ctx->stats.disk_bytes_read += bytes_read;
+    return bytes_read;
+}
 
-        if(data_bytes_in_page <0) // error in read of current page
-            break;
+/* same for pwrite */
+static ssize_t csf_sys_pwrite(CSF_CTX *ctx, const void *buf, size_t len, off_t offset) {
+    int trycount = RETRYCOUNT;
+    uint64_t start = csf_now_ns();
+    ssize_t bytes_write;
 
-        // we want to find how much data to read within each page
-        // startpoint is determined by
-        //  1. current seek pointer
-        // endpoint is determined by min of
-        //  1. user request (lastbyte_to_read)
-        //  2. end of page  (ctx->data_sz)
-        //  3. end of file  (data_bytes_in_page)
-        // after read we know 3, so now we know all parameters
+    errno = 0;
+    ctx->stats.syscalls++;
+    while( (bytes_write = csf_fd_pwrite(ctx, buf, len, offset)) <0 && trycount-- >0  ) {// try again
+        errno = 0;
+        ctx->stats.syscalls++;
+        ctx->stats.retries++;
+    }
+    ctx->stats.io_ns += csf_now_ns() - start;
+    if(bytes_write > 0)
+        ctx->stats.disk_bytes_written += bytes_write;
+    return bytes_write;
+}
 
-        // if last byte is less than max data size, then use that lower value, otherwise read max data size
-        // this isn't actually passed to csf_read_page, which reads the entire page
-        // it is used by us to determine the relevant data. that may be modified by the actual size available within page
-        // lastbyte_within_page needs to relative to the start_offset if it is smaller than pgsz
-        size_t lastbyte_within_page = (lastbyte_to_read < ctx->data_sz) ? lastbyte_to_read+start_offset: lastbyte_to_read;
+/*
+ * O_DIRECT mode: the alignment that file offsets, lengths and memory need, from statx where the
+ * kernel reports it, else the logical block size of a block device, else st_blksize.
+ * returns the alignment, or -1 on failure
+ */
+static int csf_direct_align(int fh) {
+    struct stat st;
+    int align = 0;
+#ifdef STATX_DIOALIGN
+    struct statx stx;
 
-        size_t endcutoff = lower_cutoff(lastbyte_within_page, ctx->data_sz, data_bytes_in_page);
-        //printf("===== endcutoff is %d start_offset is %d\n", endcutoff, start_offset);
+    if(statx(fh, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align > 0)
+        return (stx.stx_dio_mem_align > stx.stx_dio_offset_align) ? stx.stx_dio_mem_align : stx.stx_dio_offset_align;
+#endif
+    if(fstat(fh, &st) < 0)
+        return -1;
+#ifdef BLKSSZGET
+    if(S_ISBLK(st.st_mode) && ioctl(fh, BLKSSZGET, &align) == 0 && align > 0)
+        return align;
+#endif
+    return (st.st_blksize > 0) ? st.st_blksize : 4096;
+}
 
-        if(endcutoff > start_offset) {
-            size_t bytes_to_copy = endcutoff - start_offset;
-            //printf("===== bytes to copy ares %d %d %d %d\n", bytes_to_copy, lastbyte_to_read, ctx->data_sz, data_bytes_in_page);
-            memcpy(databuf + data_offset, ctx->csf_buffer + start_offset, bytes_to_copy);
+/*
+ * set O_DIRECT on the file. pages must be whole blocks of the device, so that a page takes up
+ * as many blocks wherever it starts.
+ * returns 0 on success, -1 on failure, with errno EINVAL if the page size does not fit the device
+ */
+static int csf_direct_init(CSF_CTX *ctx) {
+    int align = csf_direct_align(ctx->fh);
+    int fl;
 
-            lastbyte_to_read -=  bytes_to_copy;
-            total_bytes_read +=  bytes_to_copy;
-            data_offset += bytes_to_copy;
-            ctx->seek_ptr += bytes_to_copy;
-            start_offset = 0; /* after the first iteration the start offset will always be at the beginning of the page */
-            memset(ctx->csf_buffer, 0, ctx->page_sz);
-        } else {
-            // printf("breaking at EOF\n");
-            // we hit a page where the available data is less than our start offset for read
-            // this would indicate EOF so we break.
-            // doing this we should be able to avoid the earlier file size check
-            break;
-        }
+    if(align <= 0)
+        return -1;
+    if(ctx->page_sz % align != 0) {
+        TRACE3("csf_direct_init(%d), page size not a multiple of the block size %d\n", ctx->fh, align);
+        errno = EINVAL;
+        return -1;
     }
+    fl = fcntl(ctx->fh, F_GETFL);
+    if(fl < 0 || fcntl(ctx->fh, F_SETFL, fl | O_DIRECT) < 0)
+        return -1;
+    ctx->direct_align = align;
+    TRACE3("csf_direct_init(%d), block size %d\n", ctx->fh, align);
+    return 0;
+}
 
-    TRACE6("csf_read(%d,x,%ld), pages_to_read = %d, ctx->seek_ptr = %lld, return=%d\n", ctx->fh, nbyte, pages_to_read, ctx->seek_ptr, data_offset);
-    return total_bytes_read;
+/*
+ * one pread or pwrite in O_DIRECT mode. the buffer, length and offset must all be multiples of
+ * align: pages start on a block boundary (see csf_load_header) and are read and written whole,
+ * from aligned buffers, so nothing csfio does is turned away here.
+ * returns what pread or pwrite would: the bytes transferred, or -1 with errno set, EINVAL for
+ * a transfer that is not aligned
+ */
+static ssize_t csf_direct_rw(int fh, int align, int write, void *buf, size_t len, off_t offset) {
+    if(((uint64_t)(uintptr_t)buf | (uint64_t)len | (uint64_t)offset) % align != 0) {
+        TRACE4("csf_direct_rw(%d), %zu bytes at %lld not aligned\n", fh, len, (long long)offset);
+        errno = EINVAL;
+        return -1;
+    }
+    return write ? pwrite(fh, buf, len, offset) : pread(fh, buf, len, offset);
 }
 
-/* write out the file header. must be all or nothing */
-/* first check if it exists. seeks to beginning of files, restores seek at end */
-/* returns number of bytes written */
-/* in case of a error returns -1 */
-static size_t csf_write_header(CSF_CTX *ctx) {
-    int write_sz=0;
-    CSF_FILE_HEADER cfh;
-    unsigned char header[HDR_SZ];
+/* pread on the file, the way the file is opened: in O_DIRECT mode through csf_direct_rw. no retries, no stats */
+static ssize_t csf_fd_pread(CSF_CTX *ctx, void *buf, size_t len, off_t offset) {
+    if(ctx->direct_align)
+        return csf_direct_rw(ctx->fh, ctx->direct_align, 0, buf, len, offset);
+    return pread(ctx->fh, buf, len, offset);
+}
 
-    if(HDR_SZ==0)
-        return 0;
+/* same for pwrite */
+static ssize_t csf_fd_pwrite(CSF_CTX *ctx, const void *buf, size_t len, off_t offset) {
+    if(ctx->direct_align)
+        return csf_direct_rw(ctx->fh, ctx->direct_align, 1, (void *)buf, len, offset);
+    return pwrite(ctx->fh, buf, len, offset);
+}
 
-    int existing_bytes = csf_read_header(ctx, &cfh);
-    if(existing_bytes >0) {
-        //printf("successfully read header\n");
-        return existing_bytes;
-    }
-    else {
-//        printf("error reading header, creating new one\n");
+/*
+ * write len bytes of raw csf pages at file offset start_offset. a write that goes through the
+ * journal only adds them to it, see csf_journal_begin: csf_journal_end writes them to the file.
+ * returns len, or -1 on failure
+ */
+static ssize_t csf_write_raw(CSF_CTX *ctx, off_t start_offset, unsigned char *raw, size_t len) {
+    if(ctx->journal) {
+        if(csf_journal_capturing(ctx))
+            return (csf_journal_add(ctx, start_offset, raw, len) < 0) ? -1 : (ssize_t)len;
+        if(csf_journal_guard(ctx, start_offset, start_offset + len) < 0)
+            return -1;
     }
+    return csf_pwrite_all(ctx, start_offset, raw, len);
+}
 
-    off_t cur_offset = lseek(ctx->fh, 0, SEEK_CUR);
-    if(cur_offset != 0) {
-        lseek(ctx->fh, 0, SEEK_SET);
-    }
+/* csf_write_raw straight to the file, with pwrite. all or nothing */
+static ssize_t csf_pwrite_all(CSF_CTX *ctx, off_t start_offset, const unsigned char *raw, size_t len) {
+    size_t write_sz = 0;
 
-    memset(header, 0, HDR_SZ);
-    csf_create_file_header(ctx, &cfh);
-    memcpy(header, (void *)&cfh, HDR_SZ);
-    for(;write_sz < HDR_SZ;) { /* FIXME - error handling */
-        int trycount = RETRYCOUNT;
-        ssize_t bytes_write;
-        errno = 0;
-        while( (bytes_write = write(ctx->fh, header, HDR_SZ-write_sz)) <0 && trycount-- >0) {
-            // try again
-            errno = 0;
-        }
-        if(bytes_write < 0) {
+    for(;write_sz < len;) { /* FIXME - error handling */
+        ssize_t bytes_write = csf_sys_pwrite(ctx, raw + write_sz, len - write_sz, start_offset + write_sz);
+
+        if(bytes_write < 0) { // we have a write error after 3 tries
             if(errno) {
-//                printf("csf_write_header write received an error: %d\n", errno);
+//                printf("csf_write_raw write received an error: %d\n", errno);
             }
             return -1;
         }
         write_sz += bytes_write;
-        //printf("wrote n bytes of header: %d\n", write_sz);
     }
-    ctx->file_header_check = 1;
-
-    // reset it back
-    lseek(ctx->fh, cur_offset, SEEK_SET);
     return write_sz;
 }
 
-/* read in the file header
- * should be possible to do it before creating ctx, to check file type and read page size.
- * returns number of bytes read in case of success
- * returns -1 if there is an error
+/*
+ * make the file at least len bytes long. it is extended with ftruncate, which leaves a hole
+ * rather than writing anything. a longer file is left alone. a write that goes through the
+ * journal has it extended by csf_journal_end.
+ * returns 0 on success, -1 on failure
  */
-static int csf_read_header(CSF_CTX *ctx, CSF_FILE_HEADER *cfh) {
-    ssize_t bytes_read=0, read_sz=0;
-    unsigned char header[HDR_SZ];
+static int csf_extend_raw(CSF_CTX *ctx, off_t len) {
+    struct stat st;
 
-    if(HDR_SZ==0)
+    if(csf_journal_capturing(ctx))
+        return csf_journal_extend(ctx, len);
+    ctx->stats.syscalls++;
+    if(fstat(ctx->fh, &st) < 0)
+        return -1;
+    if(st.st_size >= len)
         return 0;
+    ctx->stats.syscalls++;
+    return ftruncate(ctx->fh, len);
+}
 
-    //printf("csf_read_header fh=%d seek=%d\n", ctx->fh, ctx->seek_ptr);
+/*
+ * read up to len bytes of raw csf pages at file offset start_offset with pread.
+ * returns the bytes read, short only at end of file, or -1 on failure
+ */
+static ssize_t csf_read_raw(CSF_CTX *ctx, off_t start_offset, unsigned char *raw, size_t len) {
+    size_t read_sz = 0;
 
-    // error handling : try 3 times and return error if it still fails.
-    for(;read_sz < HDR_SZ;) {
-        int trycount = RETRYCOUNT;
-        errno = 0;
-        while( (bytes_read = read(ctx->fh, header, HDR_SZ-read_sz)) <0 && trycount-- >0  ) {
-            // try again
-            // printf("error on read header: %d %d\n", errno, trycount);
-            errno = 0;
-        }
-        //printf("tried: %d %d %d %d\n", trycount, bytes_read, errno, ctx->fh);
-        if(bytes_read < 0) { // we have a read error after 3 tries.
-            // we cannot continue else read buffer will be corrupted.
-            if(errno) {
-            //  printf("csf_read_header read received an error: %d\n", errno);
-            }
+    for(;read_sz < len;) {
+        ssize_t bytes_read = csf_sys_pread(ctx, raw + read_sz, len - read_sz, start_offset + read_sz);
+        if(bytes_read < 0)
             return -1;
-        }
-        if(bytes_read == 0) { // no error but we are at EOF. new file
-            return 0;
-        }
+        if(bytes_read == 0)
+            break;
         read_sz += bytes_read;
-        //printf("read n bytes of header: %d\n", read_sz);
     }
+    return read_sz;
+}
+
+/*
+ * mmap mode: map the whole file read-only, as it is now, in place of an earlier mapping.
+ * an empty file is not mapped.
+ * returns 0 on success, -1 on failure, leaving the file unmapped
+ */
+static int csf_map_update(CSF_CTX *ctx) {
+    struct stat st;
+    void *map;
+
+    ctx->stats.syscalls++;
+    if(fstat(ctx->fh, &st) < 0) {
+        csf_map_release(ctx);
+        return -1;
+    }
+    if(ctx->map && st.st_size == ctx->map_sz)
+        return 0;
+    csf_map_release(ctx);
+    if(st.st_size == 0)
+        return 0;
+    ctx->stats.syscalls++;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, ctx->fh, 0);
+    if(map == MAP_FAILED)
+        return -1;
+    ctx->map = map;
+    ctx->map_sz = st.st_size;
+    ctx->stats.remaps++;
+    TRACE3("csf_map_update(%d), %lld bytes\n", ctx->fh, (long long)ctx->map_sz);
+    return 0;
+}
+
+static void csf_map_release(CSF_CTX *ctx) {
+    if(ctx->map)
+        munmap(ctx->map, ctx->map_sz);
+    ctx->map = NULL;
+    ctx->map_sz = 0;
+}
+
+/*
+ * where the raw bytes [offset, offset + len) of the file are mapped, in mmap mode. a range past
+ * the mapping maps the file again, in case it has grown since.
+ * writes with pwrite show through the shared mapping, so only a change of size needs a new one.
+ * returns NULL if mmap mode is off, or the range is not all in the file
+ */
+static const unsigned char *csf_map_range(CSF_CTX *ctx, off_t offset, size_t len) {
+    if(!ctx->map_mode)
+        return NULL;
+    if(offset + (off_t)len > ctx->map_sz && csf_map_update(ctx) < 0)
+        return NULL;
+    if(offset + (off_t)len > ctx->map_sz)
+        return NULL;
+    return ctx->map + offset;
+}
+
+/* keep a cached copy of page pgno in step with data that is now on disk */
+static void csf_cache_update(CSF_CTX *ctx, off_t pgno, const void *data, int data_sz) {
+    CSF_CACHE_ENTRY *entry = csf_cache_lookup(ctx, pgno);
+
+    if(entry) {
+        if(entry->data != data) {
+            memcpy(entry->data, data, data_sz);
+            memset(entry->data + data_sz, 0, ctx->data_sz - data_sz);
+        }
+        entry->data_sz = data_sz;
+    }
+}
+
+/* writes single page (data of size data_sz, header of size page_header_sz)
+ * to an encrypted file which in csf format, after the bitz header
+ * pgno is the offset in csf pages
+ * first 16 bytes in the csf page is the IV
+ * after that we have encrypted data, consisting of both the page header and page data
+ * writes at the csf page offset with pwrite, the fd seek pointer is not used
+ *
+ * encrypted write is all or none - if the write fails, the entire page write fails.
+ * return -1 on failure
+ */
+static size_t csf_write_page(CSF_CTX *ctx, off_t pgno, void *data, size_t data_sz) {
+    off_t start_offset = ctx->hdr_sz + (pgno * ctx->page_sz);
+    uint64_t start;
+    TRACE_START(tr);
+
+    TRACE1("in csf_write_page\n");
+    assert(data_sz <= ctx->data_sz);
+    csf_ra_invalidate(ctx, pgno, pgno + 1);
+
+    // create the IV for the page, directly into page_buffer
+    int testing = 0;
+    if(testing)
+        bzero(ctx->page_buffer,  ctx->iv_sz);
+    else
+        csf_page_iv(ctx, pgno, ctx->page_buffer);
+
+    //print_iv(ctx->page_buffer, pgno);
+
+    start = csf_now_ns();
+    csf_encrypt_page(ctx, ctx->ectx, pgno, data, data_sz, ctx->scratch_buffer, ctx->page_buffer);
+    ctx->stats.cipher_ns += csf_now_ns() - start;
+    ctx->stats.pages_encrypted++;
+
+    // write out entire page into the output file handle, at the page boundary.
+    if(csf_write_raw(ctx, start_offset, ctx->page_buffer, ctx->page_sz) < 0) {
+        csf_cache_invalidate(ctx, pgno, pgno + 1);
+        TRACE_EVENT(tr, CSF_TRACE_WRITE_PAGE, ctx, pgno, data_sz, -1);
+        return -1;
+    }
+
+    TRACE5("csf_write_page(%d,%lld,x,%ld), start_offset=%lld\n", ctx->fh, pgno, data_sz, start_offset);
+
+    ctx->stats.pages_written++;
+    csf_cache_update(ctx, pgno, data, data_sz);
+    TRACE_EVENT(tr, CSF_TRACE_WRITE_PAGE, ctx, pgno, data_sz, data_sz);
+    return data_sz;
+}
+
+/*
+ * page cache. holds the decrypted data portion of recently used pages, keyed by page number.
+ * slots are chained into hash buckets for lookup. once every slot is in use, the slot to reuse
+ * is the tail of the LRU list, or the first slot the CLOCK hand finds with its reference bit clear.
+ * the bytes of a slot past its data_sz are kept zeroed, as csf_write relies on that when it
+ * extends a page.
+ */
+static int csf_cache_init(CSF_CTX *ctx, int cache_pages, int cache_policy) {
+    int i;
+
+    ctx->cache_pages = (cache_pages > 0) ? cache_pages : 0;
+    ctx->cache_policy = cache_policy;
+    ctx->cache_used = 0;
+    ctx->cache_hand = 0;
+    ctx->cache_lru_head = ctx->cache_lru_tail = -1;
+    ctx->cache = NULL;
+    ctx->cache_hash = NULL;
+    if(ctx->cache_pages == 0)
+        return 0;
+
+    for(ctx->cache_nbuckets = 1; ctx->cache_nbuckets < ctx->cache_pages; ctx->cache_nbuckets <<= 1);
+    ctx->cache = csf_malloc(ctx->cache_pages * sizeof(CSF_CACHE_ENTRY));
+    ctx->cache_hash = csf_malloc(ctx->cache_nbuckets * sizeof(int));
+    if(ctx->cache == NULL || ctx->cache_hash == NULL)
+        return -1;
+
+    for(i = 0; i < ctx->cache_nbuckets; i++)
+        ctx->cache_hash[i] = -1;
+    for(i = 0; i < ctx->cache_pages; i++) {
+        ctx->cache[i].pgno = -1;
+        ctx->cache[i].prev = ctx->cache[i].next = ctx->cache[i].hash_next = -1;
+    }
+    return 0;
+}
+
+static void csf_cache_destroy(CSF_CTX *ctx) {
+    int i;
+
+    if(ctx->cache) {
+        for(i = 0; i < ctx->cache_pages; i++) {
+            if(ctx->cache[i].data)
+                csf_free(ctx->cache[i].data, ctx->data_sz);
+        }
+        csf_free(ctx->cache, ctx->cache_pages * sizeof(CSF_CACHE_ENTRY));
+    }
+    if(ctx->cache_hash)
+        csf_free(ctx->cache_hash, ctx->cache_nbuckets * sizeof(int));
+    ctx->cache = NULL;
+    ctx->cache_hash = NULL;
+    ctx->cache_pages = 0;
+}
+
+static void csf_cache_lru_unlink(CSF_CTX *ctx, int slot) {
+    CSF_CACHE_ENTRY *entry = &ctx->cache[slot];
+
+    if(entry->prev >= 0)
+        ctx->cache[entry->prev].next = entry->next;
+    else
+        ctx->cache_lru_head = entry->next;
+    if(entry->next >= 0)
+        ctx->cache[entry->next].prev = entry->prev;
+    else
+        ctx->cache_lru_tail = entry->prev;
+    entry->prev = entry->next = -1;
+}
+
+/* link slot into the LRU list, at the head (most recently used) or at the tail (reused first) */
+static void csf_cache_lru_link(CSF_CTX *ctx, int slot, int at_head) {
+    CSF_CACHE_ENTRY *entry = &ctx->cache[slot];
+
+    if(ctx->cache_lru_head < 0) {
+        ctx->cache_lru_head = ctx->cache_lru_tail = slot;
+    } else if(at_head) {
+        entry->next = ctx->cache_lru_head;
+        ctx->cache[ctx->cache_lru_head].prev = slot;
+        ctx->cache_lru_head = slot;
+    } else {
+        entry->prev = ctx->cache_lru_tail;
+        ctx->cache[ctx->cache_lru_tail].next = slot;
+        ctx->cache_lru_tail = slot;
+    }
+}
+
+static void csf_cache_hash_unlink(CSF_CTX *ctx, int slot) {
+    int *link = &ctx->cache_hash[ctx->cache[slot].pgno & (ctx->cache_nbuckets - 1)];
+
+    while(*link != slot)
+        link = &ctx->cache[*link].hash_next;
+    *link = ctx->cache[slot].hash_next;
+    ctx->cache[slot].hash_next = -1;
+}
+
+/* returns the cached page pgno and marks it as recently used, or NULL if it is not cached */
+static CSF_CACHE_ENTRY *csf_cache_lookup(CSF_CTX *ctx, off_t pgno) {
+    int slot;
+
+    if(ctx->cache_pages == 0 || pgno < 0)
+        return NULL;
+
+    for(slot = ctx->cache_hash[pgno & (ctx->cache_nbuckets - 1)]; slot >= 0; slot = ctx->cache[slot].hash_next) {
+        if(ctx->cache[slot].pgno == pgno) {
+            if(ctx->cache_policy == CSF_CACHE_LRU && ctx->cache_lru_head != slot) {
+                csf_cache_lru_unlink(ctx, slot);
+                csf_cache_lru_link(ctx, slot, 1);
+            }
+            ctx->cache[slot].ref = 1;
+            return &ctx->cache[slot];
+        }
+    }
+    return NULL;
+}
+
+/* choose the slot to (re)use for a new page */
+static int csf_cache_victim(CSF_CTX *ctx) {
+    if(ctx->cache_used < ctx->cache_pages) {
+        int slot = ctx->cache_used++;
+        if(ctx->cache_policy == CSF_CACHE_LRU)
+            csf_cache_lru_link(ctx, slot, 0);
+        return slot;
+    }
+
+    if(ctx->cache_policy == CSF_CACHE_CLOCK) {
+        for(;;) {
+            int slot = ctx->cache_hand;
+            ctx->cache_hand = (ctx->cache_hand + 1) % ctx->cache_pages;
+            if(ctx->cache[slot].ref == 0)
+                return slot;
+            ctx->cache[slot].ref = 0;
+        }
+    }
+    return ctx->cache_lru_tail;
+}
+
+/*
+ * take a slot for page pgno, which must not be cached already, evicting another page if needed.
+ * the caller fills in the data and data_sz.
+ * returns NULL if the cache is disabled or out of memory
+ */
+static CSF_CACHE_ENTRY *csf_cache_insert(CSF_CTX *ctx, off_t pgno) {
+    CSF_CACHE_ENTRY *entry;
+    int slot, bucket;
+
+    if(ctx->cache_pages == 0 || pgno < 0)
+        return NULL;
+
+    slot = csf_cache_victim(ctx);
+    entry = &ctx->cache[slot];
+    if(slot == ctx->dirty_slot && csf_flush_dirty(ctx) < 0)
+        return NULL;
+    if(entry->pgno >= 0) {
+        csf_cache_hash_unlink(ctx, slot);
+        entry->pgno = -1;
+    }
+    if(entry->data == NULL && (entry->data = csf_malloc(ctx->data_sz)) == NULL)
+        return NULL;
+
+    if(ctx->cache_policy == CSF_CACHE_LRU) {
+        csf_cache_lru_unlink(ctx, slot);
+        csf_cache_lru_link(ctx, slot, 1);
+    }
+    bucket = pgno & (ctx->cache_nbuckets - 1);
+    entry->pgno = pgno;
+    entry->data_sz = 0;
+    entry->ref = 1;
+    entry->hash_next = ctx->cache_hash[bucket];
+    ctx->cache_hash[bucket] = slot;
+    return entry;
+}
+
+/* drop every cached page in [from_pgno, to_pgno). freed slots are reused first */
+static void csf_cache_invalidate(CSF_CTX *ctx, off_t from_pgno, off_t to_pgno) {
+    int slot;
+
+    for(slot = 0; slot < ctx->cache_used; slot++) {
+        CSF_CACHE_ENTRY *entry = &ctx->cache[slot];
+        if(entry->pgno >= from_pgno && entry->pgno < to_pgno) {
+            csf_cache_hash_unlink(ctx, slot);
+            entry->pgno = -1;
+            entry->ref = 0;
+            if(slot == ctx->dirty_slot)
+                ctx->dirty_slot = -1;
+            if(ctx->cache_policy == CSF_CACHE_LRU) {
+                csf_cache_lru_unlink(ctx, slot);
+                csf_cache_lru_link(ctx, slot, 0);
+            }
+        }
+    }
+}
+
+/*
+ * locate the decrypted data of page pgno, reading and decrypting it into the cache on a miss.
+ * *data_out points to the cache slot, or to ctx->csf_buffer when the cache is disabled;
+ * it stays valid until the next page is fetched. bytes past the returned data size are zero.
+ * returns the number of data bytes on the page, or CSF_PAGE_BAD (errno EBADMSG) if it failed
+ * authentication, in which case the data is all zeros
+ */
+static int csf_fetch_page(CSF_CTX *ctx, off_t pgno, unsigned char **data_out) {
+    CSF_CACHE_ENTRY *entry = csf_cache_lookup(ctx, pgno);
+    unsigned char *buf;
+    int data_sz;
+
+    if(entry) {
+        ctx->stats.cache_hits++;
+        *data_out = entry->data;
+        return entry->data_sz;
+    }
+
+    ctx->stats.cache_misses++;
+    entry = csf_cache_insert(ctx, pgno);
+    buf = entry ? entry->data : ctx->csf_buffer;
+    data_sz = csf_ra_take(ctx, pgno, buf);
+    if(data_sz < 0)
+        data_sz = csf_read_page(ctx, pgno, buf);
+    if(data_sz >= 0)
+        memset(buf + data_sz, 0, ctx->data_sz - data_sz);
+
+    // only pages that decrypted to some data are worth keeping
+    if(entry) {
+        if(data_sz > 0)
+            entry->data_sz = data_sz;
+        else
+            csf_cache_invalidate(ctx, pgno, pgno + 1);
+    }
+    *data_out = buf;
+    return data_sz;
+}
+
+/*
+ * a zeroed buffer for page pgno, to be filled in and written by the caller without reading the
+ * page first. the buffer is a cache slot, so that the written page stays cached
+ */
+static unsigned char *csf_blank_page(CSF_CTX *ctx, off_t pgno) {
+    CSF_CACHE_ENTRY *entry = csf_cache_lookup(ctx, pgno);
+    unsigned char *buf;
+
+    if(entry == NULL)
+        entry = csf_cache_insert(ctx, pgno);
+    buf = entry ? entry->data : ctx->csf_buffer;
+    memset(buf, 0, ctx->data_sz);
+    if(entry)
+        entry->data_sz = 0;
+    return buf;
+}
+
+/*
+ * write back: record that the cached page pgno now holds data_sz bytes that are not on disk.
+ * a different page left dirty earlier is written out first, so at most one page is ever dirty.
+ * returns -1 if that write fails, or if pgno is not cached and the caller must write it itself
+ */
+static int csf_mark_dirty(CSF_CTX *ctx, off_t pgno, int data_sz) {
+    CSF_CACHE_ENTRY *entry;
+
+    if(ctx->dirty_slot >= 0 && ctx->cache[ctx->dirty_slot].pgno != pgno && csf_flush_dirty(ctx) < 0)
+        return -1;
+    entry = csf_cache_lookup(ctx, pgno);
+    if(entry == NULL)
+        return -1;
+    entry->data_sz = data_sz;
+    ctx->dirty_slot = entry - ctx->cache;
+    return 0;
+}
+
+/*
+ * encrypt and write out the page left dirty by a write back mode csf_write, if any.
+ * returns 0 on success, -1 if the page could not be written (its data is lost)
+ */
+static int csf_flush_dirty(CSF_CTX *ctx) {
+    CSF_CACHE_ENTRY *entry;
+
+    if(ctx->dirty_slot < 0)
+        return 0;
+    entry = &ctx->cache[ctx->dirty_slot];
+    ctx->dirty_slot = -1;
+    TRACE3("csf_flush_dirty(%d), pgno=%lld\n", ctx->fh, entry->pgno);
+    if((int)csf_write_page(ctx, entry->pgno, entry->data, entry->data_sz) < 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * write out the dirty page, if any, and record the plaintext size in the file header
+ * returns 0 on success, -1 on failure
+ */
+int csf_flush(CSF_CTX *ctx) {
+    int rc = 0;
+    TRACE_START(tr);
+
+    if(csf_lend(ctx) < 0)
+        return -1;
+    if(csf_lock(ctx, 0, 0, CSF_LOCK_FILE) < 0) {
+        csf_return(ctx);
+        return -1;
+    }
+    if(csf_flush_dirty(ctx) < 0) {
+        rc = -1;
+    } else if(ctx->shared) {
+        rc = csf_shared_flush(ctx);
+    } else if(ctx->hdr_dirty) {
+        if((int)csf_write_header(ctx, 1) < HDR_SZ)
+            rc = -1;
+        else
+            ctx->hdr_dirty = 0;
+    }
+    if(csf_unlock(ctx) < 0)
+        rc = -1;
+    csf_return(ctx);
+    TRACE_EVENT(tr, CSF_TRACE_FLUSH, ctx, 0, 0, rc);
+    return rc;
+}
+
+/*
+ * durability. a context syncs the file when csf_sync is called, and otherwise as its
+ * CSF_CONFIG.durability has it: not at all, at the end of every write call, or at the end of
+ * a group commit that the write calls of the context, or of all the cursors of a shared file,
+ * wait for together.
+ */
+
+/*
+ * fdatasync (CSF_SYNC_DATA) or fsync (CSF_SYNC_FULL) fd, the file of ctx or its journal.
+ * not tried again on failure: the kernel may have dropped the pages it could not write, so
+ * a sync that succeeds after it would not mean they are on disk
+ */
+static int csf_sys_sync(CSF_CTX *ctx, int fd, int mode) {
+    uint64_t start = csf_now_ns();
+    int rc;
+
+    ctx->stats.syscalls++;
+    ctx->stats.syncs++;
+    rc = (mode == CSF_SYNC_FULL) ? fsync(fd) : fdatasync(fd);
+    ctx->stats.sync_ns += csf_now_ns() - start;
+    return rc;
+}
+
+/*
+ * group commit, for CSF_DURABLE_GROUP. a write call notes itself in the group, and waits for
+ * a sync that covers it. the first writer to find no sync under way leads the next one: it
+ * holds the window open for CSF_CONFIG.group_commit_us from the oldest write waiting, or until
+ * group_commit_bytes are waiting, then syncs once for all the writes noted by then. writes
+ * noted while it syncs wait for the next. a failed sync fails its writes and all later ones:
+ * the pages it covered may be lost, and a later sync that succeeds would not tell
+ */
+struct csf_group {
+    int refs;                     // the context's, and one for each other cursor of a shared file
+    pthread_mutex_t lock;
+    pthread_cond_t join_cv;       // the leader waits here while the window is open
+    pthread_cond_t done_cv;       // the other writers wait here for the sync that covers them
+    uint64_t window_ns;           // CSF_CONFIG.group_commit_us
+    size_t window_bytes;          // CSF_CONFIG.group_commit_bytes, 0 for no limit
+    uint64_t noted;               // writes noted so far
+    uint64_t synced;              // writes covered by the syncs made so far
+    uint64_t first_ns;            // when the oldest write the next sync covers was noted, 0 if none
+    size_t pending;               // bytes of the writes the next sync covers
+    int leading;                  // a writer holds the window open, or is syncing
+    int error;                    // errno of the sync that failed, 0 while none has
+};
+
+static struct csf_group *csf_group_new(const CSF_CONFIG *config) {
+    struct csf_group *group = csf_malloc(sizeof(struct csf_group));
+    pthread_condattr_t attr;
+
+    if(group == NULL)
+        return NULL;
+    group->refs = 1;
+    group->window_ns = (config->group_commit_us > 0) ? (uint64_t)config->group_commit_us * 1000 : 0;
+    group->window_bytes = (config->group_commit_bytes > 0) ? config->group_commit_bytes : 0;
+    pthread_mutex_init(&group->lock, NULL);
+    // the window is timed on CLOCK_MONOTONIC, as csf_now_ns
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&group->join_cv, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&group->done_cv, NULL);
+    return group;
+}
+
+static struct csf_group *csf_group_ref(struct csf_group *group) {
+    __atomic_add_fetch(&group->refs, 1, __ATOMIC_RELAXED);
+    return group;
+}
+
+static void csf_group_free(struct csf_group *group) {
+    if(group == NULL || __atomic_sub_fetch(&group->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    pthread_mutex_destroy(&group->lock);
+    pthread_cond_destroy(&group->join_cv);
+    pthread_cond_destroy(&group->done_cv);
+    csf_free(group, sizeof(struct csf_group));
+}
+
+/*
+ * note a write call of nbyte bytes on ctx, already made, and wait for a sync that covers it.
+ * returns 0, or -1 with the errno of the sync that failed, if it or one before it did
+ */
+static int csf_group_commit(CSF_CTX *ctx, size_t nbyte) {
+    struct csf_group *group = ctx->group;
+    uint64_t seq, target, deadline;
+    struct timespec ts;
+    int rc, led = 0;
+
+    pthread_mutex_lock(&group->lock);
+    seq = ++group->noted;
+    if(group->first_ns == 0)
+        group->first_ns = csf_now_ns();
+    group->pending += nbyte;
+    if(group->window_bytes && group->pending >= group->window_bytes)
+        pthread_cond_signal(&group->join_cv);
+    while(group->synced < seq && !group->error) {
+        if(group->leading) {
+            pthread_cond_wait(&group->done_cv, &group->lock);
+            continue;
+        }
+        group->leading = 1;
+        deadline = group->first_ns + group->window_ns;
+        while((!group->window_bytes || group->pending < group->window_bytes) && csf_now_ns() < deadline) {
+            ts.tv_sec = deadline / 1000000000;
+            ts.tv_nsec = deadline % 1000000000;
+            pthread_cond_timedwait(&group->join_cv, &group->lock, &ts);
+        }
+        target = group->noted;
+        group->first_ns = 0;
+        group->pending = 0;
+        pthread_mutex_unlock(&group->lock);
+        rc = csf_sys_sync(ctx, ctx->fh, CSF_SYNC_DATA);
+        pthread_mutex_lock(&group->lock);
+        if(rc < 0)
+            group->error = errno ? errno : EIO;
+        group->synced = target;
+        group->leading = 0;
+        led = 1;
+        pthread_cond_broadcast(&group->done_cv);
+    }
+    rc = group->error;
+    pthread_mutex_unlock(&group->lock);
+    if(rc) {
+        errno = rc;
+        return -1;
+    }
+    if(!led)
+        ctx->stats.sync_shared++;
+    return 0;
+}
+
+/*
+ * redo journal, for CSF_CONFIG.journal_fd. a write that changes more than one page, or extends
+ * the file past a gap, is captured rather than made: the raw writes to the file it makes, IVs
+ * and all, go to the journal as entries of file offset, length and bytes. at its end the
+ * record, with a digest of the entries, is written ahead of them and the journal synced: from
+ * then on the write survives a crash whole. only then are the entries copied to the file.
+ * a crash before the sync leaves a record that does not match its digest, and the file as it
+ * was. the header is marked as for any write, and synced before the write starts, so a replay
+ * finds the file id and the write epoch that the pages were written with.
+ * the last write made stays in the journal until it cannot matter any more: a new write takes
+ * its place once the file has been synced, and a change to any of its pages other than through
+ * the journal, or a truncate below its end, empties the journal first, so a replay can't undo
+ * it. so does csf_ctx_destroy. opening the file replays a write the journal holds, which is
+ * harmless if it had made it to the file before: the same bytes are written again.
+ */
+#define CSF_JOURNAL_MAGIC 0x43534A52 // "CSJR"
+
+/* start of the journal, in host byte order. the entries follow it */
+typedef struct {
+    uint32_t magic;               // CSF_JOURNAL_MAGIC
+    uint32_t page_sz;             // of the file
+    uint64_t len;                 // bytes of entries
+    uint64_t extend;              // raw length the file is extended to, 0 if it is not
+    unsigned char file_id[CSF_FILE_ID_SZ]; // of the file, so that another file's journal is not replayed on it
+    unsigned char digest[32];     // SHA-256 of the entries, then of the record up to here
+} CSF_JOURNAL_HEADER;
+
+/* an entry of the journal: len raw bytes written to the file at offset, which follow it */
+typedef struct {
+    uint64_t offset;
+    uint64_t len;
+} CSF_JOURNAL_ENTRY;
+
+struct csf_journal {
+    int fd;                       // CSF_CONFIG.journal_fd, the caller's
+    int capturing;                // a write is being added to the journal
+    off_t end;                    // journal bytes it has taken up so far, the record included
+    off_t lo, hi;                 // file bytes it covers
+    off_t extend;                 // raw length it extends the file to, 0 if it does not
+    off_t file_sz;                // ctx->file_sz before it, to go back to if it fails
+    EVP_MD_CTX *md;               // digest of its entries
+    off_t live_lo, live_hi;       // file bytes covered by the last write made, which a replay would write again. -1 if none
+    int live_synced;              // the file was synced since that write was made
+    unsigned int synced_generation;// ctx->generation when the file was last synced: the header on disk
+};
+
+/* pread all of len bytes of the journal at pos. returns 0, or -1 on failure or at end of journal */
+static int csf_journal_pread(CSF_CTX *ctx, void *buf, size_t len, off_t pos) {
+    size_t done = 0;
+    ssize_t n;
+
+    while(done < len) {
+        ctx->stats.syscalls++;
+        n = pread(ctx->journal->fd, (unsigned char *)buf + done, len - done, pos + done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0) {
+            if(n == 0)
+                errno = EIO;
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/* pwritev all of the cnt buffers of iov to the journal at pos. iov is used up. returns 0, or -1 on failure */
+static int csf_journal_pwritev(CSF_CTX *ctx, struct iovec *iov, int cnt, off_t pos) {
+    ssize_t n;
+
+    while(cnt > 0) {
+        ctx->stats.syscalls++;
+        n = pwritev(ctx->journal->fd, iov, cnt, pos);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            return -1;
+        pos += n;
+        for(; cnt > 0 && (size_t)n >= iov->iov_len; cnt--, iov++)
+            n -= iov->iov_len;
+        if(cnt > 0) {
+            iov->iov_base = (unsigned char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/*
+ * go through the entries of the record jh: add them to the digest, or with apply set, write
+ * them to the file. returns 0, or -1 if the entries don't fit the record, or on failure
+ */
+static int csf_journal_scan(CSF_CTX *ctx, const CSF_JOURNAL_HEADER *jh, int apply) {
+    struct csf_journal *j = ctx->journal;
+    off_t pos = sizeof(CSF_JOURNAL_HEADER), end = pos + jh->len;
+    CSF_JOURNAL_ENTRY e;
+    unsigned char *buf;
+    int rc = 0;
+
+    while(rc == 0 && pos < end) {
+        if(csf_journal_pread(ctx, &e, sizeof(e), pos) < 0)
+            return -1;
+        pos += sizeof(e);
+        if(e.len > (uint64_t)(end - pos) || (buf = csf_buf_get(ctx, e.len)) == NULL)
+            return -1;
+        if(csf_journal_pread(ctx, buf, e.len, pos) < 0)
+            rc = -1;
+        else if(apply)
+            rc = (csf_pwrite_all(ctx, e.offset, buf, e.len) < 0) ? -1 : 0;
+        else if(!EVP_DigestUpdate(j->md, &e, sizeof(e)) || !EVP_DigestUpdate(j->md, buf, e.len))
+            rc = -1;
+        csf_buf_put(ctx, buf, e.len);
+        pos += e.len;
+    }
+    return rc;
+}
+
+/* the file was synced: the writes made through the journal, and the header as it stands, are on disk */
+static void csf_journal_synced(CSF_CTX *ctx) {
+    if(ctx->journal) {
+        ctx->journal->live_synced = 1;
+        ctx->journal->synced_generation = ctx->generation;
+    }
+}
+
+/* sync the header that starts a new write epoch, see csf_header_modify. returns 0, or -1 on failure */
+static int csf_epoch_sync(CSF_CTX *ctx) {
+    if(ctx->iv_ctx == NULL)
+        return 0;
+    if(csf_sys_sync(ctx, ctx->fh, CSF_SYNC_DATA) < 0)
+        return -1;
+    csf_journal_synced(ctx);
+    return 0;
+}
+
+/* empty the journal, once the last write it held is on disk. returns 0, or -1 on failure */
+static int csf_journal_retire(CSF_CTX *ctx) {
+    struct csf_journal *j = ctx->journal;
+
+    if(!j->live_synced && csf_sys_sync(ctx, ctx->fh, CSF_SYNC_DATA) < 0)
+        return -1;
+    csf_journal_synced(ctx);
+    ctx->stats.syscalls++;
+    if(ftruncate(j->fd, 0) < 0 || csf_sys_sync(ctx, j->fd, CSF_SYNC_DATA) < 0)
+        return -1;
+    j->live_lo = -1;
+    return 0;
+}
+
+/*
+ * at open: make the write the journal holds, if its record is whole, then empty the journal.
+ * a record that does not match its digest is of a write that never went ahead.
+ * returns 0, or -1 on failure, with errno EINVAL if the journal is another file's
+ */
+static int csf_journal_replay(CSF_CTX *ctx) {
+    struct csf_journal *j = ctx->journal;
+    CSF_JOURNAL_HEADER jh;
+    unsigned char digest[32];
+    struct stat st;
+
+    ctx->stats.syscalls++;
+    if(fstat(j->fd, &st) < 0)
+        return -1;
+    if(st.st_size < (off_t)sizeof(jh) || csf_journal_pread(ctx, &jh, sizeof(jh), 0) < 0 || jh.magic != CSF_JOURNAL_MAGIC)
+        return 0;
+    if(jh.len > (uint64_t)(st.st_size - sizeof(jh)) || !EVP_DigestInit_ex(j->md, EVP_sha256(), NULL) ||
+       csf_journal_scan(ctx, &jh, 0) < 0 || !EVP_DigestUpdate(j->md, &jh, offsetof(CSF_JOURNAL_HEADER, digest)) ||
+       !EVP_DigestFinal_ex(j->md, digest, NULL) || memcmp(digest, jh.digest, sizeof(digest)) != 0) {
+        TRACE2("csf_journal_replay(%d), dropping a partial record\n", ctx->fh);
+        ctx->stats.syscalls++;
+        return ftruncate(j->fd, 0);
+    }
+    if(jh.page_sz != ctx->page_sz || memcmp(jh.file_id, ctx->file_id, CSF_FILE_ID_SZ) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    TRACE3("csf_journal_replay(%d), %llu bytes\n", ctx->fh, (unsigned long long)jh.len);
+    if(csf_journal_scan(ctx, &jh, 1) < 0 || (jh.extend && csf_extend_raw(ctx, jh.extend) < 0))
+        return -1;
+    j->live_lo = 0;
+    j->live_synced = 0;
+    if(csf_journal_retire(ctx) < 0)
+        return -1;
+    ctx->stats.journal_replays++;
+    return 0;
+}
+
+/* set up the journal of ctx in fd, and make the write it holds, if any. returns 0, or -1 on failure */
+static int csf_journal_init(CSF_CTX *ctx, int fd) {
+    struct csf_journal *j = csf_malloc(sizeof(struct csf_journal));
+
+    if(j == NULL)
+        return -1;
+    j->fd = fd;
+    j->live_lo = -1;
+    j->synced_generation = ctx->generation;
+    ctx->journal = j;
+    if((j->md = EVP_MD_CTX_new()) == NULL)
+        return -1;
+    return csf_journal_replay(ctx);
+}
+
+/* at csf_ctx_destroy: empty the journal, so that nothing is replayed over later changes. returns 0, or -1 on failure */
+static int csf_journal_destroy(CSF_CTX *ctx) {
+    struct csf_journal *j = ctx->journal;
+    int rc = 0;
+
+    if(j == NULL)
+        return 0;
+    if(j->live_lo >= 0 && csf_journal_retire(ctx) < 0)
+        rc = -1;
+    EVP_MD_CTX_free(j->md);
+    csf_free(j, sizeof(struct csf_journal));
+    ctx->journal = NULL;
+    return rc;
+}
+
+/* whether a write of nbyte bytes at plaintext offset goes through the journal. ctx->file_sz is known after */
+static int csf_journal_wanted(CSF_CTX *ctx, size_t nbyte, off_t offset) {
+    off_t file_sz, start_page, page_count;
+
+    if(ctx->journal == NULL || nbyte == 0 || ctx->journal->capturing)
+        return 0;
+    file_sz = csf_file_size(ctx);
+    if(offset / ctx->data_sz != (offset + (off_t)nbyte - 1) / ctx->data_sz)
+        return 1;
+    // as csf_write_gap has it: the end page is filled up, or the file extended
+    start_page = csf_pageno_for_offset(ctx, offset);
+    page_count = csf_page_count_for_file(ctx);
+    return file_sz >= 0 && offset > file_sz && start_page >= page_count &&
+           ((page_count > 0 && file_sz % ctx->data_sz != 0) || start_page > page_count);
+}
+
+static int csf_journal_capturing(CSF_CTX *ctx) {
+    return ctx->journal && ctx->journal->capturing;
+}
+
+/*
+ * start a write that goes through the journal. the header is marked for it first, and the file
+ * synced if the header changed since it last was, or the last write in the journal may not be
+ * on disk, as the new write is about to take its place.
+ * returns 0, or -1 on failure
+ */
+static int csf_journal_begin(CSF_CTX *ctx) {
+    struct csf_journal *j = ctx->journal;
+
+    if(csf_header_modify(ctx) < 0)
+        return -1;
+    if((j->synced_generation != ctx->generation || (j->live_lo >= 0 && !j->live_synced))) {
+        if(csf_sys_sync(ctx, ctx->fh, CSF_SYNC_DATA) < 0)
+            return -1;
+        csf_journal_synced(ctx);
+    }
+    if(!EVP_DigestInit_ex(j->md, EVP_sha256(), NULL)) {
+        errno = ENOMEM;
+        return -1;
+    }
+    j->capturing = 1;
+    j->end = sizeof(CSF_JOURNAL_HEADER);
+    j->lo = CSF_PGNO_MAX;
+    j->hi = 0;
+    j->extend = 0;
+    j->file_sz = ctx->file_sz;
+    return 0;
+}
+
+/* add len raw bytes written to the file at start_offset to the write being captured. returns 0, or -1 on failure */
+static int csf_journal_add(CSF_CTX *ctx, off_t start_offset, const unsigned char *raw, size_t len) {
+    struct csf_journal *j = ctx->journal;
+    CSF_JOURNAL_ENTRY e;
+    struct iovec iov[2];
+
+    e.offset = start_offset;
+    e.len = len;
+    iov[0].iov_base = &e;
+    iov[0].iov_len = sizeof(e);
+    iov[1].iov_base = (void *)raw;
+    iov[1].iov_len = len;
+    if(csf_journal_pwritev(ctx, iov, 2, j->end) < 0 || !EVP_DigestUpdate(j->md, &e, sizeof(e)) || !EVP_DigestUpdate(j->md, raw, len))
+        return -1;
+    j->end += sizeof(e) + len;
+    if(start_offset < j->lo)
+        j->lo = start_offset;
+    if(start_offset + (off_t)len > j->hi)
+        j->hi = start_offset + len;
+    return 0;
+}
+
+/* csf_extend_raw for the write being captured */
+static int csf_journal_extend(CSF_CTX *ctx, off_t len) {
+    struct csf_journal *j = ctx->journal;
+
+    if(len > j->extend)
+        j->extend = len;
+    if(len > j->hi)
+        j->hi = len;
+    return 0;
+}
+
+/*
+ * finish a write that went through the journal. one that was made whole (ok) is committed, then
+ * copied to the file. one that was not is dropped, with what it left in the cache: the file is as
+ * it was. returns 0, or -1 if the write failed, or did not make it to the file
+ */
+static int csf_journal_end(CSF_CTX *ctx, int ok) {
+    struct csf_journal *j = ctx->journal;
+    off_t from = (j->lo - ctx->hdr_sz) / ctx->page_sz, to = (j->hi - ctx->hdr_sz + ctx->page_sz - 1) / ctx->page_sz;
+    CSF_JOURNAL_HEADER jh;
+    struct iovec iov;
+
+    j->capturing = 0;
+    if(ok && j->hi > 0) {
+        memset(&jh, 0, sizeof(jh));
+        jh.magic = CSF_JOURNAL_MAGIC;
+        jh.page_sz = ctx->page_sz;
+        jh.len = j->end - sizeof(jh);
+        jh.extend = j->extend;
+        memcpy(jh.file_id, ctx->file_id, CSF_FILE_ID_SZ);
+        iov.iov_base = &jh;
+        iov.iov_len = sizeof(jh);
+        ok = EVP_DigestUpdate(j->md, &jh, offsetof(CSF_JOURNAL_HEADER, digest)) && EVP_DigestFinal_ex(j->md, jh.digest, NULL) &&
+             csf_journal_pwritev(ctx, &iov, 1, 0) == 0 && csf_sys_sync(ctx, j->fd, CSF_SYNC_DATA) == 0;
+        if(!ok) {
+            // the record may have been written: it must not be replayed
+            ctx->stats.syscalls++;
+            ftruncate(j->fd, 0);
+        }
+    }
+    if(!ok) {
+        if(j->hi > 0) {
+            csf_cache_invalidate(ctx, from, to);
+            csf_ra_invalidate(ctx, from, to);
+        }
+        ctx->partial_pgno = -1;
+        ctx->file_sz = j->file_sz;
+        return -1;
+    }
+    if(j->hi == 0)
+        return 0;
+    // from here on a crash replays the write
+    j->live_lo = j->lo;
+    j->live_hi = j->hi;
+    j->live_synced = 0;
+    ctx->stats.journal_writes++;
+    if(csf_journal_scan(ctx, &jh, 1) < 0 || (j->extend && csf_extend_raw(ctx, j->extend) < 0)) {
+        csf_cache_invalidate(ctx, from, to);
+        csf_ra_invalidate(ctx, from, to);
+        ctx->partial_pgno = -1;
+        return -1;
+    }
+    csf_ra_invalidate(ctx, from, to);
+    return 0;
+}
+
+/*
+ * before file bytes [from, to) are changed other than through the journal: empty it if the last
+ * write it holds covers any of them. returns 0, or -1 on failure
+ */
+static int csf_journal_guard(CSF_CTX *ctx, off_t from, off_t to) {
+    struct csf_journal *j = ctx->journal;
+
+    if(j == NULL || j->live_lo < 0 || to <= j->live_lo || from >= j->live_hi)
+        return 0;
+    return csf_journal_retire(ctx);
+}
+
+/*
+ * the end of a write call under ctx->durability: nbyte bytes were written, 0 for a truncate.
+ * called once the locks of the call are let go, so that other writers can join a group commit
+ * meanwhile. a call made within another, as truncate makes csf_pwrite, leaves it to that one.
+ * returns 0, or -1 if the file could not be synced
+ */
+static int csf_durable(CSF_CTX *ctx, size_t nbyte) {
+    int rc;
+
+    if(ctx->durability == CSF_DURABLE_NONE || ctx->lent > 1)
+        return 0;
+    if(ctx->durability == CSF_DURABLE_GROUP)
+        rc = csf_group_commit(ctx, nbyte);
+    else
+        rc = csf_sys_sync(ctx, ctx->fh, CSF_SYNC_DATA);
+    if(rc == 0)
+        csf_journal_synced(ctx);
+    return rc;
+}
+
+/*
+ * write out the dirty page and the header, as csf_flush does, then have everything written to
+ * the file reach stable storage: with fdatasync for CSF_SYNC_DATA, fsync for CSF_SYNC_FULL.
+ * in CSF_DURABLE_GROUP mode CSF_SYNC_DATA waits for a group commit, as a write does.
+ * returns 0, or -1 on failure, with errno EINVAL for a mode not known
+ */
+int csf_sync(CSF_CTX *ctx, int mode) {
+    int rc;
+    TRACE_START(tr);
+
+    if(mode != CSF_SYNC_DATA && mode != CSF_SYNC_FULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    rc = csf_flush(ctx);
+    if(rc == 0 && mode == CSF_SYNC_DATA && ctx->group)
+        rc = csf_group_commit(ctx, 0);
+    else if(rc == 0)
+        rc = csf_sys_sync(ctx, ctx->fh, mode);
+    if(rc == 0)
+        csf_journal_synced(ctx);
+    TRACE_EVENT(tr, CSF_TRACE_SYNC, ctx, mode, 0, rc);
+    return rc;
+}
+
+/*
+ * batches for requests spanning several pages. the raw pages of a batch are read or written
+ * with a single pread/pwrite, and encrypted/decrypted in between. every page has its own IV,
+ * so pages are processed independently: with a worker pool, the caller hands out the pages of
+ * a large batch, and the workers and the calling thread each take pages until none are left.
+ * each worker keeps its own copy of the keyed cipher contexts.
+ */
+#define CSF_BATCH_ENCRYPT 1
+#define CSF_BATCH_DECRYPT 0
+#define CSF_BATCH_PENDING -2    // batch_data_sz of a page still to be decrypted
+#define CSF_BATCH_UNREAD  -3    // batch_data_sz of a page that is left to csf_fetch_page
+
+typedef struct {
+    struct csf_pool *pool;
+    pthread_t thread;
+    EVP_CIPHER_CTX *ectx;
+    EVP_CIPHER_CTX *dctx;
+    unsigned char *scratch;       // ctx->page_sz
+} CSF_WORKER;
+
+struct csf_pool {
+    CSF_CTX *ctx;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cv;       // a new batch was handed out, or shutdown
+    pthread_cond_t done_cv;       // the last page of the batch is done
+    int nworkers;                 // threads started
+    CSF_WORKER *workers;
+    int shutdown;
+    unsigned long batch_id;       // bumped for each batch
+    int op;                       // CSF_BATCH_ENCRYPT or CSF_BATCH_DECRYPT
+    const unsigned char *src;     // CSF_BATCH_ENCRYPT: data of the first page, full pages follow
+    int count;                    // pages in the batch
+    int next;                     // next page to hand out
+    int active;                   // pages handed out and not done yet
+};
+
+/*
+ * encrypt page k of a batch from src into ctx->batch_raw, or decrypt page k of ctx->batch_src
+ * into ctx->batch_dest[k] if it is pending, with the given cipher contexts.
+ * the batch starts at page ctx->batch_pgno of the file
+ */
+static void csf_batch_page(CSF_CTX *ctx, int op, const unsigned char *src, int k, EVP_CIPHER_CTX *ectx, EVP_CIPHER_CTX *dctx, unsigned char *scratch) {
+    if(op == CSF_BATCH_ENCRYPT) {
+        csf_encrypt_page(ctx, ectx, ctx->batch_pgno + k, src + (size_t)k * ctx->data_sz, ctx->data_sz, scratch, ctx->batch_raw + (size_t)k * ctx->page_sz);
+    } else if(ctx->batch_data_sz[k] == CSF_BATCH_PENDING) {
+        ctx->batch_data_sz[k] = csf_decrypt_page(ctx, dctx, ctx->batch_pgno + k, ctx->batch_src + (size_t)k * ctx->page_sz, scratch, ctx->batch_dest[k]);
+    }
+}
+
+/* take pages of the current batch until there are none left. called and returns with pool->lock held */
+static void csf_pool_work(struct csf_pool *pool, EVP_CIPHER_CTX *ectx, EVP_CIPHER_CTX *dctx, unsigned char *scratch) {
+    while(pool->next < pool->count) {
+        int k = pool->next++;
+        pool->active++;
+        pthread_mutex_unlock(&pool->lock);
+        csf_batch_page(pool->ctx, pool->op, pool->src, k, ectx, dctx, scratch);
+        pthread_mutex_lock(&pool->lock);
+        pool->active--;
+    }
+    if(pool->active == 0)
+        pthread_cond_broadcast(&pool->done_cv);
+}
+
+static void *csf_pool_main(void *arg) {
+    CSF_WORKER *w = arg;
+    struct csf_pool *pool = w->pool;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for(;;) {
+        while(!pool->shutdown && pool->batch_id == seen)
+            pthread_cond_wait(&pool->work_cv, &pool->lock);
+        if(pool->shutdown)
+            break;
+        seen = pool->batch_id;
+        csf_pool_work(pool, w->ectx, w->dctx, w->scratch);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*
+ * encrypt or decrypt count pages of a batch. batches of more than ctx->parallel_pages pages
+ * are shared with the worker pool, if there is one, smaller ones are done on this thread
+ */
+static void csf_batch_run(CSF_CTX *ctx, int op, const unsigned char *src, int count) {
+    struct csf_pool *pool = ctx->pool;
+    uint64_t start = csf_now_ns();
+    int k;
+
+    if(pool == NULL || count <= ctx->parallel_pages) {
+        for(k = 0; k < count; k++)
+            csf_batch_page(ctx, op, src, k, ctx->ectx, ctx->dctx, ctx->scratch_buffer);
+        ctx->stats.cipher_ns += csf_now_ns() - start;
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->op = op;
+    pool->src = src;
+    pool->count = count;
+    pool->next = 0;
+    pool->batch_id++;
+    pthread_cond_broadcast(&pool->work_cv);
+    csf_pool_work(pool, ctx->ectx, ctx->dctx, ctx->scratch_buffer);
+    while(pool->next < pool->count || pool->active > 0)
+        pthread_cond_wait(&pool->done_cv, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    ctx->stats.cipher_ns += csf_now_ns() - start;
+}
+
+/*
+ * start the worker threads.
+ * returns 0, or -1 if any of it failed, in which case nothing is left running
+ */
+static int csf_pool_init(CSF_CTX *ctx, int workers) {
+    struct csf_pool *pool;
+    int i;
+
+    pool = ctx->pool = csf_malloc(sizeof(struct csf_pool));
+    if(pool == NULL)
+        return -1;
+    pool->ctx = ctx;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cv, NULL);
+    pthread_cond_init(&pool->done_cv, NULL);
+    pool->workers = csf_malloc(workers * sizeof(CSF_WORKER));
+    if(pool->workers == NULL)
+        goto fail;
+
+    for(i = 0; i < workers; i++) {
+        CSF_WORKER *w = &pool->workers[i];
+        w->pool = pool;
+        w->ectx = EVP_CIPHER_CTX_new();
+        w->dctx = EVP_CIPHER_CTX_new();
+        w->scratch = csf_malloc(ctx->page_sz);
+        if(w->ectx == NULL || w->dctx == NULL || w->scratch == NULL ||
+           !EVP_CIPHER_CTX_copy(w->ectx, ctx->ectx) || !EVP_CIPHER_CTX_copy(w->dctx, ctx->dctx) ||
+           pthread_create(&w->thread, NULL, csf_pool_main, w) != 0) {
+            if(w->ectx)
+                EVP_CIPHER_CTX_free(w->ectx);
+            if(w->dctx)
+                EVP_CIPHER_CTX_free(w->dctx);
+            csf_free(w->scratch, ctx->page_sz);
+            goto fail;
+        }
+        pool->nworkers++;
+    }
+    TRACE3("csf_pool_init(%d), workers=%d\n", ctx->fh, workers);
+    return 0;
+
+fail:
+    csf_pool_destroy(ctx);
+    return -1;
+}
+
+/* stop the worker threads */
+static void csf_pool_destroy(CSF_CTX *ctx) {
+    struct csf_pool *pool = ctx->pool;
+    int i;
+
+    if(pool == NULL)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_cv);
+    pthread_mutex_unlock(&pool->lock);
+    for(i = 0; i < pool->nworkers; i++) {
+        CSF_WORKER *w = &pool->workers[i];
+        pthread_join(w->thread, NULL);
+        EVP_CIPHER_CTX_free(w->ectx);
+        EVP_CIPHER_CTX_free(w->dctx);
+        csf_free(w->scratch, ctx->page_sz);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_cv);
+    pthread_cond_destroy(&pool->done_cv);
+    csf_free(pool->workers, pool->nworkers * sizeof(CSF_WORKER));
+    csf_free(pool, sizeof(struct csf_pool));
+    ctx->pool = NULL;
+}
+
+/*
+ * readahead. once csf_pread sees CSF_READAHEAD_TRIGGER requests in a row that each start where
+ * the one before ended, a background thread reads and decrypts the pages that follow, up to
+ * window pages ahead of the reader, into a ring. reads then copy their pages out of the ring, so
+ * the disk and cipher work for the next request overlaps with the caller's use of the last one.
+ * a request elsewhere in the file stops it, as does a write to a page the ring may hold.
+ */
+#define CSF_READAHEAD_TRIGGER 2
+
+struct csf_readahead {
+    CSF_CTX *ctx;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cv;            // pages wanted, pages ready, or shutdown
+    EVP_CIPHER_CTX *dctx;         // copy of ctx->dctx for the thread
+    unsigned char *scratch;       // ctx->page_sz
+    unsigned char *raw;           // window raw pages. page pgno goes in slot pgno % window
+    unsigned char *plain;         // window decrypted data portions
+    int *data_sz;                 // data size of the page in each slot
+    int window;
+    int chunk;                    // most pages read with one pread
+    int shutdown;
+    int active;                   // the thread keeps the ring filled up to lo + window
+    int idle;                     // the thread is waiting for room in the ring
+    int reader_waiting;           // the reader is waiting for a page, so any room in the ring will do
+    unsigned long gen;            // bumped when the ring is emptied, so that a read in flight is dropped
+    off_t lo, hi;                 // pages [lo, hi) are ready in the ring
+    off_t end;                    // page count of the file, pages from here on are not read ahead
+    off_t last;                   // last page of the previous csf_pread, -1 if none. reader only
+    int runs;                     // sequential requests in a row. reader only
+    uint64_t pages, syscalls, disk_bytes, ns;   // work done by the thread, for csf_get_stats
+};
+
+/*
+ * true if the thread has pages to read. it waits for room for a whole chunk, so that the reader
+ * taking pages one at a time does not wake it for each
+ */
+static int csf_ra_wanted(struct csf_readahead *ra) {
+    off_t room = ra->lo + ra->window - ra->hi;
+
+    if(!ra->active || ra->hi >= ra->end || room <= 0)
+        return 0;
+    return room >= ra->chunk || room >= ra->end - ra->hi || ra->reader_waiting;
+}
+
+/* wake the thread if it has pages to read. called with ra->lock held */
+static void csf_ra_wake(struct csf_readahead *ra) {
+    if(ra->idle && csf_ra_wanted(ra))
+        pthread_cond_broadcast(&ra->cv);
+}
+
+static void *csf_ra_main(void *arg) {
+    struct csf_readahead *ra = arg;
+    CSF_CTX *ctx = ra->ctx;
+
+    pthread_mutex_lock(&ra->lock);
+    for(;;) {
+        unsigned long gen;
+        off_t from, n, k, got;
+        size_t len, read_sz = 0;
+        unsigned char *raw;
+        uint64_t start, syscalls = 0;
+
+        ra->idle = 1;
+        while(!ra->shutdown && !csf_ra_wanted(ra))
+            pthread_cond_wait(&ra->cv, &ra->lock);
+        ra->idle = 0;
+        if(ra->shutdown)
+            break;
+        gen = ra->gen;
+        from = ra->hi;
+        n = ra->lo + ra->window - from;
+        if(n > ra->end - from)
+            n = ra->end - from;
+        if(n > ra->chunk)
+            n = ra->chunk;
+        if(n > ra->window - from % ra->window) // a read does not wrap around the end of the ring
+            n = ra->window - from % ra->window;
+        pthread_mutex_unlock(&ra->lock);
+
+        // the slots for [from, from + n) are not in [lo, hi), so the reader does not touch them
+        start = csf_now_ns();
+        raw = ra->raw + (size_t)(from % ra->window) * ctx->page_sz;
+        len = (size_t)n * ctx->page_sz;
+        posix_fadvise(ctx->fh, ctx->hdr_sz + (from + n) * ctx->page_sz, len, POSIX_FADV_WILLNEED);
+        while(read_sz < len) {
+            int calls;
+            ssize_t bytes_read = csf_retry_pread(ctx, raw + read_sz, len - read_sz, ctx->hdr_sz + from * ctx->page_sz + read_sz, &calls);
+
+            syscalls += calls;
+            if(bytes_read <= 0)
+                break;
+            read_sz += bytes_read;
+        }
+        got = read_sz / ctx->page_sz;
+        for(k = 0; k < got; k++) {
+            int slot = (from + k) % ra->window;
+            ra->data_sz[slot] = csf_decrypt_page(ctx, ra->dctx, from + k, raw + (size_t)k * ctx->page_sz, ra->scratch,
+                                                 ra->plain + (size_t)slot * ctx->data_sz);
+        }
+
+        pthread_mutex_lock(&ra->lock);
+        ra->pages += got;
+        ra->syscalls += syscalls + 1;
+        ra->disk_bytes += read_sz;
+        ra->ns += csf_now_ns() - start;
+        if(gen != ra->gen)
+            continue;
+        ra->hi += got;
+        // end of file or a read error: the reader reads the rest itself
+        if(got < n)
+            ra->active = 0;
+        pthread_cond_broadcast(&ra->cv);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+/* empty the ring and stop the thread. called with ra->lock held */
+static void csf_ra_stop(struct csf_readahead *ra) {
+    ra->active = 0;
+    ra->gen++;
+    ra->lo = ra->hi = 0;
+    pthread_cond_broadcast(&ra->cv);
+}
+
+/*
+ * note a csf_pread of pages [first, last] of a file of page_count pages. a request that starts on
+ * the last page of the one before it, or on the page after that, is sequential. enough of them in
+ * a row start readahead from the page after last, anything else stops it
+ */
+static void csf_ra_note(CSF_CTX *ctx, off_t first, off_t last, off_t page_count) {
+    struct csf_readahead *ra = ctx->ra;
+    int seq;
+
+    if(ra == NULL)
+        return;
+    seq = ra->last >= 0 && (first == ra->last || first == ra->last + 1);
+    ra->last = last;
+    if(!seq) {
+        if(ra->runs >= CSF_READAHEAD_TRIGGER) {
+            pthread_mutex_lock(&ra->lock);
+            csf_ra_stop(ra);
+            pthread_mutex_unlock(&ra->lock);
+            posix_fadvise(ctx->fh, 0, 0, POSIX_FADV_NORMAL);
+        }
+        ra->runs = 0;
+        return;
+    }
+    if(++ra->runs < CSF_READAHEAD_TRIGGER)
+        return;
+    if(ra->runs == CSF_READAHEAD_TRIGGER)
+        posix_fadvise(ctx->fh, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    pthread_mutex_lock(&ra->lock);
+    if(ra->active) {
+        // the file may have grown since readahead started
+        ra->end = page_count;
+    } else if(!(ra->end == page_count && ra->hi > last + 1)) {
+        // (re)start after the last page read, unless the ring still holds pages up to end of file
+        ra->gen++;
+        ra->lo = ra->hi = last + 1;
+        ra->end = page_count;
+        ra->active = 1;
+    }
+    csf_ra_wake(ra);
+    pthread_mutex_unlock(&ra->lock);
+}
+
+/* true while sequential reads are being served by readahead */
+static int csf_ra_streaming(CSF_CTX *ctx) {
+    return ctx->ra && ctx->ra->runs >= CSF_READAHEAD_TRIGGER;
+}
+
+/*
+ * copy the data portion of page pgno out of the readahead ring into data, waiting for the thread
+ * if the page is on its way. pages before pgno are dropped from the ring.
+ * returns the data size of the page, or -1 if readahead does not have it
+ */
+static int csf_ra_take(CSF_CTX *ctx, off_t pgno, unsigned char *data) {
+    struct csf_readahead *ra = ctx->ra;
+    int slot, data_sz;
+
+    if(!csf_ra_streaming(ctx))
+        return -1;
+    pthread_mutex_lock(&ra->lock);
+    while(ra->active && pgno >= ra->hi && pgno < ra->lo + ra->window && pgno < ra->end) {
+        ra->reader_waiting = 1;
+        csf_ra_wake(ra);
+        pthread_cond_wait(&ra->cv, &ra->lock);
+    }
+    ra->reader_waiting = 0;
+    if(pgno < ra->lo || pgno >= ra->hi) {
+        pthread_mutex_unlock(&ra->lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    slot = pgno % ra->window;
+    data_sz = ra->data_sz[slot];
+    memcpy(data, ra->plain + (size_t)slot * ctx->data_sz, ctx->data_sz);
+
+    pthread_mutex_lock(&ra->lock);
+    ra->lo = pgno + 1;
+    csf_ra_wake(ra);
+    pthread_mutex_unlock(&ra->lock);
+    ctx->stats.readahead_hits++;
+    return data_sz;
+}
+
+/* pages [from_pgno, to_pgno) are about to be written: drop the ring if it may hold any of them */
+static void csf_ra_invalidate(CSF_CTX *ctx, off_t from_pgno, off_t to_pgno) {
+    struct csf_readahead *ra = ctx->ra;
+
+    if(!csf_ra_streaming(ctx))
+        return;
+    pthread_mutex_lock(&ra->lock);
+    if(from_pgno < ra->lo + ra->window && to_pgno > ra->lo)
+        csf_ra_stop(ra);
+    pthread_mutex_unlock(&ra->lock);
+}
+
+/*
+ * start the readahead thread with a ring of window pages.
+ * returns 0, or -1 if it failed, in which case nothing is left running
+ */
+static int csf_ra_init(CSF_CTX *ctx, int window) {
+    struct csf_readahead *ra;
+
+    ra = ctx->ra = csf_malloc(sizeof(struct csf_readahead));
+    if(ra == NULL)
+        return -1;
+    ra->ctx = ctx;
+    ra->window = window;
+    ra->chunk = (window >= 4) ? window / 4 : 1;  // the reader can start on a chunk while the next is read
+    if(ra->chunk > ctx->batch_pages)
+        ra->chunk = ctx->batch_pages;
+    ra->last = -1;
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cv, NULL);
+    ra->dctx = EVP_CIPHER_CTX_new();
+    ra->scratch = csf_malloc(ctx->page_sz);
+    ra->raw = csf_malloc_io(ctx, window * ctx->page_sz);
+    ra->plain = csf_malloc(window * ctx->data_sz);
+    ra->data_sz = csf_malloc(window * sizeof(int));
+    if(ra->dctx == NULL || ra->scratch == NULL || ra->raw == NULL || ra->plain == NULL || ra->data_sz == NULL ||
+       !EVP_CIPHER_CTX_copy(ra->dctx, ctx->dctx) || pthread_create(&ra->thread, NULL, csf_ra_main, ra) != 0) {
+        ra->shutdown = 1;  // no thread to join
+        csf_ra_destroy(ctx);
+        return -1;
+    }
+    TRACE3("csf_ra_init(%d), window=%d\n", ctx->fh, window);
+    return 0;
+}
+
+/* stop the readahead thread */
+static void csf_ra_destroy(CSF_CTX *ctx) {
+    struct csf_readahead *ra = ctx->ra;
+
+    if(ra == NULL)
+        return;
+    if(!ra->shutdown) {
+        pthread_mutex_lock(&ra->lock);
+        ra->shutdown = 1;
+        pthread_cond_broadcast(&ra->cv);
+        pthread_mutex_unlock(&ra->lock);
+        pthread_join(ra->thread, NULL);
+    }
+    pthread_mutex_destroy(&ra->lock);
+    pthread_cond_destroy(&ra->cv);
+    if(ra->dctx)
+        EVP_CIPHER_CTX_free(ra->dctx);
+    csf_free(ra->scratch, ctx->page_sz);
+    csf_free(ra->raw, ra->window * ctx->page_sz);
+    csf_free(ra->plain, ra->window * ctx->data_sz);
+    csf_free(ra->data_sz, ra->window * sizeof(int));
+    csf_free(ra, sizeof(struct csf_readahead));
+    ctx->ra = NULL;
+}
+
+/*
+ * borrow the batch buffers on the first request of a call that spans several pages. the small
+ * arrays of page sizes and destinations are allocated once and kept.
+ * returns 0, or -1 if they can't be had, in which case pages are handled one at a time
+ */
+static int csf_batch_alloc(CSF_CTX *ctx) {
+    if(ctx->batch_raw)
+        return 0;
+    if(ctx->batch_data_sz == NULL) {
+        ctx->batch_data_sz = csf_malloc(ctx->batch_pages * sizeof(int));
+        ctx->batch_dest = csf_malloc(ctx->batch_pages * sizeof(unsigned char *));
+    }
+    ctx->batch_raw = csf_buf_get(ctx, (size_t)ctx->batch_pages * ctx->page_sz);
+    ctx->batch_plain = csf_buf_get(ctx, (size_t)ctx->batch_pages * ctx->data_sz);
+    if(ctx->batch_raw && ctx->batch_plain && ctx->batch_data_sz && ctx->batch_dest)
+        return 0;
+    csf_batch_free(ctx);
+    return -1;
+}
+
+/* give the batch buffers back to the pool, at the end of a call. the plaintext one is cleared first */
+static void csf_batch_release(CSF_CTX *ctx) {
+    if(ctx->batch_plain)
+        memset(ctx->batch_plain, 0, (size_t)ctx->batch_pages * ctx->data_sz);
+    csf_buf_put(ctx, ctx->batch_raw, (size_t)ctx->batch_pages * ctx->page_sz);
+    csf_buf_put(ctx, ctx->batch_plain, (size_t)ctx->batch_pages * ctx->data_sz);
+    ctx->batch_raw = ctx->batch_plain = NULL;
+}
+
+static void csf_batch_free(CSF_CTX *ctx) {
+    csf_batch_release(ctx);
+    csf_free(ctx->batch_data_sz, ctx->batch_pages * sizeof(int));
+    csf_free(ctx->batch_dest, ctx->batch_pages * sizeof(unsigned char *));
+    ctx->batch_data_sz = NULL;
+    ctx->batch_dest = NULL;
+}
+
+/*
+ * bring the data of n pages starting at pgno into memory, n <= ctx->batch_pages.
+ * a page whose full data portion would land within out, at offset out_base + k * ctx->data_sz
+ * of a buffer of out_len bytes, goes straight there; other pages go to ctx->batch_plain.
+ * batch_dest gets where each page went.
+ * cached pages (including a dirty one) are copied from the cache. the range from the first to
+ * the last page that is not cached is read with one pread, or found in the mapping in mmap mode,
+ * and those pages are then decrypted.
+ * batch_data_sz gets the data size of each page, CSF_PAGE_BAD for one that failed
+ * authentication, or CSF_BATCH_UNREAD for a page that could not be read in full, left to
+ * csf_fetch_page.
+ * pages read here are not added to the cache, so a long read does not push out other pages.
+ * returns 0
+ */
+static int csf_batch_read(CSF_CTX *ctx, off_t pgno, int n, unsigned char *out, long long out_base, size_t out_len) {
+    int k, first = -1, last = -1;
+    ssize_t bytes_read = 0;
+    off_t offset;
+    size_t len;
+    TRACE_START(tr);
+
+    for(k = 0; k < n; k++) {
+        CSF_CACHE_ENTRY *entry = csf_cache_lookup(ctx, pgno + k);
+        long long dest = out_base + (long long)k * ctx->data_sz;
+
+        if(dest >= 0 && dest + ctx->data_sz <= (long long)out_len)
+            ctx->batch_dest[k] = out + dest;
+        else
+            ctx->batch_dest[k] = ctx->batch_plain + (size_t)k * ctx->data_sz;
+
+        if(entry) {
+            ctx->stats.cache_hits++;
+            memcpy(ctx->batch_dest[k], entry->data, entry->data_sz);
+            ctx->batch_data_sz[k] = entry->data_sz;
+        } else {
+            ctx->stats.cache_misses++;
+            ctx->batch_data_sz[k] = csf_ra_take(ctx, pgno + k, ctx->batch_dest[k]);
+            if(ctx->batch_data_sz[k] < 0) {
+                ctx->batch_data_sz[k] = CSF_BATCH_PENDING;
+                if(first < 0)
+                    first = k;
+                last = k;
+            }
+        }
+    }
+    if(first < 0) {
+        TRACE_EVENT(tr, CSF_TRACE_BATCH_READ, ctx, pgno, n, 0);
+        return 0;
+    }
+
+    offset = ctx->hdr_sz + (off_t)pgno * ctx->page_sz;
+    len = (size_t)(last - first + 1) * ctx->page_sz;
+    ctx->batch_src = csf_map_range(ctx, offset + (off_t)first * ctx->page_sz, len);
+    if(ctx->batch_src) {
+        ctx->batch_src -= (size_t)first * ctx->page_sz;
+        bytes_read = len;
+        ctx->stats.mapped_pages += last - first + 1;
+    } else {
+        ctx->batch_src = ctx->batch_raw;
+        bytes_read = csf_read_raw(ctx, offset + (off_t)first * ctx->page_sz, ctx->batch_raw + (size_t)first * ctx->page_sz, len);
+    }
+    for(k = first; k <= last; k++) {
+        // pages past a short read or a read error are left to csf_fetch_page
+        if(ctx->batch_data_sz[k] != CSF_BATCH_PENDING)
+            continue;
+        if(bytes_read < 0 || bytes_read < (ssize_t)(k - first + 1) * ctx->page_sz) {
+            ctx->batch_data_sz[k] = CSF_BATCH_UNREAD;
+        } else {
+            ctx->stats.pages_read++;
+            ctx->stats.pages_decrypted++;
+        }
+    }
+    ctx->batch_pgno = pgno;
+    csf_batch_run(ctx, CSF_BATCH_DECRYPT, NULL, n);
+    for(k = first; k <= last; k++) {
+        if(ctx->batch_data_sz[k] == CSF_PAGE_BAD)
+            ctx->stats.auth_failures++;
+    }
+    TRACE6("csf_batch_read(%d,%lld,%d), read pages %lld to %lld\n", ctx->fh, pgno, n, pgno + first, pgno + last);
+    TRACE_EVENT(tr, CSF_TRACE_BATCH_READ, ctx, pgno, n, 0);
+    return 0;
+}
+
+/*
+ * write n full pages of data starting at pgno, n <= ctx->batch_pages: the pages are
+ * encrypted, then written with one pwrite. cached copies are kept in step, and a dirty
+ * page among them is dropped since it is overwritten entirely.
+ * returns n, or 0 if the write failed
+ */
+static int csf_batch_write(CSF_CTX *ctx, off_t pgno, const unsigned char *data, int n) {
+    int k;
+    TRACE_START(tr);
+
+    if(ctx->dirty_slot >= 0 && ctx->cache[ctx->dirty_slot].pgno >= pgno && ctx->cache[ctx->dirty_slot].pgno < pgno + n)
+        ctx->dirty_slot = -1;
+    csf_ra_invalidate(ctx, pgno, pgno + n);
+
+    for(k = 0; k < n; k++)
+        csf_page_iv(ctx, pgno + k, ctx->batch_raw + (size_t)k * ctx->page_sz);
+    ctx->batch_pgno = pgno;
+    csf_batch_run(ctx, CSF_BATCH_ENCRYPT, data, n);
+    ctx->stats.pages_encrypted += n;
+
+    if(csf_write_raw(ctx, ctx->hdr_sz + (off_t)pgno * ctx->page_sz, ctx->batch_raw, (size_t)n * ctx->page_sz) < 0) {
+        csf_cache_invalidate(ctx, pgno, pgno + n);
+        TRACE_EVENT(tr, CSF_TRACE_BATCH_WRITE, ctx, pgno, n, 0);
+        return 0;
+    }
+    ctx->stats.pages_written += n;
+    for(k = 0; k < n; k++)
+        csf_cache_update(ctx, pgno + k, data + (size_t)k * ctx->data_sz, ctx->data_sz);
+    TRACE4("csf_batch_write(%d,%lld,%d)\n", ctx->fh, pgno, n);
+    TRACE_EVENT(tr, CSF_TRACE_BATCH_WRITE, ctx, pgno, n, n);
+    return n;
+}
+
+#if CSF_TRACE
+#define CSF_TRACE_RING_SZ 4096   // records kept per thread, a power of 2
+
+typedef struct csf_trace_ring {
+    struct csf_trace_ring *next; // all rings, newest first
+    uint64_t head;               // records written so far. the record at head is written next
+    CSF_TRACE_RECORD recs[CSF_TRACE_RING_SZ];
+} CSF_TRACE_RING;
+
+static pthread_mutex_t csf_trace_lock = PTHREAD_MUTEX_INITIALIZER;  // guards the list of rings only
+static CSF_TRACE_RING *csf_trace_rings;
+static int csf_trace_threads;
+static __thread CSF_TRACE_RING *csf_trace_ring;
+static __thread int csf_trace_thread;
+
+/*
+ * append a record to the ring of the calling thread, which only that thread writes to.
+ * the ring is set up on the first record. rings are never freed, so that records of threads
+ * that have exited can still be dumped
+ */
+static void csf_trace_record(int event, int fh, int64_t pgno, int64_t size, int64_t result, uint64_t start) {
+    CSF_TRACE_RING *ring = csf_trace_ring;
+    CSF_TRACE_RECORD *rec;
+
+    if(ring == NULL) {
+        ring = calloc(1, sizeof(CSF_TRACE_RING));
+        if(ring == NULL)
+            return;
+        pthread_mutex_lock(&csf_trace_lock);
+        ring->next = csf_trace_rings;
+        csf_trace_rings = ring;
+        csf_trace_thread = ++csf_trace_threads;
+        pthread_mutex_unlock(&csf_trace_lock);
+        csf_trace_ring = ring;
+    }
+    rec = &ring->recs[ring->head & (CSF_TRACE_RING_SZ - 1)];
+    rec->ts_ns = start;
+    rec->duration_ns = csf_now_ns() - start;
+    rec->event = event;
+    rec->thread = csf_trace_thread;
+    rec->fh = fh;
+    rec->pgno = pgno;
+    rec->size = size;
+    rec->result = result;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+#endif
+
+/* start (on = 1) or stop (on = 0) recording trace events, for all contexts and threads */
+void csf_trace_enable(int on) {
+#if CSF_TRACE
+    __atomic_store_n(&csf_trace_on, on, __ATOMIC_RELAXED);
+#endif
+}
+
+/*
+ * write the records held in all trace rings to fd: a CSF_TRACE_FILE_HEADER, then the records,
+ * thread by thread, oldest first. records written while the dump runs may come out torn;
+ * stop tracing first for a clean dump. see csf_trace_decode.c for reading it back.
+ * returns the number of records written, or -1 on error or if tracing is not built in
+ */
+int csf_trace_dump(int fd) {
+#if CSF_TRACE
+    CSF_TRACE_FILE_HEADER hdr;
+    CSF_TRACE_RING *ring;
+    uint64_t total = 0;
+    int rc = 0;
+
+    pthread_mutex_lock(&csf_trace_lock);
+    for(ring = csf_trace_rings; ring; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        total += (head < CSF_TRACE_RING_SZ) ? head : CSF_TRACE_RING_SZ;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = CSF_TRACE_MAGIC;
+    hdr.version = CSF_TRACE_VERSION;
+    hdr.record_sz = sizeof(CSF_TRACE_RECORD);
+    hdr.count = total;
+    if(write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+        rc = -1;
+
+    for(ring = csf_trace_rings; ring && rc == 0; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t n = (head < CSF_TRACE_RING_SZ) ? head : CSF_TRACE_RING_SZ;
+        uint64_t from = (head - n) & (CSF_TRACE_RING_SZ - 1);
+        // the oldest records run to the end of the ring, the rest wrap around to its start
+        uint64_t first = (from + n <= CSF_TRACE_RING_SZ) ? n : CSF_TRACE_RING_SZ - from;
+        ssize_t len = first * sizeof(CSF_TRACE_RECORD);
+
+        if(write(fd, &ring->recs[from], len) != len)
+            rc = -1;
+        len = (n - first) * sizeof(CSF_TRACE_RECORD);
+        if(len > 0 && write(fd, &ring->recs[0], len) != len)
+            rc = -1;
+    }
+    pthread_mutex_unlock(&csf_trace_lock);
+    return rc < 0 ? -1 : (int)total;
+#else
+    return -1;
+#endif
+}
+
+/* copy out the counters kept since the context was created or csf_reset_stats was called. returns 0 */
+int csf_get_stats(CSF_CTX *ctx, CSF_STATS *stats) {
+    struct csf_readahead *ra = ctx->ra;
+
+    memcpy(stats, &ctx->stats, sizeof(CSF_STATS));
+    if(ra) {
+        pthread_mutex_lock(&ra->lock);
+        stats->readahead_window = ra->window;
+        stats->readahead_pages = ra->pages;
+        stats->readahead_ns = ra->ns;
+        stats->syscalls += ra->syscalls;
+        stats->disk_bytes_read += ra->disk_bytes;
+        pthread_mutex_unlock(&ra->lock);
+    }
+    return 0;
+}
+
+void csf_reset_stats(CSF_CTX *ctx) {
+    struct csf_readahead *ra = ctx->ra;
+
+    memset(&ctx->stats, 0, sizeof(CSF_STATS));
+    if(ra) {
+        pthread_mutex_lock(&ra->lock);
+        ra->pages = ra->syscalls = ra->disk_bytes = ra->ns = 0;
+        pthread_mutex_unlock(&ra->lock);
+    }
+}
+
+static size_t lower_cutoff(size_t req_end, size_t page_end, size_t file_end) {
+    size_t lowest = (req_end < page_end) ? req_end : page_end;
+    lowest = (lowest < file_end) ? lowest: file_end;
+    return lowest;
+}
+
+/* read from an encrypted file nbyte bytes of data, starting at plaintext offset, into data buffer
+ * max size of data returned is not data_sz or page_sz, it can be larger
+ * it reads each csf page in which the data resides and copies them into one buffer
+ * neither ctx->seek_ptr nor the fd seek pointer is used or moved
+ * returns number of bytes read on success
+ * returns -1 on failures
+ *    - file header mismatch
+ *    - page magic mismatch
+ *    - GCM page that failed authentication, errno EBADMSG. the read stops short at such a
+ *      page if it got data before it
+ */
+static size_t csf_do_pread(CSF_CTX *ctx, void *databuf, size_t nbyte, off_t offset) {
+    TRACE_START(tr);
+
+    TRACE2("csf_pread(%lld)\n", offset);
+    // starting csf page
+    const off_t start_page = csf_pageno_for_offset(ctx, offset);
+
+    // starting offset translated to offset within the page
+    int start_offset = offset % ctx->data_sz;
+    //int first_start_offset = start_offset; // how much to subtract from last read
+
+    // this is the last byte to read, starting from current page, offset 0
+    // used to determine number of pages to iterate over in loop below
+    size_t lastbyte_to_read = nbyte + start_offset;
+    const off_t pages_to_read = csf_page_count_for_length(ctx, lastbyte_to_read);
+
+    // now lastbyte_to_read tracks the number of bytes left to read
+    // it is updated after every page read, relative to start of current page.
+    lastbyte_to_read = nbyte;
+
+    // total page count for file.
+    // used as bounds check over the loop, to avoid read past last page
+    // that check should really be for page_count minus start_page
+    off_t total_page_count = csf_page_count_for_file(ctx);
+    off_t page_count_to_EOF = total_page_count - start_page;
+    off_t i;
+    size_t data_offset = 0;
+    size_t total_bytes_read = 0;
+    // multi-page requests bring their pages in a batch at a time, read with one pread
+    int batched = pages_to_read > 1 && csf_batch_alloc(ctx) == 0;
+    off_t batch_start = 0;
+    int batch_n = 0;
+
+    if(nbyte > 0 && start_page < total_page_count)
+        csf_ra_note(ctx, start_page, start_page + pages_to_read - 1, total_page_count);
 
-    memcpy((void*)cfh, header, HDR_SZ);
+    // a small read from a page that is not cached decrypts only the cipher blocks it needs.
+    // a sequential reader gets its pages from readahead instead
+    if(pages_to_read == 1 && !csf_ra_streaming(ctx) && start_page < total_page_count && nbyte > 0 && nbyte <= ctx->data_sz / CSF_PARTIAL_READ_RATIO) {
+        int bytes_read = csf_read_partial(ctx, start_page, databuf, start_offset, nbyte);
+        if(bytes_read >= 0) {
+            ctx->stats.bytes_read += bytes_read;
+            TRACE_EVENT(tr, CSF_TRACE_PREAD, ctx, offset, nbyte, bytes_read);
+            return bytes_read;
+        }
+    }
+
+    // loop over csf pages to read, reading them in entirety using csf_fetch_page
+    // printf("in csf_pread (offset=%ld, size=%d)=>([startpage=%d startoff=%d], [pages_to_read=%d, lastbyteoff=%d])\n" ,
+    //    (unsigned int)offset, nbyte,   start_page, start_offset,  pages_to_read, lastbyte_to_read);
+
+    for(i = 0; i < pages_to_read && i < total_page_count; i++) { /* dont read past end of file */
+
+        if(i > page_count_to_EOF) {
+//            printf("=========> reading page past EOF\n");
+            ctx->seekPastEndOfFile = 1;
+        }
+
+        // read in the full page in csf_buffer, startng from page offset 0 to ctx->data_sz (not fh->seek)
+        // retval which indicates bytes available comes from the header value
+        // if it is less than data_sz, then that's the max amount of data we can read.
+        unsigned char *page;
+        int data_bytes_in_page;
+
+        if(batched && i >= batch_start + batch_n) {
+            off_t left = (pages_to_read < total_page_count ? pages_to_read : total_page_count) - i;
+            batch_start = i;
+            batch_n = (left < ctx->batch_pages) ? left : ctx->batch_pages;
+            // whole pages are decrypted straight into databuf, at their place were all pages before them full
+            csf_batch_read(ctx, start_page + i, batch_n, databuf, (long long)data_offset - start_offset, nbyte);
+        }
+        if(batched && ctx->batch_data_sz[i - batch_start] != CSF_BATCH_UNREAD) {
+            page = ctx->batch_dest[i - batch_start];
+            data_bytes_in_page = ctx->batch_data_sz[i - batch_start];
+        } else {
+            data_bytes_in_page = csf_fetch_page(ctx, start_page + i, &page);
+        }
+
+        if(data_bytes_in_page <0) { // the page failed authentication
+            ctx->stats.bytes_read += total_bytes_read;
+            TRACE_EVENT(tr, CSF_TRACE_PREAD, ctx, offset, nbyte, total_bytes_read ? (int64_t)total_bytes_read : -1);
+            errno = EBADMSG;
+            return total_bytes_read ? total_bytes_read : (size_t)-1;
+        }
+
+        // we want to find how much data to read within each page
+        // startpoint is determined by
+        //  1. current seek pointer
+        // endpoint is determined by min of
+        //  1. user request (lastbyte_to_read)
+        //  2. end of page  (ctx->data_sz)
+        //  3. end of file  (data_bytes_in_page)
+        // after read we know 3, so now we know all parameters
+
+        // if last byte is less than max data size, then use that lower value, otherwise read max data size
+        // this isn't actually passed to csf_read_page, which reads the entire page
+        // it is used by us to determine the relevant data. that may be modified by the actual size available within page
+        // lastbyte_within_page needs to relative to the start_offset if it is smaller than pgsz
+        size_t lastbyte_within_page = (lastbyte_to_read < ctx->data_sz) ? lastbyte_to_read+start_offset: lastbyte_to_read;
+
+        size_t endcutoff = lower_cutoff(lastbyte_within_page, ctx->data_sz, data_bytes_in_page);
+        //printf("===== endcutoff is %d start_offset is %d\n", endcutoff, start_offset);
+
+        if(endcutoff > start_offset) {
+            size_t bytes_to_copy = endcutoff - start_offset;
+            //printf("===== bytes to copy ares %d %d %d %d\n", bytes_to_copy, lastbyte_to_read, ctx->data_sz, data_bytes_in_page);
+            // a page decrypted into databuf is already in place, unless a short page came before it
+            if(page + start_offset != (unsigned char *)databuf + data_offset)
+                memmove(databuf + data_offset, page + start_offset, bytes_to_copy);
+
+            lastbyte_to_read -=  bytes_to_copy;
+            total_bytes_read +=  bytes_to_copy;
+            data_offset += bytes_to_copy;
+            start_offset = 0; /* after the first iteration the start offset will always be at the beginning of the page */
+        } else {
+            // printf("breaking at EOF\n");
+            // we hit a page where the available data is less than our start offset for read
+            // this would indicate EOF so we break.
+            // doing this we should be able to avoid the earlier file size check
+            break;
+        }
+    }
+
+    ctx->stats.bytes_read += total_bytes_read;
+    TRACE6("csf_pread(%d,x,%ld,%lld), pages_to_read = %lld, return=%ld\n", ctx->fh, nbyte, offset, pages_to_read, data_offset);
+    TRACE_EVENT(tr, CSF_TRACE_PREAD, ctx, offset, nbyte, total_bytes_read);
+    return total_bytes_read;
+}
+
+size_t csf_pread(CSF_CTX *ctx, void *databuf, size_t nbyte, off_t offset) {
+    size_t rc;
+
+    if(csf_lend(ctx) < 0)
+        return -1;
+    if(csf_lock(ctx, offset, nbyte, CSF_LOCK_READ) < 0) {
+        csf_return(ctx);
+        return -1;
+    }
+    rc = csf_do_pread(ctx, databuf, nbyte, offset);
+    csf_unlock(ctx);
+    csf_return(ctx);
+    return rc;
+}
+
+/* read from the current seek pointer, see csf_pread. advances the seek pointer by the bytes read */
+size_t csf_read(CSF_CTX *ctx, void *databuf, size_t nbyte) {
+    ssize_t bytes_read = csf_pread(ctx, databuf, nbyte, ctx->seek_ptr);
+
+    if(bytes_read > 0)
+        ctx->seek_ptr += bytes_read;
+    TRACE5("csf_read(%d,x,%ld), ctx->seek_ptr = %lld, return=%d\n", ctx->fh, nbyte, ctx->seek_ptr, bytes_read);
+    return bytes_read;
+}
+
+/* write out the VERSION_1002 (or later) file header. must be all or nothing */
+/* written at offset 0 with pwrite, the fd seek pointer is not moved */
+/* size_valid records ctx->file_sz in it, otherwise the size is marked as not valid */
+/* in O_DIRECT mode the whole first block is written, from an aligned buffer: the padding is zeros */
+/* returns number of bytes written */
+/* in case of a error returns -1 */
+static size_t csf_write_header(CSF_CTX *ctx, int size_valid) {
+    int write_sz=0;
+    CSF_FILE_HEADER cfh;
+    unsigned char buf[HDR_SZ];
+    unsigned char *header = buf;
+    int len = ctx->direct_align ? ctx->direct_align : HDR_SZ;
+
+    if(ctx->direct_align && (header = csf_malloc_io(ctx, len)) == NULL)
+        return -1;
+    memset(header, 0, len);
+    csf_create_file_header(ctx, &cfh, size_valid);
+    memcpy(header, (void *)&cfh, sizeof(cfh));
+    for(;write_sz < len;) { /* FIXME - error handling */
+        ssize_t bytes_write = csf_sys_pwrite(ctx, header + write_sz, len-write_sz, write_sz);
+        if(bytes_write < 0) {
+            if(errno) {
+//                printf("csf_write_header write received an error: %d\n", errno);
+            }
+            if(header != buf)
+                csf_free(header, len);
+            return -1;
+        }
+        write_sz += bytes_write;
+        //printf("wrote n bytes of header: %d\n", write_sz);
+    }
+    if(header != buf)
+        csf_free(header, len);
+    ctx->file_header_check = 1;
+    ctx->generation++;
+    return write_sz;
+}
+
+/* read in the file header, from offset 0 with pread
+ * should be possible to do it before creating ctx, to check file type and read page size.
+ * the fields are returned in host byte order. the caller checks the magic, as files written
+ * without a header start straight with the first page
+ * in O_DIRECT mode the first block is read whole, into an aligned buffer, with one pread: a
+ * short read is end of file
+ * returns number of bytes read in case of success, up to HDR_SZ. 0 for an empty file
+ * returns -1 if there is an error
+ */
+static int csf_read_header(CSF_CTX *ctx, CSF_FILE_HEADER *cfh) {
+    ssize_t bytes_read=0, read_sz=0;
+    unsigned char buf[HDR_SZ];
+    unsigned char *header = buf;
+    int len = ctx->direct_align ? ctx->direct_align : HDR_SZ;
+
+    if(ctx->direct_align && (header = csf_malloc_io(ctx, len)) == NULL)
+        return -1;
+    // error handling : try 3 times and return error if it still fails.
+    for(;read_sz < HDR_SZ;) {
+        bytes_read = csf_sys_pread(ctx, header + read_sz, len-read_sz, read_sz);
+        if(bytes_read < 0) { // we have a read error after 3 tries.
+            // we cannot continue else read buffer will be corrupted.
+            if(errno) {
+            //  printf("csf_read_header read received an error: %d\n", errno);
+            }
+            if(header != buf)
+                csf_free(header, len);
+            return -1;
+        }
+        if(bytes_read == 0) { // no error but we are at EOF. new or short file
+            break;
+        }
+        read_sz += bytes_read;
+        if(ctx->direct_align)
+            break;
+        //printf("read n bytes of header: %d\n", read_sz);
+    }
+    if(read_sz > HDR_SZ)
+        read_sz = HDR_SZ;
+
+    memset((void*)cfh, 0, sizeof(CSF_FILE_HEADER));
+    memcpy((void*)cfh, header, (read_sz < sizeof(CSF_FILE_HEADER)) ? read_sz : sizeof(CSF_FILE_HEADER));
+    if(header != buf)
+        csf_free(header, len);
     //printf("header values1 vers=%x magic=%x cipher=%x pgsize=%d cmpmagic=%x\n", cfh->version, cfh->magic, cfh->cipher, cfh->pagesize, FILE_MAGIC_NUM);
     cfh->version = ntohl(cfh->version);
     cfh->magic = ntohl(cfh->magic);
     cfh->cipher = ntohl(cfh->cipher);
     cfh->pagesize = ntohl(cfh->pagesize);
-    if(cfh->magic != FILE_MAGIC_NUM) {
-        //printf("header values vers=%x magic=%x cipher=%x pgsize=%d cmpmagic=%x\n", cfh->version, cfh->magic, cfh->cipher, cfh->pagesize, FILE_MAGIC_NUM);
-        // printf("not a bitzer file\n");
+    cfh->flags = ntohl(cfh->flags);
+    cfh->file_sz_hi = ntohl(cfh->file_sz_hi);
+    cfh->file_sz_lo = ntohl(cfh->file_sz_lo);
+    cfh->write_epoch = ntohl(cfh->write_epoch);
+    cfh->generation = ntohl(cfh->generation);
+    return read_sz;
+}
+
+/*
+ * find out at open time where the pages start and whether the plaintext size is known.
+ *  - an empty file gets a header of ctx->hdr_version with the first write, naming ctx->cipher:
+ *    VERSION_1004 with a new random file id, or with CSF_CONFIG.random_iv (ctx->hdr_version 0)
+ *    VERSION_1002, or VERSION_1003 with a file id for GCM. in O_DIRECT mode the header is padded
+ *    to a whole page (CSF_HDR_PADDED), so that every page starts on a block boundary.
+ *  - a file with a header is read and written with the cipher it names, one without is CBC.
+ *    GCM is only taken from a VERSION_1003 or 1004 header, which hold the file id it needs.
+ *  - a VERSION_1002 or later header gives the size, unless the file was not flushed after its
+ *    last change, and with CSF_HDR_PADDED, that pages start pagesize bytes in. the header keeps
+ *    its version and padding when it is rewritten.
+ *  - a VERSION_1001 header, or no header at all (files written while HDR_SZ was 0, which begin
+ *    with the random IV of page 0), leave the size to be found from the last page, as before.
+ *    these files are not given a new header.
+ *  - if the header can't be read (say the file is open write only), assume the current layout.
+ *    the header is not written then, and pages get random IVs.
+ * returns 0, or -1 if the header could not be read
+ */
+static int csf_load_header(CSF_CTX *ctx) {
+    CSF_FILE_HEADER cfh;
+    int bytes_read = csf_read_header(ctx, &cfh);
+
+    ctx->file_sz = -1;
+    ctx->hdr_dirty = 0;
+    ctx->hdr_size_field = 0;
+    ctx->file_header_check = 1;
+
+    if(bytes_read < 0) {
+        ctx->hdr_sz = HDR_SZ;
+        ctx->hdr_version = 0;
         return -1;
     }
-    ctx->file_header_check = 1;
+    if(bytes_read == 0) {
+        ctx->hdr_sz = ctx->direct_align ? ctx->page_sz : HDR_SZ;
+        ctx->hdr_size_field = 1;
+        ctx->file_header_check = 0;
+        ctx->file_sz = 0;
+        if(ctx->hdr_version == 0)
+            ctx->hdr_version = (ctx->cipher == CSF_CIPHER_AES_256_GCM) ? VERSION_1003 : VERSION_1002;
+        if(ctx->hdr_version != VERSION_1002 && RAND_bytes(ctx->file_id, CSF_FILE_ID_SZ) != 1)
+            return -1;
+    } else if(bytes_read >= HDR_SZ && cfh.magic == FILE_MAGIC_NUM && cfh.version >= VERSION_1002 && cfh.version <= VERSION_1004) {
+        ctx->hdr_sz = (cfh.flags & CSF_HDR_PADDED) ? (int)cfh.pagesize : HDR_SZ;
+        ctx->hdr_size_field = 1;
+        ctx->hdr_version = cfh.version;
+        ctx->cipher = csf_cipher_from_hex(cfh.cipher);
+        if((ctx->cipher == CSF_CIPHER_AES_256_GCM && cfh.version == VERSION_1002) ||
+           (ctx->cipher != CSF_CIPHER_AES_256_GCM && cfh.version == VERSION_1003))
+            ctx->cipher = -1;
+        memcpy(ctx->file_id, cfh.file_id, CSF_FILE_ID_SZ);
+        ctx->generation = cfh.generation;
+        if(cfh.version == VERSION_1004)
+            ctx->iv_epoch = ctx->hdr_epoch = cfh.write_epoch;
+        if(cfh.flags & CSF_HDR_SIZE_VALID)
+            ctx->file_sz = ((off_t)cfh.file_sz_hi << 32) | cfh.file_sz_lo;
+    } else if(bytes_read >= HDR_SZ_1001 && cfh.magic == FILE_MAGIC_NUM && cfh.version == VERSION_1001) {
+        ctx->hdr_sz = HDR_SZ_1001;
+        ctx->hdr_version = 0;
+        ctx->cipher = csf_cipher_from_hex(cfh.cipher);
+        if(ctx->cipher == CSF_CIPHER_AES_256_GCM)
+            ctx->cipher = -1;
+    } else {
+        ctx->hdr_sz = 0;
+        ctx->hdr_version = 0;
+        ctx->cipher = CSF_CIPHER_AES_256_CBC;
+    }
+    TRACE4("csf_load_header(%d), hdr_sz=%d, file_sz=%lld\n", ctx->fh, ctx->hdr_sz, ctx->file_sz);
+    return 0;
+}
+
+/*
+ * called before the file is changed. the first change after a flush writes out the header
+ * with the size marked as not valid, so that if we never get to csf_flush (say on a crash)
+ * the next open falls back to finding the size from the last page.
+ * in a VERSION_1004 file it also starts a new write epoch, so page IVs derived from now on
+ * differ from all those of earlier opens and flushes. the epoch goes past the one in the header
+ * as last seen, which in multi_process mode may have been started by another process. the
+ * header is synced before any page of the new epoch is written: were it lost in a crash, the
+ * next open would start the same epoch again, and hand out the same IVs.
+ * returns 0, or -1 if the header could not be written or synced
+ */
+static int csf_header_modify(CSF_CTX *ctx) {
+    if(ctx->shared)
+        return csf_shared_modify(ctx);
+    if(!ctx->hdr_size_field || ctx->hdr_dirty)
+        return 0;
+    if(ctx->iv_ctx) {
+        ctx->iv_epoch = (ctx->iv_epoch > ctx->hdr_epoch ? ctx->iv_epoch : ctx->hdr_epoch) + 1;
+        ctx->iv_count = 0;
+    }
+    if((int)csf_write_header(ctx, 0) < HDR_SZ || csf_epoch_sync(ctx) < 0)
+        return -1;
+    ctx->hdr_dirty = 1;
     return 0;
 }
 
 /*
- * write out set of encrypted pages to file
+ * get ready for a write to page start_page, past the end page of a file of file_sz bytes in
+ * page_count pages. whole pages in the gap are left as a hole, which takes no disk space and
+ * reads back as zeros. the file is extended up to start_page first, so that the hole is there
+ * even while start_page is held back in write back mode. the current end page is filled up.
+ * a GCM page of zeros would fail authentication, so there the gap is written out as pages of
+ * encrypted zeros instead.
+ * returns 0, or -1 if the file could not be extended or the end page written
  */
-size_t csf_write(CSF_CTX *ctx, const void *data, size_t nbyte) {
-    int start_page = csf_pageno_for_offset(ctx, ctx->seek_ptr);
-    int start_offset = ctx->seek_ptr % ctx->data_sz;
-    int to_write = nbyte + start_offset;
-    int pages_to_write = csf_page_count_for_length(ctx, to_write);
-    int i, data_offset = 0;
-    int page_count = csf_page_count_for_file(ctx);
-
-    TRACE2("in csf_write %d\n", ctx->file_header_check);
-
-    // write out the header.
-    // if there is an error, caller must try again.
-    if(ctx->file_header_check == 0) {
-        //printf("writing file header\n");
-        int hdrbytes_written = 0;
-        hdrbytes_written = csf_write_header(ctx);
-        if(hdrbytes_written < 0 || hdrbytes_written < HDR_SZ)
+static int csf_write_gap(CSF_CTX *ctx, off_t start_page, off_t file_sz, off_t page_count) {
+    if(page_count > 0 && (file_sz % ctx->data_sz) != 0) {
+        unsigned char *page;
+        /* unused data on the page is already back filled with zeros */
+        if(csf_fetch_page(ctx, page_count-1, &page) < 0 || (int)csf_write_page(ctx, page_count-1, page, ctx->data_sz) < 0)
             return -1;
     }
+    if(start_page <= page_count)
+        return 0;
+    if(!ctx->tag_sz)
+        return csf_extend_raw(ctx, ctx->hdr_sz + start_page * ctx->page_sz);
 
-    // TBD: Error handling for writes of empty pages.
-    if(start_page > page_count) {
-        /* this is a seek past end of file. we need to fill in the gap. sorry no sparse files */
-        int i;
-
-        /* start by rewriting the current end page */
-        if(page_count > 0) {
-            size_t data_sz = csf_read_page(ctx, page_count-1, ctx->csf_buffer);
-            memset(ctx->csf_buffer + data_sz, 0, ctx->data_sz - data_sz); /* back fill an unused data on page with zeros */
-            data_sz = csf_write_page(ctx, page_count-1, ctx->csf_buffer, ctx->data_sz);
-            assert(data_sz == ctx->data_sz);
+    if(csf_batch_alloc(ctx) == 0) {
+        memset(ctx->batch_plain, 0, (size_t)ctx->batch_pages * ctx->data_sz);
+        for(; page_count < start_page; page_count += ctx->batch_pages) {
+            int n = (start_page - page_count < ctx->batch_pages) ? start_page - page_count : ctx->batch_pages;
+            if(csf_batch_write(ctx, page_count, ctx->batch_plain, n) < n)
+                return -1;
         }
-
-        /* loop through the next page on through the n-1 page, fill up with zero data */
-        memset(ctx->csf_buffer, 0, ctx->page_sz); // zero out the data!
-        for(i = page_count; i < start_page - 1; i++) {
-            csf_write_page(ctx, i, ctx->csf_buffer, ctx->data_sz);
+    } else {
+        memset(ctx->csf_buffer, 0, ctx->data_sz);
+        for(; page_count < start_page; page_count++) {
+            if((int)csf_write_page(ctx, page_count, ctx->csf_buffer, ctx->data_sz) < 0)
+                return -1;
         }
+    }
+    return 0;
+}
+
+/*
+ * write out set of encrypted pages to file, starting at plaintext offset
+ * neither ctx->seek_ptr nor the fd seek pointer is used or moved
+ */
+static size_t csf_do_pwrite(CSF_CTX *ctx, const void *data, size_t nbyte, off_t offset) {
+    off_t start_page = csf_pageno_for_offset(ctx, offset);
+    int start_offset = offset % ctx->data_sz;
+    size_t to_write = nbyte + start_offset;
+    off_t pages_to_write = csf_page_count_for_length(ctx, to_write);
+    off_t i;
+    size_t data_offset = 0;
+    off_t file_sz = csf_file_size(ctx);
+    off_t page_count = csf_page_count_for_file(ctx);
+    // runs of whole pages in multi-page requests are written a batch at a time, with one pwrite
+    int batched = pages_to_write > 1 && csf_batch_alloc(ctx) == 0;
+    TRACE_START(tr);
+
+    TRACE2("in csf_pwrite %d\n", ctx->file_header_check);
+
+    // write out the header, or mark its size as changing.
+    // if there is an error, caller must try again.
+    if(file_sz < 0 || csf_header_modify(ctx) < 0) {
+        TRACE_EVENT(tr, CSF_TRACE_PWRITE, ctx, offset, nbyte, -1);
+        return -1;
+    }
 
-        /* take the last page, and write out the proper number of bytes to reach the target offset */
-        csf_write_page(ctx, start_page-1, ctx->csf_buffer, ctx->seek_ptr % ctx->data_sz);
+    /* this is a seek past end of file. the zeros before offset on start_page itself are filled in below */
+    if(start_page >= page_count && offset > file_sz && csf_write_gap(ctx, start_page, file_sz, page_count) < 0) {
+        TRACE_EVENT(tr, CSF_TRACE_PWRITE, ctx, offset, nbyte, -1);
+        return -1;
     }
 
     for(i = 0; i < pages_to_write; i++) {
@@ -781,19 +4029,51 @@ size_t csf_write(CSF_CTX *ctx, const void *data, size_t nbyte) {
         int l_data_sz = data_sz - start_offset;
         int bytes_write = 0;
         int cur_page_bytes = 0;
+        unsigned char *page;
+
+        if(batched && start_offset == 0 && to_write >= ctx->data_sz) {
+            int n = (to_write / ctx->data_sz < ctx->batch_pages) ? to_write / ctx->data_sz : ctx->batch_pages;
+            int written;
 
-        if(page_count > (start_page + i)) {
-            cur_page_bytes = csf_read_page(ctx, start_page + i, ctx->csf_buffer); /* FIXME error hndling */
-            if(cur_page_bytes < 0) { // error reading in the page
+            written = csf_batch_write(ctx, start_page + i, data + data_offset, n);
+            to_write -= written * ctx->data_sz;
+            data_offset += written * ctx->data_sz;
+            if(written < n) // write failure. stop writing further pages.
+                break;
+            i += n - 1;
+            continue;
+        }
+
+        if(page_count > (start_page + i) && l_data_sz < ctx->data_sz) {
+            /* read-modify-write of a partially overwritten page, usually served by the page cache */
+            ctx->stats.rmw_cycles++;
+            cur_page_bytes = csf_fetch_page(ctx, start_page + i, &page);
+            if(cur_page_bytes < 0) { // the page failed authentication: leave it as it is
             //  printf("csf_write_page: error reading page no=%d: errno=%d\n", start_page+i, errno);
+                if(data_offset == 0) {
+                    TRACE_EVENT(tr, CSF_TRACE_PWRITE, ctx, offset, nbyte, -1);
+                    return -1;
+                }
+                break;
             }
         } else {
+            /* new page, or one that is overwritten entirely: nothing to read */
             cur_page_bytes = 0;
+            page = csf_blank_page(ctx, start_page + i);
         }
 
-        memcpy(ctx->csf_buffer + start_offset, data + data_offset, l_data_sz);
+        memcpy(page + start_offset, data + data_offset, l_data_sz);
 
-        bytes_write = csf_write_page(ctx, start_page + i, ctx->csf_buffer, (data_sz < cur_page_bytes) ? cur_page_bytes : data_sz);
+        if(data_sz < cur_page_bytes)
+            data_sz = cur_page_bytes;
+        if(ctx->write_back && csf_mark_dirty(ctx, start_page + i, data_sz) == 0) {
+            /* the page is written out once the writer moves past its end */
+            bytes_write = data_sz;
+            if(start_offset + l_data_sz == ctx->data_sz && csf_flush_dirty(ctx) < 0)
+                bytes_write = -1;
+        } else {
+            bytes_write = csf_write_page(ctx, start_page + i, page, data_sz);
+        }
 
         if(bytes_write <0) { // write failure. stop writing further pages.
             // printf("csf_write_page received an error");
@@ -802,18 +4082,805 @@ size_t csf_write(CSF_CTX *ctx, const void *data, size_t nbyte) {
 
         to_write -= bytes_write; /* to_write is already adjusted for start_offset */
         data_offset += l_data_sz;
-        ctx->seek_ptr += l_data_sz;
         start_offset = 0; /* after the first iteration the start offset will always be at the beginning of the page */
-        memset(ctx->csf_buffer, 0, ctx->page_sz);
     }
 
-    TRACE6("csf_write(%d,x,%ld), pages_to_write = %d, ctx->seek_ptr = %lld, return=%d\n", ctx->fh, nbyte, pages_to_write, ctx->seek_ptr, data_offset);
+    ctx->stats.bytes_written += data_offset;
+    if(offset + data_offset > ctx->file_sz)
+        ctx->file_sz = offset + data_offset;
+
+    TRACE6("csf_pwrite(%d,x,%ld,%lld), pages_to_write = %lld, return=%ld\n", ctx->fh, nbyte, offset, pages_to_write, data_offset);
+    TRACE_EVENT(tr, CSF_TRACE_PWRITE, ctx, offset, nbyte, data_offset);
     return data_offset;
 }
 
+size_t csf_pwrite(CSF_CTX *ctx, const void *data, size_t nbyte, off_t offset) {
+    size_t rc;
+    int journaled;
+
+    if(csf_lend(ctx) < 0)
+        return -1;
+    if(csf_lock(ctx, offset, nbyte, CSF_LOCK_WRITE) < 0) {
+        csf_return(ctx);
+        return -1;
+    }
+    journaled = csf_journal_wanted(ctx, nbyte, offset);
+    if(journaled && csf_journal_begin(ctx) < 0) {
+        rc = -1;
+    } else {
+        rc = csf_do_pwrite(ctx, data, nbyte, offset);
+        if(journaled && csf_journal_end(ctx, rc == nbyte) < 0)
+            rc = -1;
+    }
+    if(csf_unlock(ctx) < 0)
+        rc = -1;
+    if((ssize_t)rc > 0 && csf_durable(ctx, rc) < 0)
+        rc = -1;
+    csf_return(ctx);
+    return rc;
+}
+
+/* write at the current seek pointer, see csf_pwrite. advances the seek pointer by the bytes written */
+size_t csf_write(CSF_CTX *ctx, const void *data, size_t nbyte) {
+    ssize_t bytes_written = csf_pwrite(ctx, data, nbyte, ctx->seek_ptr);
+
+    if(bytes_written > 0)
+        ctx->seek_ptr += bytes_written;
+    TRACE5("csf_write(%d,x,%ld), ctx->seek_ptr = %lld, return=%d\n", ctx->fh, nbyte, ctx->seek_ptr, bytes_written);
+    return bytes_written;
+}
+
 /*
  input: size of the buffer to allocate
  */
+/*
+ * asynchronous i/o. a csf_aio engine takes read and write requests on any number of contexts,
+ * and runs the raw i/o for them with io_uring, or on a pool of threads where io_uring is not
+ * available. the cipher work is done by the calling thread: writes are encrypted when they are
+ * submitted, and reads decrypted when csf_aio_poll or csf_aio_wait hands them back.
+ *
+ * a request reads or writes all the pages it covers with a single operation. partially written
+ * pages at either end are read in first, synchronously, as csf_pwrite does, so a write is not
+ * taken while another write to any of its pages is in flight. a read in flight together with
+ * a write to the same pages may see the page before or after the write. a context must not be
+ * used from other threads while requests on it are in flight or being handed back.
+ */
+struct csf_aio {
+    int backend;                  // CSF_AIO_URING or CSF_AIO_THREADS
+    int depth;                    // most requests in flight
+    int inflight;                 // requests submitted and not handed back yet
+    pthread_mutex_t lock;
+    pthread_cond_t work_cv;       // CSF_AIO_THREADS: a request was queued, or shutdown
+    pthread_cond_t done_cv;       // CSF_AIO_THREADS: a request is done
+    CSF_AIO_REQ *work_head, *work_tail;     // CSF_AIO_THREADS: raw i/o not started yet
+    CSF_AIO_REQ *done_head, *done_tail;     // raw i/o over, or not needed. to be handed back
+    CSF_AIO_REQ **writes;         // writes in flight, depth entries
+    int nwrites;
+    int shutdown;
+    int nthreads;
+    pthread_t threads[CSF_AIO_POOL_THREADS];
+#if CSF_IO_URING
+    int ring_fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+    unsigned to_submit;           // entries queued on the submission ring, not yet passed to the kernel
+#endif
+};
+
+/* append req to a list of requests. lists that worker threads use are guarded by aio->lock */
+static void csf_aio_push(CSF_AIO_REQ **head, CSF_AIO_REQ **tail, CSF_AIO_REQ *req) {
+    req->next = NULL;
+    if(*tail)
+        (*tail)->next = req;
+    else
+        *head = req;
+    *tail = req;
+}
+
+static CSF_AIO_REQ *csf_aio_pop(CSF_AIO_REQ **head, CSF_AIO_REQ **tail) {
+    CSF_AIO_REQ *req = *head;
+
+    if(req) {
+        *head = req->next;
+        if(*head == NULL)
+            *tail = NULL;
+    }
+    return req;
+}
+
+static void csf_aio_done(struct csf_aio *aio, CSF_AIO_REQ *req) {
+    pthread_mutex_lock(&aio->lock);
+    csf_aio_push(&aio->done_head, &aio->done_tail, req);
+    pthread_cond_signal(&aio->done_cv);
+    pthread_mutex_unlock(&aio->lock);
+}
+
+/* is a write in flight to any page of ctx in [from_pgno, to_pgno) */
+static int csf_aio_busy(struct csf_aio *aio, CSF_CTX *ctx, off_t from_pgno, off_t to_pgno) {
+    int i;
+
+    for(i = 0; i < aio->nwrites; i++) {
+        CSF_AIO_REQ *w = aio->writes[i];
+        if(w->ctx == ctx && from_pgno < w->pgno + (off_t)(w->raw_len / ctx->page_sz) && to_pgno > w->pgno)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * set up req for its raw i/o: the pages it covers, and for a write those pages encrypted.
+ * returns 1 if there is i/o to do, 0 if the request is complete already, with result set,
+ * or -1 if it is a write that has to wait for one in flight
+ */
+static int csf_aio_prepare(struct csf_aio *aio, CSF_AIO_REQ *req) {
+    CSF_CTX *ctx = req->ctx;
+    off_t first = csf_pageno_for_offset(ctx, req->offset);
+    int start = req->offset % ctx->data_sz;
+    off_t npages = csf_page_count_for_length(ctx, req->nbyte + start);
+    off_t file_sz, page_count, k;
+    unsigned char *plain = NULL;
+    size_t src = 0;
+
+    req->result = -1;
+    req->error = 0;
+    req->raw = NULL;
+    req->raw_len = req->raw_done = 0;
+    req->tries = 0;
+    if(req->op == CSF_AIO_WRITE && ctx->durability != CSF_DURABLE_NONE) {
+        // nothing would sync the pages before the request is handed back
+        req->error = EINVAL;
+        return 0;
+    }
+    if(req->nbyte == 0) {
+        req->result = 0;
+        return 0;
+    }
+
+    // the raw i/o goes straight to the file: put a page held back in write back mode there first
+    if(csf_flush_dirty(ctx) < 0)
+        goto fail;
+    file_sz = csf_file_size(ctx);
+    page_count = csf_page_count_for_file(ctx);
+    if(file_sz < 0)
+        goto fail;
+    if(req->op == CSF_AIO_READ) {
+        if(first >= page_count) {
+            req->result = 0;
+            return 0;
+        }
+        if(npages > page_count - first)
+            npages = page_count - first;
+    } else {
+        // filling up the last page before a gap also rewrites it
+        off_t from = (first >= page_count && req->offset > file_sz && page_count > 0) ? page_count - 1 : first;
+
+        if(csf_aio_busy(aio, ctx, from, first + npages))
+            return -1;
+        if(csf_header_modify(ctx) < 0)
+            goto fail;
+        if(first >= page_count && req->offset > file_sz && csf_write_gap(ctx, first, file_sz, page_count) < 0)
+            goto fail;
+    }
+    if(npages * ctx->page_sz > INT_MAX) {
+        errno = EINVAL;
+        goto fail;
+    }
+    req->pgno = first;
+    req->raw_len = npages * ctx->page_sz;
+    req->raw = csf_malloc_io(ctx, req->raw_len);
+    if(req->raw == NULL)
+        goto fail;
+    if(req->op == CSF_AIO_READ)
+        return 1;
+
+    plain = csf_malloc(ctx->data_sz);
+    if(plain == NULL)
+        goto fail;
+    for(k = 0; k < npages; k++) {
+        int from = (k == 0) ? start : 0;
+        int to = (req->nbyte - src < (size_t)(ctx->data_sz - from)) ? from + (req->nbyte - src) : ctx->data_sz;
+        int data_sz = to;
+        unsigned char *page;
+
+        if(first + k < page_count && (from > 0 || to < ctx->data_sz)) {
+            /* read-modify-write of a partially overwritten page */
+            int cur_page_bytes = csf_fetch_page(ctx, first + k, &page);
+            ctx->stats.rmw_cycles++;
+            if(cur_page_bytes < 0) {
+                errno = EBADMSG;
+                goto fail;
+            }
+            memcpy(plain, page, ctx->data_sz);
+            if(data_sz < cur_page_bytes)
+                data_sz = cur_page_bytes;
+        } else {
+            memset(plain, 0, ctx->data_sz);
+        }
+        memcpy(plain + from, (unsigned char *)req->buf + src, to - from);
+        src += to - from;
+        csf_page_iv(ctx, first + k, req->raw + k * ctx->page_sz);
+        csf_encrypt_page(ctx, ctx->ectx, first + k, plain, data_sz, ctx->scratch_buffer, req->raw + k * ctx->page_sz);
+    }
+    csf_free(plain, ctx->data_sz);
+    ctx->stats.pages_encrypted += npages;
+
+    // the pages are changing on disk under the cache and readahead
+    csf_cache_invalidate(ctx, first, first + npages);
+    csf_ra_invalidate(ctx, first, first + npages);
+    if(req->offset + (off_t)req->nbyte > ctx->file_sz)
+        ctx->file_sz = req->offset + req->nbyte;
+    aio->writes[aio->nwrites++] = req;
+    return 1;
+
+fail:
+    req->error = errno ? errno : EIO;
+    csf_free(plain, ctx->data_sz);
+    csf_free(req->raw, req->raw_len);
+    req->raw = NULL;
+    return 0;
+}
+
+/* the raw i/o of req is over: decrypt what was read, and set the result */
+static void csf_aio_finish(CSF_AIO_REQ *req) {
+    CSF_CTX *ctx = req->ctx;
+    off_t k, pages = req->raw_done / ctx->page_sz;
+    int start = req->offset % ctx->data_sz;
+    size_t got = 0;
+
+    if(req->raw == NULL)
+        return;
+    if(req->error) {
+        req->result = -1;
+    } else if(req->op == CSF_AIO_WRITE) {
+        req->result = req->nbyte;
+        ctx->stats.pages_written += pages;
+        ctx->stats.bytes_written += req->nbyte;
+        ctx->stats.disk_bytes_written += req->raw_done;
+    } else if(csf_lend(ctx) < 0) {
+        req->result = -1;
+        req->error = ENOMEM;
+    } else {
+        uint64_t t0 = csf_now_ns();
+
+        for(k = 0; k < pages && got < req->nbyte; k++) {
+            int data_sz = csf_decrypt_page(ctx, ctx->dctx, req->pgno + k, req->raw + k * ctx->page_sz, ctx->scratch_buffer, ctx->csf_buffer);
+            size_t n;
+
+            if(data_sz == CSF_PAGE_BAD) {
+                // a read stops at a page that failed authentication. it fails if that is the first
+                ctx->stats.auth_failures++;
+                if(got == 0)
+                    req->error = EBADMSG;
+                break;
+            }
+            if(data_sz <= start) // end of file
+                break;
+            n = (data_sz - start < req->nbyte - got) ? data_sz - start : req->nbyte - got;
+            memcpy((unsigned char *)req->buf + got, ctx->csf_buffer + start, n);
+            got += n;
+            start = 0;
+            if(data_sz < ctx->data_sz)
+                break;
+        }
+        ctx->stats.cipher_ns += csf_now_ns() - t0;
+        ctx->stats.pages_read += pages;
+        ctx->stats.pages_decrypted += k;
+        ctx->stats.bytes_read += got;
+        ctx->stats.disk_bytes_read += req->raw_done;
+        req->result = req->error ? -1 : (ssize_t)got;
+        csf_return(ctx);
+    }
+    csf_free(req->raw, req->raw_len);
+    req->raw = NULL;
+}
+
+/* blocking raw i/o for req, on a pool thread */
+static void csf_aio_rw(CSF_AIO_REQ *req) {
+    CSF_CTX *ctx = req->ctx;
+    off_t offset = ctx->hdr_sz + req->pgno * ctx->page_sz;
+    int trycount = RETRYCOUNT;
+
+    while(req->raw_done < req->raw_len) {
+        ssize_t n;
+
+        if(req->op == CSF_AIO_READ)
+            n = csf_fd_pread(ctx, req->raw + req->raw_done, req->raw_len - req->raw_done, offset + req->raw_done);
+        else
+            n = csf_fd_pwrite(ctx, req->raw + req->raw_done, req->raw_len - req->raw_done, offset + req->raw_done);
+        if(n < 0 && trycount-- > 0)
+            continue;
+        if(n < 0 || (n == 0 && req->op == CSF_AIO_WRITE)) {
+            req->error = (n < 0) ? errno : EIO;
+            break;
+        }
+        if(n == 0) // end of file
+            break;
+        req->raw_done += n;
+    }
+}
+
+static void *csf_aio_thread(void *arg) {
+    struct csf_aio *aio = arg;
+
+    pthread_mutex_lock(&aio->lock);
+    for(;;) {
+        CSF_AIO_REQ *req;
+
+        while(!aio->shutdown && aio->work_head == NULL)
+            pthread_cond_wait(&aio->work_cv, &aio->lock);
+        if(aio->shutdown)
+            break;
+        req = csf_aio_pop(&aio->work_head, &aio->work_tail);
+        pthread_mutex_unlock(&aio->lock);
+        csf_aio_rw(req);
+        pthread_mutex_lock(&aio->lock);
+        csf_aio_push(&aio->done_head, &aio->done_tail, req);
+        pthread_cond_signal(&aio->done_cv);
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return NULL;
+}
+
+#if CSF_IO_URING
+/*
+ * set up an io_uring with room for entries submissions, and twice that for completions.
+ * returns 0, or -1 if the kernel does not have io_uring or is too old for IORING_OP_READ/WRITE
+ */
+static int csf_uring_init(struct csf_aio *aio, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    aio->ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+    if(aio->ring_fd < 0)
+        return -1;
+    // IORING_OP_READ and IORING_OP_WRITE came with 5.6, fast poll with 5.7
+    if(!(p.features & IORING_FEAT_FAST_POLL))
+        goto fail;
+
+    aio->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    aio->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(aio->cq_ring_sz > aio->sq_ring_sz)
+            aio->sq_ring_sz = aio->cq_ring_sz;
+        aio->cq_ring_sz = aio->sq_ring_sz;
+    }
+    aio->sq_ring = mmap(NULL, aio->sq_ring_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, aio->ring_fd, IORING_OFF_SQ_RING);
+    if(aio->sq_ring == MAP_FAILED)
+        goto fail;
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        aio->cq_ring = aio->sq_ring;
+    } else {
+        aio->cq_ring = mmap(NULL, aio->cq_ring_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, aio->ring_fd, IORING_OFF_CQ_RING);
+        if(aio->cq_ring == MAP_FAILED)
+            goto fail_sq;
+    }
+    aio->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    aio->sqes = mmap(NULL, aio->sqes_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, aio->ring_fd, IORING_OFF_SQES);
+    if(aio->sqes == MAP_FAILED)
+        goto fail_cq;
+
+    aio->sq_head = (unsigned *)((char *)aio->sq_ring + p.sq_off.head);
+    aio->sq_tail = (unsigned *)((char *)aio->sq_ring + p.sq_off.tail);
+    aio->sq_mask = (unsigned *)((char *)aio->sq_ring + p.sq_off.ring_mask);
+    aio->sq_array = (unsigned *)((char *)aio->sq_ring + p.sq_off.array);
+    aio->cq_head = (unsigned *)((char *)aio->cq_ring + p.cq_off.head);
+    aio->cq_tail = (unsigned *)((char *)aio->cq_ring + p.cq_off.tail);
+    aio->cq_mask = (unsigned *)((char *)aio->cq_ring + p.cq_off.ring_mask);
+    aio->cqes = (struct io_uring_cqe *)((char *)aio->cq_ring + p.cq_off.cqes);
+    return 0;
+
+fail_cq:
+    if(aio->cq_ring != aio->sq_ring)
+        munmap(aio->cq_ring, aio->cq_ring_sz);
+fail_sq:
+    munmap(aio->sq_ring, aio->sq_ring_sz);
+fail:
+    close(aio->ring_fd);
+    return -1;
+}
+
+static void csf_uring_destroy(struct csf_aio *aio) {
+    munmap(aio->sqes, aio->sqes_sz);
+    if(aio->cq_ring != aio->sq_ring)
+        munmap(aio->cq_ring, aio->cq_ring_sz);
+    munmap(aio->sq_ring, aio->sq_ring_sz);
+    close(aio->ring_fd);
+}
+
+/* queue the rest of the raw i/o of req on the submission ring */
+static void csf_uring_queue(struct csf_aio *aio, CSF_AIO_REQ *req) {
+    CSF_CTX *ctx = req->ctx;
+    unsigned tail = *aio->sq_tail;
+    unsigned idx = tail & *aio->sq_mask;
+    struct io_uring_sqe *sqe = &aio->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (req->op == CSF_AIO_READ) ? IORING_OP_READ : IORING_OP_WRITE;
+    sqe->fd = ctx->fh;
+    sqe->addr = (unsigned long)(req->raw + req->raw_done);
+    sqe->len = req->raw_len - req->raw_done;
+    sqe->off = ctx->hdr_sz + req->pgno * ctx->page_sz + req->raw_done;
+    sqe->user_data = (unsigned long)req;
+    aio->sq_array[idx] = idx;
+    __atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    aio->to_submit++;
+}
+
+/* pass queued submissions to the kernel, and if wait is set, wait for a completion */
+static int csf_uring_enter(struct csf_aio *aio, int wait) {
+    int rc = syscall(__NR_io_uring_enter, aio->ring_fd, aio->to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+    if(rc < 0)
+        return (errno == EINTR || errno == EAGAIN || errno == EBUSY) ? 0 : -1;
+    aio->to_submit -= rc;
+    return 0;
+}
+
+/*
+ * move requests whose raw i/o is over from the completion ring to aio->done_head. a short
+ * transfer, or one that failed with EAGAIN or EINTR, is queued again for the rest. with block
+ * set, waits until there is at least one.
+ * returns 0, or -1 if io_uring_enter failed
+ */
+static int csf_uring_reap(struct csf_aio *aio, int block) {
+    for(;;) {
+        unsigned head = *aio->cq_head;
+        unsigned tail = __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE);
+        int done = 0;
+
+        for(; head != tail; head++) {
+            struct io_uring_cqe *cqe = &aio->cqes[head & *aio->cq_mask];
+            CSF_AIO_REQ *req = (CSF_AIO_REQ *)(unsigned long)cqe->user_data;
+            int res = cqe->res;
+
+            if(res < 0 && (res == -EAGAIN || res == -EINTR) && req->tries++ < RETRYCOUNT) {
+                csf_uring_queue(aio, req);
+                continue;
+            }
+            if(res < 0 || (res == 0 && req->op == CSF_AIO_WRITE)) {
+                req->error = (res < 0) ? -res : EIO;
+            } else if(res > 0) {
+                req->raw_done += res;
+                if(req->raw_done < req->raw_len) {
+                    csf_uring_queue(aio, req);
+                    continue;
+                }
+            }
+            csf_aio_done(aio, req);
+            done++;
+        }
+        __atomic_store_n(aio->cq_head, head, __ATOMIC_RELEASE);
+
+        block = block && !done && aio->done_head == NULL;
+        if(aio->to_submit > 0 || block) {
+            if(csf_uring_enter(aio, block) < 0)
+                return -1;
+            if(block)
+                continue;
+        }
+        return 0;
+    }
+}
+#endif
+
+/*
+ * create an engine that keeps up to depth requests in flight (CSF_AIO_DEFAULT_DEPTH if depth is 0).
+ * it uses io_uring if it can, unless flags has CSF_AIO_THREADS, and threads otherwise.
+ * returns 0, or -1 on failure
+ */
+int csf_aio_init(struct csf_aio **aio_out, int depth, int flags) {
+    struct csf_aio *aio = csf_malloc(sizeof(struct csf_aio));
+    int i;
+
+    if(aio == NULL)
+        return -1;
+    aio->depth = (depth > 0) ? depth : CSF_AIO_DEFAULT_DEPTH;
+    aio->writes = csf_malloc(aio->depth * sizeof(CSF_AIO_REQ *));
+    if(aio->writes == NULL) {
+        csf_free(aio, sizeof(struct csf_aio));
+        return -1;
+    }
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->work_cv, NULL);
+    pthread_cond_init(&aio->done_cv, NULL);
+    *aio_out = aio;
+
+#if CSF_IO_URING
+    if(!(flags & CSF_AIO_THREADS) && csf_uring_init(aio, aio->depth) == 0) {
+        aio->backend = CSF_AIO_URING;
+        TRACE3("csf_aio_init(%d), io_uring fd %d\n", aio->depth, aio->ring_fd);
+        return 0;
+    }
+#endif
+    aio->backend = CSF_AIO_THREADS;
+    for(i = 0; i < aio->depth && i < CSF_AIO_POOL_THREADS; i++) {
+        if(pthread_create(&aio->threads[i], NULL, csf_aio_thread, aio) != 0) {
+            csf_aio_destroy(aio);
+            *aio_out = NULL;
+            return -1;
+        }
+        aio->nthreads++;
+    }
+    TRACE3("csf_aio_init(%d), %d threads\n", aio->depth, aio->nthreads);
+    return 0;
+}
+
+/* returns CSF_AIO_URING or CSF_AIO_THREADS */
+int csf_aio_backend(struct csf_aio *aio) {
+    return aio->backend;
+}
+
+/*
+ * start up to n requests, in order. writes are encrypted here, on the calling thread.
+ * returns the number of requests taken, or -1 if none could be passed to the kernel. fewer than
+ * n are taken once depth requests are in flight, or when the next is a write to a page that a
+ * write in flight has: wait for some to finish, then submit the rest
+ */
+int csf_aio_submit(struct csf_aio *aio, CSF_AIO_REQ **reqs, int n) {
+    int i;
+
+    for(i = 0; i < n && aio->inflight < aio->depth; i++) {
+        CSF_AIO_REQ *req = reqs[i];
+        int rc = 0;
+
+        if(req->ctx->shared || req->ctx->multi_process || req->ctx->journal || csf_lend(req->ctx) < 0) {
+            // the raw i/o of a request runs after the call, outside the locks of a shared file, and past the journal
+            req->result = -1;
+            req->error = (req->ctx->shared || req->ctx->multi_process || req->ctx->journal) ? EINVAL : ENOMEM;
+            req->raw = NULL;
+        } else {
+            rc = csf_aio_prepare(aio, req);
+            csf_return(req->ctx);
+        }
+
+        if(rc < 0)
+            break;
+        aio->inflight++;
+        if(rc == 0) {
+            csf_aio_done(aio, req);
+            continue;
+        }
+#if CSF_IO_URING
+        if(aio->backend == CSF_AIO_URING) {
+            csf_uring_queue(aio, req);
+            continue;
+        }
+#endif
+        pthread_mutex_lock(&aio->lock);
+        csf_aio_push(&aio->work_head, &aio->work_tail, req);
+        pthread_cond_signal(&aio->work_cv);
+        pthread_mutex_unlock(&aio->lock);
+    }
+#if CSF_IO_URING
+    // all the new requests go to the kernel with one system call
+    if(aio->backend == CSF_AIO_URING && aio->to_submit > 0 && csf_uring_enter(aio, 0) < 0 && i > 0)
+        return -1;
+#endif
+    return i;
+}
+
+/* hand back up to max finished requests, waiting for one first if block is set */
+static int csf_aio_collect(struct csf_aio *aio, CSF_AIO_REQ **done, int max, int block) {
+    int n = 0, i;
+
+#if CSF_IO_URING
+    if(aio->backend == CSF_AIO_URING && csf_uring_reap(aio, block) < 0)
+        return -1;
+#endif
+    pthread_mutex_lock(&aio->lock);
+    while(block && aio->done_head == NULL && aio->backend == CSF_AIO_THREADS)
+        pthread_cond_wait(&aio->done_cv, &aio->lock);
+    while(n < max && aio->done_head)
+        done[n++] = csf_aio_pop(&aio->done_head, &aio->done_tail);
+    pthread_mutex_unlock(&aio->lock);
+
+    for(i = 0; i < n; i++) {
+        int w;
+
+        for(w = 0; w < aio->nwrites; w++) {
+            if(aio->writes[w] == done[i]) {
+                aio->writes[w] = aio->writes[--aio->nwrites];
+                break;
+            }
+        }
+        csf_aio_finish(done[i]);
+    }
+    aio->inflight -= n;
+    return n;
+}
+
+/*
+ * hand back up to max finished requests, decrypting those that read. does not wait.
+ * returns the number of requests put in done, or -1 on failure
+ */
+int csf_aio_poll(struct csf_aio *aio, CSF_AIO_REQ **done, int max) {
+    return csf_aio_collect(aio, done, max, 0);
+}
+
+/*
+ * as csf_aio_poll, but waits until at least min requests are finished, or none are in flight.
+ * returns the number of requests put in done, or -1 on failure
+ */
+int csf_aio_wait(struct csf_aio *aio, CSF_AIO_REQ **done, int min, int max) {
+    int n = 0;
+
+    if(min > max)
+        min = max;
+    while(n < max) {
+        int block = n < min && aio->inflight > 0;
+        int got = csf_aio_collect(aio, done + n, max - n, block);
+
+        if(got < 0)
+            return n ? n : -1;
+        n += got;
+        if(!block)
+            break;
+    }
+    return n;
+}
+
+/*
+ * stop the engine. requests still in flight are waited for and finished, but not handed back
+ */
+void csf_aio_destroy(struct csf_aio *aio) {
+    CSF_AIO_REQ *done[16];
+    int i;
+
+    if(aio == NULL)
+        return;
+    while(aio->inflight > 0 && csf_aio_collect(aio, done, 16, 1) >= 0)
+        ;
+    pthread_mutex_lock(&aio->lock);
+    aio->shutdown = 1;
+    pthread_cond_broadcast(&aio->work_cv);
+    pthread_mutex_unlock(&aio->lock);
+    for(i = 0; i < aio->nthreads; i++)
+        pthread_join(aio->threads[i], NULL);
+#if CSF_IO_URING
+    if(aio->backend == CSF_AIO_URING)
+        csf_uring_destroy(aio);
+#endif
+    pthread_mutex_destroy(&aio->lock);
+    pthread_cond_destroy(&aio->work_cv);
+    pthread_cond_destroy(&aio->done_cv);
+    csf_free(aio->writes, aio->depth * sizeof(CSF_AIO_REQ *));
+    csf_free(aio, sizeof(struct csf_aio));
+}
+
+/*
+ * page buffer pool, shared by all contexts. a context borrows its page buffers for the length of
+ * a call (csf_lend, csf_return), so that open files that are not being read or written hold
+ * none, and memory follows the number of calls in progress rather than the number of open files.
+ * free buffers are kept in a list per size class, a power of 2 from CSF_BUFPOOL_MIN, up to
+ * CSF_BUFPOOL_KEEP bytes of them per class; larger buffers are allocated for each call.
+ * pool buffers are aligned to CSF_BUFPOOL_ALIGN, which does for O_DIRECT on most devices.
+ * the pool is shared by contexts with different keys, so buffers that held plaintext are cleared
+ * before they go back to it, and the buffers left in it are cleared and freed at exit. buffers
+ * that only held encrypted pages are not: callers must not rely on the contents of a buffer
+ * they borrow
+ */
+#define CSF_BUFPOOL_MIN     512
+#define CSF_BUFPOOL_CLASSES 16                  // up to CSF_BUFPOOL_MIN << 15, 16MB
+#define CSF_BUFPOOL_KEEP    (32 * 1024 * 1024)
+#define CSF_BUFPOOL_ALIGN   4096
+
+static struct {
+    pthread_mutex_t lock;
+    void *free;        // free buffers of the class, each holding the next in its first bytes
+    size_t kept;       // bytes in the list
+} csf_bufpool[CSF_BUFPOOL_CLASSES] = {
+    [0 ... CSF_BUFPOOL_CLASSES - 1] = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 }
+};
+
+/* size class of a buffer of sz bytes, -1 if buffers of that size are not pooled for ctx */
+static int csf_buf_class(CSF_CTX *ctx, size_t sz) {
+    int c = 0;
+
+    if(ctx->direct_align > CSF_BUFPOOL_ALIGN)
+        return -1;
+    while(c < CSF_BUFPOOL_CLASSES && ((size_t)CSF_BUFPOOL_MIN << c) < sz)
+        c++;
+    return (c < CSF_BUFPOOL_CLASSES) ? c : -1;
+}
+
+/* borrow a buffer of at least sz bytes from the pool, NULL if there is no memory for it */
+static void *csf_buf_get(CSF_CTX *ctx, size_t sz) {
+    int c = csf_buf_class(ctx, sz);
+    void *buf;
+
+    if(c < 0)
+        return csf_malloc_io(ctx, sz);
+    pthread_mutex_lock(&csf_bufpool[c].lock);
+    buf = csf_bufpool[c].free;
+    if(buf) {
+        csf_bufpool[c].free = *(void **)buf;
+        csf_bufpool[c].kept -= (size_t)CSF_BUFPOOL_MIN << c;
+    }
+    pthread_mutex_unlock(&csf_bufpool[c].lock);
+    if(buf == NULL && posix_memalign(&buf, CSF_BUFPOOL_ALIGN, (size_t)CSF_BUFPOOL_MIN << c) != 0) {
+        TRACE2("allocating %ld pool bytes via posix_memalign() in csf_buf_get()\n", (long)sz);
+        return NULL;
+    }
+    return buf;
+}
+
+/* give back a buffer of sz bytes from csf_buf_get. it is freed if its class has enough. clearing it is up to the caller */
+static void csf_buf_put(CSF_CTX *ctx, void *buf, size_t sz) {
+    int c = csf_buf_class(ctx, sz);
+    size_t class_sz;
+
+    if(buf == NULL)
+        return;
+    if(c < 0) {
+        csf_free(buf, sz);
+        return;
+    }
+    class_sz = (size_t)CSF_BUFPOOL_MIN << c;
+    pthread_mutex_lock(&csf_bufpool[c].lock);
+    if(csf_bufpool[c].kept + class_sz <= CSF_BUFPOOL_KEEP || csf_bufpool[c].free == NULL) {
+        *(void **)buf = csf_bufpool[c].free;
+        csf_bufpool[c].free = buf;
+        csf_bufpool[c].kept += class_sz;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&csf_bufpool[c].lock);
+    csf_free(buf, class_sz);
+}
+
+/* at exit, clear and free the buffers left in the pool */
+static void __attribute__((destructor)) csf_bufpool_drain(void) {
+    int c;
+
+    for(c = 0; c < CSF_BUFPOOL_CLASSES; c++) {
+        pthread_mutex_lock(&csf_bufpool[c].lock);
+        while(csf_bufpool[c].free) {
+            void *buf = csf_bufpool[c].free;
+
+            csf_bufpool[c].free = *(void **)buf;
+            csf_free(buf, CSF_BUFPOOL_MIN << c);
+        }
+        csf_bufpool[c].kept = 0;
+        pthread_mutex_unlock(&csf_bufpool[c].lock);
+    }
+}
+
+/*
+ * borrow page_buffer, csf_buffer and scratch_buffer for a call on ctx. calls nest: only the
+ * outermost one borrows, and gives them back, with the batch buffers, at its csf_return.
+ * returns 0, or -1 with errno ENOMEM if the buffers can't be had
+ */
+static int csf_lend(CSF_CTX *ctx) {
+    if(ctx->lent++ > 0)
+        return 0;
+    ctx->page_buffer = csf_buf_get(ctx, ctx->page_sz);
+    ctx->csf_buffer = csf_buf_get(ctx, ctx->page_sz);
+    ctx->scratch_buffer = csf_buf_get(ctx, ctx->page_sz);
+    if(ctx->page_buffer && ctx->csf_buffer && ctx->scratch_buffer)
+        return 0;
+    csf_return(ctx);
+    errno = ENOMEM;
+    return -1;
+}
+
+/* the end of a call that started with csf_lend. the buffers that held plaintext are cleared first */
+static void csf_return(CSF_CTX *ctx) {
+    if(--ctx->lent > 0)
+        return;
+    if(ctx->csf_buffer)
+        memset(ctx->csf_buffer, 0, ctx->page_sz);
+    if(ctx->scratch_buffer)
+        memset(ctx->scratch_buffer, 0, ctx->page_sz);
+    csf_buf_put(ctx, ctx->page_buffer, ctx->page_sz);
+    csf_buf_put(ctx, ctx->csf_buffer, ctx->page_sz);
+    csf_buf_put(ctx, ctx->scratch_buffer, ctx->page_sz);
+    ctx->page_buffer = ctx->csf_buffer = ctx->scratch_buffer = NULL;
+    csf_batch_release(ctx);
+}
+
 static void *csf_malloc(int sz) {
     void *buf;
     buf = calloc(sz, 1);
@@ -823,11 +4890,27 @@ static void *csf_malloc(int sz) {
     return buf;
 }
 
+/* csf_malloc for buffers that raw pages are read into and written from: aligned for O_DIRECT in that mode */
+static void *csf_malloc_io(CSF_CTX *ctx, int sz) {
+    void *buf;
+
+    if(!ctx->direct_align)
+        return csf_malloc(sz);
+    if(posix_memalign(&buf, ctx->direct_align, sz) != 0) {
+        TRACE2("allocating %d aligned bytes via posix_memalign() in csf_malloc_io()\n", sz);
+        return NULL;
+    }
+    memset(buf, 0, sz);
+    return buf;
+}
+
 /*
  input: the pointer to the malloc'd memory, and
  the lenght of the buffer to zero out
  */
 static void csf_free(void * buf, int sz) {
+    if(buf == NULL)
+        return;
     memset(buf, 0, sz);
     free(buf);
 }
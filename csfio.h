@@ -34,50 +34,343 @@
 #ifndef CSFIO_H
 #define CSFIO_H
 
+#include <sys/types.h>
 #include <openssl/crypto.h>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
 #include "csfio.h"
 #include <inttypes.h>
 
-#define CIPHER EVP_aes_256_cbc()
+/* file offsets and page numbers are off_t, which must be 64 bits for files past 2GB. on 32 bit
+   systems, build csfio.c and everything including this header with -D_FILE_OFFSET_BITS=64: a
+   define here would come too late for a file that included a system header first */
+_Static_assert(sizeof(off_t) == 8, "csfio needs a 64 bit off_t: build with -D_FILE_OFFSET_BITS=64");
+
+#define CIPHER EVP_aes_256_cbc()  // CSF_CIPHER_AES_256_CBC
+
+/* page ciphers, see CSF_CONFIG.cipher */
+#define CSF_CIPHER_AES_256_CBC 0
+#define CSF_CIPHER_AES_256_CTR 1
+#define CSF_CIPHER_AES_256_XTS 2
+#define CSF_CIPHER_AES_256_GCM 3  // authenticated: a page that was changed or moved fails to read, with EBADMSG
 
 #define FILE_MAGIC_NUM     0x4249545A
-#define VERSION_1001       0x00001001
-#define CIPHER_HEX_STRING  0x00AE5256
+#define VERSION_1001       0x00001001 // magic, version, cipher, pagesize
+#define VERSION_1002       0x00001002 // adds flags and the plaintext file size
+#define VERSION_1003       0x00001003 // adds the file id. CSF_CIPHER_AES_256_GCM files only
+#define VERSION_1004       0x00001004 // adds the write epoch, any cipher: page IVs are derived, not random
+#define CIPHER_HEX_STRING  0x00AE5256 // CSF_FILE_HEADER.cipher for CSF_CIPHER_AES_256_CBC
+#define CIPHER_HEX_CTR     0x01AE5256 // CSF_CIPHER_AES_256_CTR
+#define CIPHER_HEX_XTS     0x02AE5256 // CSF_CIPHER_AES_256_XTS
+#define CIPHER_HEX_GCM     0x03AE5256 // CSF_CIPHER_AES_256_GCM
 
 #define PAGE_MAGIC_NUM     0xCAFEBABE
 
-#define HDR_SZ 0               // magic (4) + version (4) + cipher (4) + pagesize (4)
+#define HDR_SZ_1001 16         // magic (4) + version (4) + cipher (4) + pagesize (4)
+#define HDR_SZ 64              // VERSION_1002: HDR_SZ_1001 + flags (4) + file size (8), zero padded
+                               // VERSION_1003: the same + file id (16)
+                               // VERSION_1004: the same + write epoch (4)
+                               // any of these: + generation (4), in what earlier csfio leaves as padding
+                               // files without a header (written while HDR_SZ was 0) are still read
+
+/* CSF_FILE_HEADER flags */
+#define CSF_HDR_SIZE_VALID 0x00000001 // file_sz_hi/lo hold the plaintext size. cleared while the file is being modified
+#define CSF_HDR_SIZE_SHARED 0x00000002// file_sz_hi/lo hold the size as of generation, for CSF_CONFIG.multi_process
+                                      // contexts, even while the file is being modified
+#define CSF_HDR_PADDED 0x00000004     // the header is zero padded to pagesize bytes, so pages start block aligned.
+                                      // new files of CSF_CONFIG.direct contexts. csfio before this flag misreads them
+
+#define CSF_FILE_ID_SZ 16
 
+/* stored in network byte order */
 typedef struct {
     unsigned int magic;        // magic number
     unsigned int version;      // version number of encryption
     unsigned int cipher;       // cipher type
     unsigned int pagesize;     // page size
+    unsigned int flags;        // VERSION_1002 and later: CSF_HDR_ flags
+    unsigned int file_sz_hi;   // VERSION_1002 and later: plaintext size of the file
+    unsigned int file_sz_lo;
+    unsigned char file_id[CSF_FILE_ID_SZ]; // VERSION_1003 and later: random, authenticated with every GCM page so pages
+                               // can't be swapped between files. VERSION_1004: also keys the page IVs
+    unsigned int write_epoch;  // VERSION_1004: bumped each time the file starts being modified, see csf_page_iv
+    unsigned int generation;   // VERSION_1002 and later: bumped by every header write. zero before csfio wrote it.
+                               // multi_process contexts write the header for every change to the file
 } CSF_FILE_HEADER;
 
+/* eviction policies for the decrypted page cache, see CSF_CONFIG.cache_policy */
+#define CSF_CACHE_LRU      0
+#define CSF_CACHE_CLOCK    1
+
+#define CSF_CACHE_DEFAULT_PAGES 16
+/* CSF_CONFIG.cache_pages as csf_config_init sets it: CSF_CACHE_DEFAULT_PAGES for csf_ctx_init and
+   csf_ctx_init_ex, no cache for csf_ctx_init_key, which is for many files open on one key: cached
+   pages are held between calls, so memory would grow with the number of open files */
+#define CSF_CACHE_DEFAULT       (-1)
+
+#define CSF_PARALLEL_DEFAULT_PAGES 8
+#define CSF_BATCH_DEFAULT_PAGES    64
+
+/* optional settings for csf_ctx_init_ex. csf_config_init fills in the defaults used by csf_ctx_init */
+typedef struct {
+    int cache_pages;   // number of decrypted pages kept in memory. 0 disables the cache, see CSF_CACHE_DEFAULT
+    int cache_policy;  // CSF_CACHE_LRU or CSF_CACHE_CLOCK
+    int write_back;    // 1 to keep a partially written page in the cache, and encrypt and write it
+                       // only once the writer leaves the page, seeks, or calls csf_flush. needs the cache
+    int workers;       // threads that encrypt/decrypt pages alongside the caller. 0 for none
+    int parallel_pages;// batches of more than this many pages are shared with the workers
+    int batch_pages;   // most pages read or written with a single pread/pwrite
+    int readahead_pages;// pages read and decrypted ahead of a sequential reader, on a background
+                       // thread. 0 disables readahead
+    int mmap;          // 1 to map the file read-only and decrypt pages straight from the mapping, instead
+                       // of reading them with pread. for files that other processes do not truncate
+    int direct;        // 1 to set O_DIRECT on the file, so its pages do not go through the kernel page
+                       // cache. the page size must be a multiple of the device's logical block size. a new
+                       // file gets a header padded to a whole page (CSF_HDR_PADDED). an existing file whose
+                       // pages do not start on a block boundary can't be opened this way
+    int cipher;        // CSF_CIPHER_ for a new file. an existing file is read and written with the cipher
+                       // its header names. files without one are CBC
+    int random_iv;     // 1 to write a new file as VERSION_1002 (VERSION_1003 for GCM), which csfio before
+                       // VERSION_1004 can read: every page written gets an IV from the OpenSSL RNG, instead
+                       // of one derived from the page number and a write counter. files of those versions
+                       // are always written this way
+    int multi_process; // 1 to share the file with other processes that open it this way. each call takes
+                       // fcntl locks on the pages it reads (shared) or writes (exclusive), and on the header,
+                       // which records the size and a generation that each change bumps: when another
+                       // process has changed the file, the cached pages and size are dropped. needs a
+                       // VERSION_1002 or later header, or a new file. write back, readahead, mmap and direct
+                       // are not used, and the context is not for csf_aio or csf_file_open
+    int durability;    // CSF_DURABLE_: whether csf_write and csf_truncate return only once what they changed is
+                       // on stable storage, and how the syncs for that are shared. write back is not used
+                       // with CSF_DURABLE_WRITE or CSF_DURABLE_GROUP. csf_aio writes are made durable by csf_sync
+    int group_commit_us;   // CSF_DURABLE_GROUP: how long the first writer waiting holds its sync back for others
+                       // to join. 0 syncs at once: writers join only while a sync is under way
+    int group_commit_bytes;// CSF_DURABLE_GROUP: bytes waiting that close the window early. 0 for no limit
+    int journal_fd;    // a file open for reading and writing that keeps a redo journal, or -1 for none: a write
+                       // that changes more than one page, or extends the file past a gap, goes there first and
+                       // survives a crash whole or not at all. a write the journal still holds is replayed when
+                       // the file is opened again, so open it with the same journal each time. not for
+                       // multi_process contexts or csf_file_open. write back is not used, and the context is
+                       // not for csf_aio
+} CSF_CONFIG;
+
+/* durability policies, see CSF_CONFIG.durability */
+#define CSF_DURABLE_NONE  0    // the system writes the file out when it gets to it, or at csf_sync
+#define CSF_DURABLE_WRITE 1    // every write call syncs the file before it returns
+#define CSF_DURABLE_GROUP 2    // every write call waits for a sync that covers it, shared with the other writers
+                               // of the context, or of the cursors of a CSF_FILE, within the group commit window
+
+/* csf_sync modes */
+#define CSF_SYNC_DATA 0        // fdatasync: the pages and whatever of the file's metadata is needed to read them back
+#define CSF_SYNC_FULL 1        // fsync: all of the file's metadata as well
+
+struct csf_pool;
+struct csf_readahead;
+struct csf_group;
+struct csf_journal;
+
+/* a key that any number of contexts can share, see csf_key_new */
+typedef struct csf_key CSF_KEY;
+
+/* a file that any number of threads read and write, each through a cursor of its own, see csf_file_open */
+typedef struct csf_file CSF_FILE;
+
+/* counters kept by each CSF_CTX, see csf_get_stats */
+typedef struct {
+    uint64_t pages_read;       // whole csf pages read from the file
+    uint64_t pages_written;    // csf pages written to the file
+    uint64_t pages_decrypted;
+    uint64_t pages_encrypted;
+    uint64_t partial_pages;    // pages of which only the blocks needed by a small read were read and decrypted
+    uint64_t rmw_cycles;       // partially overwritten pages that had to be read back first
+    uint64_t cache_hits;       // pages found in the page cache
+    uint64_t cache_misses;
+    uint64_t syscalls;         // pread, pwrite, fstat, ftruncate and sync calls on the file and its journal, including retries
+    uint64_t retries;          // calls repeated by the RETRYCOUNT loops
+    uint64_t bytes_read;       // plaintext bytes returned by csf_read/csf_pread
+    uint64_t bytes_written;    // plaintext bytes taken by csf_write/csf_pwrite
+    uint64_t disk_bytes_read;  // bytes read from and written to the file, headers and IVs included
+    uint64_t disk_bytes_written;
+    uint64_t cipher_ns;        // time spent encrypting and decrypting pages, wall clock of the calling thread
+    uint64_t io_ns;            // time spent in pread/pwrite
+    uint64_t readahead_window; // CSF_CONFIG.readahead_pages, 0 if readahead is off
+    uint64_t readahead_pages;  // pages read and decrypted by the readahead thread. its reads count in
+                               // syscalls and disk_bytes_read, not in pages_read
+    uint64_t readahead_hits;   // pages a read took from readahead
+    uint64_t readahead_ns;     // time the readahead thread spent reading and decrypting
+    uint64_t mapped_pages;     // pages (of pages_read and partial_pages) decrypted straight from the mapping
+    uint64_t remaps;           // times the file was mapped in mmap mode: once at the start, then when it changes size
+    uint64_t auth_failures;    // CSF_CIPHER_AES_256_GCM pages that failed authentication when read
+    uint64_t remote_changes;   // calls in multi_process mode that found the file changed by another context
+    uint64_t syncs;            // fdatasync and fsync calls on the file and its journal
+    uint64_t sync_ns;          // time spent in them
+    uint64_t sync_shared;      // CSF_DURABLE_GROUP: writes made durable by a sync another writer made
+    uint64_t journal_writes;   // writes that went through the redo journal
+    uint64_t journal_replays;  // writes the journal held when the context was opened, and that were made again
+} CSF_STATS;
+
+/* events in a CSF_TRACE_RECORD */
+#define CSF_TRACE_READ_PAGE    1  // pgno, size: data bytes found on the page
+#define CSF_TRACE_WRITE_PAGE   2  // pgno, size: data bytes written, result: -1 on failure
+#define CSF_TRACE_SEEK         3  // pgno: requested offset, size: whence, result: new offset
+#define CSF_TRACE_PREAD        4  // pgno: plaintext offset, size: bytes requested, result: bytes read
+#define CSF_TRACE_PWRITE       5  // pgno: plaintext offset, size: bytes requested, result: bytes written
+#define CSF_TRACE_BATCH_READ   6  // pgno: first page, size: pages
+#define CSF_TRACE_BATCH_WRITE  7  // pgno: first page, size: pages, result: pages written
+#define CSF_TRACE_PARTIAL_READ 8  // pgno, size: bytes requested, result: bytes read
+#define CSF_TRACE_FLUSH        9  // result: 0 or -1
+#define CSF_TRACE_TRUNCATE     10 // pgno: new plaintext size, result: 0 or -1
+#define CSF_TRACE_SYNC         11 // pgno: CSF_SYNC_ mode, result: 0 or -1
+
+/* fixed size binary trace record, see csf_trace_dump */
+typedef struct {
+    uint64_t ts_ns;       // CLOCK_MONOTONIC time the call started
+    int64_t pgno;         // page number, or plaintext offset, depending on the event
+    int64_t size;
+    int64_t result;
+    uint32_t duration_ns;
+    uint16_t event;       // CSF_TRACE_
+    uint16_t thread;      // small number given to each thread on its first record
+    int32_t fh;
+    uint32_t pad;
+} CSF_TRACE_RECORD;
+
+#define CSF_TRACE_MAGIC   0x43534654 // "CSFT"
+#define CSF_TRACE_VERSION 1
+
+/* start of a csf_trace_dump, in host byte order. count records follow */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_sz;   // sizeof(CSF_TRACE_RECORD)
+    uint32_t pad;
+    uint64_t count;
+} CSF_TRACE_FILE_HEADER;
+
+/* one slot of the decrypted page cache */
+typedef struct {
+    off_t pgno;        // csf page held in this slot, -1 if the slot is free
+    int data_sz;       // bytes of data on the page, as found in its page header
+    int ref;           // reference bit for CLOCK
+    int prev, next;    // LRU list, most recently used first. -1 terminated
+    int hash_next;     // next slot in the same hash bucket. -1 terminated
+    unsigned char *data;          // decrypted data portion of the page, ctx->data_sz bytes. allocated on first use
+} CSF_CACHE_ENTRY;
+
 typedef struct {
     int fh;
     off_t seek_ptr;    // current location in encrypted file
-    off_t file_sz;     // not used, set to 0. could be set and saved in file header
+    off_t file_sz;     // plaintext size of the file, -1 until known. kept up to date by csf_write and csf_truncate
     int encrypted;     // is true. set to 0 to test paging+headers, without encryption
     int key_sz;        // size of the encryption key. 256bits=32bytes for CIPHER=AES_256
+    int cipher;        // CSF_CIPHER_ the pages are encrypted with, -1 if the file header names one not known here
     int data_sz;       // size of data within a page
     int block_sz;      // cipher block size. property of cipher
     int iv_sz;         // size of initialization vector. 16 bytes. created for each csf page.
-    int page_header_sz;// 8 bytes below. 16 with alignment to 16 bytes.
+    int page_header_sz;// 8 bytes below. 16 with alignment to 16 bytes. 4 for GCM, which has data_sz only
+    int tag_sz;        // GCM: bytes of authentication tag at the end of each page. 0 for the other ciphers
+    unsigned char file_id[CSF_FILE_ID_SZ]; // GCM: from the file header, part of the associated data of every page
+    EVP_CIPHER_CTX *iv_ctx;       // VERSION_1004: AES-256-ECB keyed from the key and file id, derives page IVs. NULL
+                                  // for files that get random IVs
+    unsigned int iv_epoch;        // VERSION_1004: write epoch from the file header, see csf_page_iv
+    unsigned int iv_count;        // pages given an IV in this epoch
     int page_sz;       // passed in as a user paramerter in ctx_init
     int file_header_check;        // 0 if file header is not yet written or checked. 1 if it is.
-    unsigned char *key_data;      // file encryption/decryption key.
+    int hdr_sz;        // bytes of file header before the first page: HDR_SZ, page_sz with CSF_HDR_PADDED,
+                       // HDR_SZ_1001, or 0 for files without one
+    int hdr_size_field;// 1 if the file header holds the plaintext size, and should be kept up to date
+    int hdr_dirty;     // the file was modified and the header size is marked not valid until csf_flush
+    unsigned int hdr_version;     // VERSION_ of the header written by csf_write_header, 0 if it is never written
+    CSF_KEY *key;                 // file encryption/decryption key, held by reference
+    EVP_CIPHER_CTX *ectx;         // copied in csf_ctx_init from the key's context for the cipher, only the IV is set for each page written
+    EVP_CIPHER_CTX *dctx;         // same, for pages read
+    /* the page buffers are lent by the buffer pool for the length of a call, NULL between calls */
     unsigned char *page_buffer;   // raw csf page read from disk, of ctx->page_sz
     unsigned char *scratch_buffer;// used to encrypt/decrypt header+data portion
     unsigned char *csf_buffer;
+    int lent;          // calls in progress that use the page buffers: they go back to the pool when it drops to 0
+    CSF_FILE *shared;  // the shared file this context is a cursor of, NULL for a context of its own
+    int locked;        // calls in progress on a cursor, or in multi_process mode, that hold its locks: they are released when it drops to 0
+    int lock_excl;     // the cursor holds the shared file exclusively, or in multi_process mode the header lock
+    uint64_t lock_mask;// page lock stripes the cursor holds, when not exclusively
+    int multi_process; // from CSF_CONFIG
+    off_t lock_from;   // multi_process: first page locked by the call in progress, -1 if none
+    off_t lock_to;     // and the page after the last, CSF_PGNO_MAX for all pages on
+    unsigned int generation;      // CSF_FILE_HEADER.generation, as last written or seen
+    unsigned int hdr_epoch;       // CSF_FILE_HEADER.write_epoch, as last seen
     int fileFlag;      //Holds the file flag originally set by caller. If file is opened write only, we open file read/write for csfio seek purpose. To simulate correct file mode, we keep mode here and use it to simulate read/write protection.
     int seekPastEndOfFile;        //This flag will be set if seek/read is done past end of file;
+    int cache_pages;   // capacity of the page cache. 0 if disabled
+    int cache_policy;  // CSF_CACHE_LRU or CSF_CACHE_CLOCK
+    int cache_used;    // slots handed out so far. slots past this have never been used
+    int cache_nbuckets;// size of cache_hash, a power of 2
+    int cache_lru_head, cache_lru_tail;
+    int cache_hand;    // next slot examined by CLOCK
+    int *cache_hash;   // bucket heads, indexed by pgno & (cache_nbuckets-1)
+    CSF_CACHE_ENTRY *cache;
+    int write_back;    // from CSF_CONFIG
+    int dirty_slot;    // cache slot with plaintext not yet written to disk, -1 if none. only used with write_back
+    CSF_STATS stats;
+    off_t partial_pgno;// page of the last csf_pread that decrypted only part of a page, -1 if none
+    struct csf_pool *pool;        // worker threads, NULL if CSF_CONFIG.workers is 0
+    struct csf_readahead *ra;     // readahead thread, NULL if CSF_CONFIG.readahead_pages is 0
+    int parallel_pages;// from CSF_CONFIG
+    int batch_pages;   // from CSF_CONFIG
+    unsigned char *batch_raw;     // batch_pages raw csf pages, of ctx->page_sz each. lent on first use in a call
+    unsigned char *batch_plain;   // batch_pages decrypted data portions, of ctx->data_sz each. same
+    int *batch_data_sz;           // data size of each page of a batch read
+    unsigned char **batch_dest;   // where each page of a batch read was decrypted: batch_plain, or the caller's buffer
+    const unsigned char *batch_src;// raw pages of a batch read, from its first page on: batch_raw, or the mapping
+    off_t batch_pgno;             // page number of the first page of the batch being encrypted or decrypted
+    int map_mode;      // CSF_CONFIG.mmap
+    unsigned char *map;// the file mapped read-only, NULL if not mapped
+    off_t map_sz;      // bytes mapped, the file size when it was last mapped
+    int direct_align;  // O_DIRECT mode: alignment of file offsets, lengths and buffers for i/o. 0 if not in O_DIRECT mode
+    int durability;    // from CSF_CONFIG
+    struct csf_group *group;      // CSF_DURABLE_GROUP: group commit, shared by the cursors of a CSF_FILE. NULL otherwise
+    struct csf_journal *journal;  // redo journal, NULL if CSF_CONFIG.journal_fd is -1
 } CSF_CTX;
 
-/* total size is 8 bytes, which is less than 16 byte block sz, so another 8 bytes will be padded */
+/* asynchronous reads and writes, see csf_aio_init */
+#define CSF_AIO_READ     0
+#define CSF_AIO_WRITE    1
+
+/* csf_aio_init flags, and csf_aio_backend values */
+#define CSF_AIO_URING    0x1   // io_uring, where the kernel and headers have it
+#define CSF_AIO_THREADS  0x2   // a pool of threads doing blocking pread/pwrite. forced by this flag
+
+#define CSF_AIO_DEFAULT_DEPTH 256
+#define CSF_AIO_POOL_THREADS  16   // most threads in the CSF_AIO_THREADS pool
+
+/*
+ * one asynchronous read or write of nbyte bytes at plaintext offset on ctx. the caller fills in
+ * the fields up to user_data, and keeps the request and buf alive until csf_aio_poll or
+ * csf_aio_wait hands the request back with result set. a cursor of a CSF_FILE, or a context
+ * in multi_process mode or with a journal, is not taken: the request fails with EINVAL. nor is
+ * a write on a context with a CSF_CONFIG.durability other than CSF_DURABLE_NONE
+ */
+typedef struct csf_aio_req {
+    CSF_CTX *ctx;
+    int op;            // CSF_AIO_READ or CSF_AIO_WRITE
+    void *buf;
+    size_t nbyte;
+    off_t offset;
+    void *user_data;   // for the caller, not used by csfio
+    ssize_t result;    // bytes read or written, or -1 on failure
+    int error;         // errno value of a failure
+    /* used by csfio while the request is in flight */
+    unsigned char *raw;           // the csf pages covered by the request, as on disk
+    size_t raw_len;
+    size_t raw_done;              // bytes of raw read or written so far
+    off_t pgno;                   // first page in raw
+    int tries;
+    struct csf_aio_req *next;
+} CSF_AIO_REQ;
+
+struct csf_aio;
+
+/* total size is 8 bytes, which is less than 16 byte block sz, so another 8 bytes will be padded.
+   GCM pages are authenticated by their tag instead of the magic, and keep data_sz only */
 typedef struct {
     int32_t magic;       // unsigned int of 4 bytes
     int32_t data_sz;     // index of last byte of data on page
@@ -85,11 +378,34 @@ typedef struct {
 
 /* context init for file open and interceptors for other file i/o functions */
 int csf_ctx_init(CSF_CTX **ctx_out, int fh, unsigned char *keydata, int key_sz, int page_sz, int flags);
-int csf_truncate(CSF_CTX *ctx, int nByte);
+int csf_ctx_init_ex(CSF_CTX **ctx_out, int fh, unsigned char *keydata, int key_sz, int page_sz, int flags, const CSF_CONFIG *config);
+int csf_ctx_init_key(CSF_CTX **ctx_out, int fh, CSF_KEY *key, int page_sz, int flags, const CSF_CONFIG *config);
+CSF_KEY *csf_key_new(const unsigned char *keydata, int key_sz);
+CSF_KEY *csf_key_ref(CSF_KEY *key);
+void csf_key_free(CSF_KEY *key);
+CSF_FILE *csf_file_open(int fh, CSF_KEY *key, int page_sz, int flags, const CSF_CONFIG *config);
+int csf_cursor_open(CSF_CTX **ctx_out, CSF_FILE *file);
+int csf_file_close(CSF_FILE *file);
+void csf_config_init(CSF_CONFIG *config);
+int csf_truncate(CSF_CTX *ctx, off_t nByte);
 off_t csf_seek(CSF_CTX *ctx, off_t offset, int whence);
 size_t csf_read(CSF_CTX *ctx, void *buf, size_t nbyte);
 size_t csf_write(CSF_CTX *ctx, const void *buf, size_t nbyte);
+size_t csf_pread(CSF_CTX *ctx, void *buf, size_t nbyte, off_t offset);
+size_t csf_pwrite(CSF_CTX *ctx, const void *buf, size_t nbyte, off_t offset);
 int csf_ctx_destroy(CSF_CTX *ctx);
 off_t csf_file_size(CSF_CTX *ctx);
+int csf_flush(CSF_CTX *ctx);
+int csf_sync(CSF_CTX *ctx, int mode);
+int csf_get_stats(CSF_CTX *ctx, CSF_STATS *stats);
+void csf_reset_stats(CSF_CTX *ctx);
+void csf_trace_enable(int on);
+int csf_trace_dump(int fd);
+int csf_aio_init(struct csf_aio **aio_out, int depth, int flags);
+int csf_aio_backend(struct csf_aio *aio);
+int csf_aio_submit(struct csf_aio *aio, CSF_AIO_REQ **reqs, int n);
+int csf_aio_poll(struct csf_aio *aio, CSF_AIO_REQ **done, int max);
+int csf_aio_wait(struct csf_aio *aio, CSF_AIO_REQ **done, int min, int max);
+void csf_aio_destroy(struct csf_aio *aio);
 
 #endif
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
@@ -10,12 +11,15 @@
 #include "csfio.h"
 
 #include <errno.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sys/wait.h>
 
 #define BLOCK_SIZE 512
 
 
-/* read in an unencrypted file, encrypt it with a key */
-int do_encrypt(int fdin, int fdout, unsigned char *key, int keylen){
+/* read in an unencrypted file, encrypt it with a key, with config if it is not NULL */
+int do_encrypt(int fdin, int fdout, unsigned char *key, int keylen, CSF_CONFIG *config){
   CSF_CTX *csf_ctx;
 
   //int read_size = 65536;
@@ -28,7 +32,10 @@ int do_encrypt(int fdin, int fdout, unsigned char *key, int keylen){
   printf("sizeof file header=%d\n", sizeof(CSF_FILE_HEADER));
 
   //csf_ctx_init(&csf_ctx, fdout, key, keylen, BLOCK_SIZE, "csfio.log");
-  csf_ctx_init(&csf_ctx, fdout, key, keylen, BLOCK_SIZE, O_CREAT|O_RDWR);
+  if(config)
+      csf_ctx_init_ex(&csf_ctx, fdout, key, keylen, BLOCK_SIZE, O_CREAT|O_RDWR, config);
+  else
+      csf_ctx_init(&csf_ctx, fdout, key, keylen, BLOCK_SIZE, O_CREAT|O_RDWR);
   while( (actual_read_size=read(fdin, buffer, read_size)) >0 ) {
       //printf("we have read %d \n", actual_read_size);
       csf_write(csf_ctx, buffer, actual_read_size);
@@ -39,8 +46,8 @@ int do_encrypt(int fdin, int fdout, unsigned char *key, int keylen){
 }
 
 // we need size of the original file to truncate it back to
-/* read in an encrypted file, decrypt it with a key */
-int do_decrypt(int fdin, int fdout, unsigned char *key, int keylen){
+/* read in an encrypted file, decrypt it with a key, with config if it is not NULL */
+int do_decrypt(int fdin, int fdout, unsigned char *key, int keylen, CSF_CONFIG *config){
   CSF_CTX *csf_ctx;
 
   // must test with different read sizes for different edge cases
@@ -54,7 +61,10 @@ int do_decrypt(int fdin, int fdout, unsigned char *key, int keylen){
   int total_read;
 
   //csf_ctx_init(&csf_ctx, fdin, key, keylen, BLOCK_SIZE, "csfio.log");
-  csf_ctx_init(&csf_ctx, fdin, key, keylen, BLOCK_SIZE, O_RDWR);
+  if(config)
+      csf_ctx_init_ex(&csf_ctx, fdin, key, keylen, BLOCK_SIZE, O_RDWR, config);
+  else
+      csf_ctx_init(&csf_ctx, fdin, key, keylen, BLOCK_SIZE, O_RDWR);
   while( (actual_read_size=csf_read(csf_ctx, buffer, read_size)) >0 ) {
       printf("we have read %d %d\n\n\n", actual_read_size, read_size);
       write(fdout, buffer, actual_read_size);
@@ -64,12 +74,20 @@ int do_decrypt(int fdin, int fdout, unsigned char *key, int keylen){
           write(fdout, buffer, actual_read_size);*/
       total_read +=actual_read_size;
   }
+  CSF_STATS stats;
+  csf_get_stats(csf_ctx, &stats);
+  printf("pages read %llu, decrypted %llu, syscalls %llu, cipher %llu us, io %llu us\n",
+         (unsigned long long)stats.pages_read, (unsigned long long)stats.pages_decrypted, (unsigned long long)stats.syscalls,
+         (unsigned long long)stats.cipher_ns / 1000, (unsigned long long)stats.io_ns / 1000);
+  printf("readahead window %llu, pages %llu, hits %llu, %llu us\n",
+         (unsigned long long)stats.readahead_window, (unsigned long long)stats.readahead_pages,
+         (unsigned long long)stats.readahead_hits, (unsigned long long)stats.readahead_ns / 1000);
   csf_ctx_destroy(csf_ctx);
   return total_read;
 }
 
 // encrypt a file
-int test_enc( char *inpath, char *outpath) {
+int test_enc( char *inpath, char *outpath, CSF_CONFIG *config) {
    char *key="012345678901234567890123456789012";
    int keylen = 32;
 
@@ -84,7 +102,7 @@ int test_enc( char *inpath, char *outpath) {
     printf("could not open files\n");
     exit(0);
    }
-   do_encrypt(fdin, fdout, key, keylen);
+   do_encrypt(fdin, fdout, key, keylen, config);
 
    close(fdin);
    close(fdout);
@@ -92,7 +110,7 @@ int test_enc( char *inpath, char *outpath) {
 }
 
 // decrypt a file
-int test_dec( char *inpath, char *outpath) {
+int test_dec( char *inpath, char *outpath, CSF_CONFIG *config) {
    char *key="012345678901234567890123456789012";
    int keylen = 32;
 
@@ -107,32 +125,1039 @@ int test_dec( char *inpath, char *outpath) {
     printf("could not open files %s %d %s %d\n", inpath, fdin, outpath, fdout);
     exit(0);
    }
-   do_decrypt(fdin, fdout, key, keylen);
+   do_decrypt(fdin, fdout, key, keylen, config);
 
    close(fdin);
    close(fdout);
    chmod(outpath, S_IRWXU);
 }
 
+/* read back the markers test_large wrote, from a file of end bytes. returns the number of failures */
+static int large_read(CSF_CTX *csf_ctx, off_t *marks, int nmarks, off_t end) {
+   char expect[1000], buffer[1000];
+   int i, j, fails = 0;
+
+   if(csf_file_size(csf_ctx) != end) {
+       printf("large file size %lld, expected %lld\n", (long long)csf_file_size(csf_ctx), (long long)end);
+       fails++;
+   }
+   for(i = 0; i < nmarks; i++) {
+       // a range around each marker, read with csf_seek/csf_read
+       off_t from = marks[i] - 500;
+       int n = (from + sizeof(buffer) > end) ? end - from : sizeof(buffer);
+       memset(expect, 0, sizeof(expect));
+       memcpy(expect + 500, "0123456789ABCDEF", 16);
+       for(j = 0; j < nmarks; j++) { // markers close together show up in each other's range
+           if(j != i && marks[j] + 16 > from && marks[j] < from + n) {
+               printf("markers too close\n");
+               exit(0);
+           }
+       }
+       if(csf_seek(csf_ctx, from, SEEK_SET) != from || csf_read(csf_ctx, buffer, sizeof(buffer)) != n || memcmp(buffer, expect, n) != 0) {
+           printf("large file read at %lld failed\n", (long long)from);
+           fails++;
+       }
+       // the marker alone, with csf_pread
+       memset(buffer, 0, sizeof(buffer));
+       if(csf_pread(csf_ctx, buffer, 16, marks[i]) != 16 || memcmp(buffer, "0123456789ABCDEF", 16) != 0) {
+           printf("large file pread at %lld failed\n", (long long)marks[i]);
+           fails++;
+       }
+   }
+   return fails;
+}
+
+/*
+ * offsets past 2^31 and 2^32: write markers around the boundaries of a multi-GB file that is
+ * otherwise empty (the gaps are left as holes that read back as zeros), reopen it, and read the
+ * ranges back. the markers are written with the default config, then again in O_DIRECT mode
+ * where the file system has it, and read each time in mmap mode, then with the default config.
+ * only the O_DIRECT file has its header padded to a page, and the other can't be opened that way
+ */
+int test_large(char *outpath) {
+   char *key="012345678901234567890123456789012";
+   int keylen = 32;
+   off_t marks[] = { ((off_t)1 << 31) - 7, ((off_t)1 << 31) + 4093, ((off_t)1 << 32) - 5, ((off_t)1 << 32) + 70000 };
+   int nmarks = sizeof(marks) / sizeof(marks[0]);
+   char buffer[1000];
+   off_t end = marks[nmarks-1] + 16;
+   CSF_CTX *csf_ctx;
+   CSF_CONFIG config;
+   CSF_STATS stats;
+   CSF_FILE_HEADER cfh;
+   struct stat st;
+   int i, direct, fails = 0;
+
+   for(direct = 0; direct <= 1; direct++) {
+       int fd = open(outpath, O_CREAT|O_TRUNC|O_RDWR, S_IRWXU);
+       if(fd < 0) {
+        printf("could not open file: %s %d %s\n", outpath, errno, strerror(errno));
+        exit(0);
+       }
+       csf_config_init(&config);
+       config.direct = direct;
+       if(csf_ctx_init_ex(&csf_ctx, fd, key, keylen, BLOCK_SIZE, O_RDWR, &config) < 0) {
+           // the file system may not do O_DIRECT, or only with blocks larger than BLOCK_SIZE
+           printf("O_DIRECT not available: %s\n", strerror(errno));
+           close(fd);
+           continue;
+       }
+       for(i = 0; i < nmarks; i++) {
+           csf_pwrite(csf_ctx, "0123456789ABCDEF", 16, marks[i]);
+       }
+       csf_ctx_destroy(csf_ctx);
+       // only the pages around the markers take disk space
+       if(fstat(fd, &st) != 0 || (long long)st.st_blocks * 512 > 1024 * 1024) {
+           printf("large file is not sparse: %lld bytes on disk\n", (long long)st.st_blocks * 512);
+           fails++;
+       }
+       if(pread(fd, &cfh, sizeof(cfh), 0) != sizeof(cfh) || !(ntohl(cfh.flags) & CSF_HDR_PADDED) != !direct ||
+          st.st_size % BLOCK_SIZE != (direct ? 0 : HDR_SZ)) {
+           printf("large file header flags %x, file size %lld\n", ntohl(cfh.flags), (long long)st.st_size);
+           fails++;
+       }
+
+       // read through the mapping, then through pread
+       csf_config_init(&config);
+       config.mmap = 1;
+       csf_ctx_init_ex(&csf_ctx, fd, key, keylen, BLOCK_SIZE, O_RDWR, &config);
+       fails += large_read(csf_ctx, marks, nmarks, end);
+       csf_get_stats(csf_ctx, &stats);
+       if(stats.mapped_pages == 0) {
+           printf("large file was not read through the mapping\n");
+           fails++;
+       }
+       csf_ctx_destroy(csf_ctx);
+
+       csf_ctx_init(&csf_ctx, fd, key, keylen, BLOCK_SIZE, O_RDWR);
+       fails += large_read(csf_ctx, marks, nmarks, end);
+       // shrink to just past 2^32, then past 2^31
+       if(csf_truncate(csf_ctx, marks[2] + 8) != 0 || csf_file_size(csf_ctx) != marks[2] + 8 ||
+          csf_seek(csf_ctx, -8, SEEK_END) != marks[2] || csf_read(csf_ctx, buffer, 100) != 8 || memcmp(buffer, "01234567", 8) != 0) {
+           printf("large file truncate past 2^32 failed\n");
+           fails++;
+       }
+       if(csf_truncate(csf_ctx, marks[1] + 3) != 0 || csf_pread(csf_ctx, buffer, 100, marks[1]) != 3 || memcmp(buffer, "012", 3) != 0) {
+           printf("large file truncate past 2^31 failed\n");
+           fails++;
+       }
+       csf_ctx_destroy(csf_ctx);
+
+       // pages 64 bytes in are not block aligned
+       csf_config_init(&config);
+       config.direct = 1;
+       if(!direct && csf_ctx_init_ex(&csf_ctx, fd, key, keylen, BLOCK_SIZE, O_RDWR, &config) == 0) {
+           printf("large file without a padded header opened in O_DIRECT mode\n");
+           csf_ctx_destroy(csf_ctx);
+           fails++;
+       }
+       close(fd);
+   }
+   printf("large file test: %s\n", fails ? "FAILED" : "ok");
+   return fails;
+}
+
+/*
+ * asynchronous i/o, with io_uring where there is one and with the thread pool: write a file as
+ * a set of requests with unaligned edges, read it back with another set, and compare with the
+ * same data written by csf_pwrite
+ */
+int test_aio(char *outpath) {
+   char *key="012345678901234567890123456789012";
+   int keylen = 32;
+   enum { NREQ = 64, REQ_SZ = 1500 };
+   static char data[NREQ * REQ_SZ], back[NREQ * REQ_SZ];
+   char bufs[NREQ][REQ_SZ];
+   CSF_AIO_REQ reqs[NREQ], *ptrs[NREQ], *done[NREQ];
+   int flags[] = { CSF_AIO_URING, CSF_AIO_THREADS };
+   int f, i, n, fails = 0;
+
+   for(i = 0; i < sizeof(data); i++)
+       data[i] = rand();
+   for(f = 0; f < 2; f++) {
+       struct csf_aio *aio;
+       CSF_CTX *csf_ctx, *durable_ctx;
+       CSF_CONFIG config;
+       int fd = open(outpath, O_CREAT|O_TRUNC|O_RDWR, S_IRWXU);
+
+       if(fd < 0 || csf_aio_init(&aio, 16, flags[f]) < 0) {
+           printf("could not set up aio test: %s %d %s\n", outpath, errno, strerror(errno));
+           exit(0);
+       }
+       csf_ctx_init(&csf_ctx, fd, key, keylen, BLOCK_SIZE, O_RDWR);
+       // requests in reverse order, each starting 100 bytes into its slot: the edges are partial pages
+       for(i = 0; i < NREQ; i++) {
+           memset(&reqs[i], 0, sizeof(reqs[i]));
+           reqs[i].ctx = csf_ctx;
+           reqs[i].op = CSF_AIO_WRITE;
+           reqs[i].buf = data + (NREQ - 1 - i) * REQ_SZ;
+           reqs[i].nbyte = REQ_SZ;
+           reqs[i].offset = 100 + (off_t)(NREQ - 1 - i) * REQ_SZ;
+           ptrs[i] = &reqs[i];
+       }
+       // depth is 16: once that many are in flight, wait for some before submitting the rest
+       i = 0;
+       while(i < NREQ && (n = csf_aio_submit(aio, ptrs + i, NREQ - i)) >= 0) {
+           i += n;
+           csf_aio_wait(aio, done, 1, NREQ);
+       }
+       while(csf_aio_wait(aio, done, 1, NREQ) > 0)
+           ;
+       for(i = 0; i < NREQ; i++) {
+           if(reqs[i].result != REQ_SZ) {
+               printf("aio write %d failed: %zd %d\n", i, reqs[i].result, reqs[i].error);
+               fails++;
+           }
+       }
+
+       for(i = 0; i < NREQ; i++) {
+           reqs[i].op = CSF_AIO_READ;
+           reqs[i].buf = bufs[i];
+           reqs[i].offset = 100 + (off_t)i * REQ_SZ;
+       }
+       i = 0;
+       while(i < NREQ && (n = csf_aio_submit(aio, ptrs + i, NREQ - i)) >= 0) {
+           i += n;
+           csf_aio_wait(aio, done, 1, NREQ);
+       }
+       while(csf_aio_wait(aio, done, 1, NREQ) > 0)
+           ;
+       for(i = 0; i < NREQ; i++) {
+           if(reqs[i].result != REQ_SZ || memcmp(bufs[i], data + i * REQ_SZ, REQ_SZ) != 0) {
+               printf("aio read %d failed: %zd %d\n", i, reqs[i].result, reqs[i].error);
+               fails++;
+           }
+       }
+       // the synchronous calls see what was written, from the start of the file
+       memset(back, 1, sizeof(back));
+       if(csf_pread(csf_ctx, back, 100, 0) != 100 || csf_pread(csf_ctx, back, sizeof(back), 100) != sizeof(back) ||
+          memcmp(back, data, sizeof(data)) != 0) {
+           printf("aio data does not read back with csf_pread\n");
+           fails++;
+       }
+       // a write through a context that syncs its writes is not taken: nothing would sync it
+       csf_config_init(&config);
+       config.durability = CSF_DURABLE_WRITE;
+       csf_ctx_init_ex(&durable_ctx, fd, key, keylen, BLOCK_SIZE, O_RDWR, &config);
+       memset(&reqs[0], 0, sizeof(reqs[0]));
+       reqs[0].ctx = durable_ctx;
+       reqs[0].op = CSF_AIO_WRITE;
+       reqs[0].buf = back;
+       reqs[0].nbyte = REQ_SZ;
+       if(csf_aio_submit(aio, ptrs, 1) != 1 || csf_aio_wait(aio, done, 1, 1) != 1 || reqs[0].result != -1 || reqs[0].error != EINVAL) {
+           printf("aio write on a durable context: %zd %d\n", reqs[0].result, reqs[0].error);
+           fails++;
+       }
+       csf_ctx_destroy(durable_ctx);
+       printf("aio test (%s): %s\n", csf_aio_backend(aio) == CSF_AIO_URING ? "io_uring" : "threads", fails ? "FAILED" : "ok");
+       csf_aio_destroy(aio);
+       csf_ctx_destroy(csf_ctx);
+       close(fd);
+   }
+   return fails;
+}
+
+/*
+ * page ciphers: write a file with each cipher, check the header names it, then reopen it with
+ * another cipher configured and read it back whole and in small pieces (partial page reads)
+ */
+int test_ciphers(char *outpath) {
+   char *key="012345678901234567890123456789012";
+   int keylen = 32;
+   int ciphers[] = { CSF_CIPHER_AES_256_CBC, CSF_CIPHER_AES_256_CTR, CSF_CIPHER_AES_256_XTS, CSF_CIPHER_AES_256_GCM };
+   unsigned int hex[] = { CIPHER_HEX_STRING, CIPHER_HEX_CTR, CIPHER_HEX_XTS, CIPHER_HEX_GCM };
+   static char data[20000], back[20000];
+   int c, i, fails = 0;
+
+   for(i = 0; i < sizeof(data); i++)
+       data[i] = rand();
+   for(c = 0; c < 4; c++) {
+       CSF_CONFIG config;
+       CSF_CTX *csf_ctx;
+       CSF_FILE_HEADER cfh;
+       CSF_STATS stats;
+       int fd = open(outpath, O_CREAT|O_TRUNC|O_RDWR, S_IRWXU);
+
+       if(fd < 0) {
+           printf("could not open file: %s %d %s\n", outpath, errno, strerror(errno));
+           exit(0);
+       }
+       csf_config_init(&config);
+       config.cipher = ciphers[c];
+       csf_ctx_init_ex(&csf_ctx, fd, key, keylen, BLOCK_SIZE, O_RDWR, &config);
+       csf_pwrite(csf_ctx, data, sizeof(data) - 77, 0);
+       csf_pwrite(csf_ctx, data + sizeof(data) - 77, 77, sizeof(data) - 77);
+       csf_ctx_destroy(csf_ctx);
+       if(pread(fd, &cfh, sizeof(cfh), 0) != sizeof(cfh) || ntohl(cfh.cipher) != hex[c]) {
+           printf("cipher %d: header names cipher %x\n", ciphers[c], ntohl(cfh.cipher));
+           fails++;
+       }
+
+       // the cipher in the header wins over the one configured
+       config.cipher = ciphers[(c + 1) % 4];
+       config.cache_pages = 0;
+       csf_ctx_init_ex(&csf_ctx, fd, key, keylen, BLOCK_SIZE, O_RDWR, &config);
+       memset(back, 0, sizeof(back));
+       if(csf_pread(csf_ctx, back, sizeof(back), 0) != sizeof(data) || memcmp(back, data, sizeof(data)) != 0) {
+           printf("cipher %d: read back failed\n", ciphers[c]);
+           fails++;
+       }
+       for(i = 0; i + 40 < sizeof(data); i += 997) {
+           if(csf_pread(csf_ctx, back, 1 + i % 40, i) != 1 + i % 40 || memcmp(back, data + i, 1 + i % 40) != 0) {
+               printf("cipher %d: small read at %d failed\n", ciphers[c], i);
+               fails++;
+           }
+       }
+       csf_get_stats(csf_ctx, &stats);
+       if((stats.partial_pages > 0) != (ciphers[c] == CSF_CIPHER_AES_256_CBC || ciphers[c] == CSF_CIPHER_AES_256_CTR)) {
+           printf("cipher %d: %llu partial page reads\n", ciphers[c], (unsigned long long)stats.partial_pages);
+           fails++;
+       }
+       csf_ctx_destroy(csf_ctx);
+       close(fd);
+   }
+   printf("cipher test: %s\n", fails ? "FAILED" : "ok");
+   return fails;
+}
+
+/* GCM pages that are changed, moved within the file, or taken from another file fail to read */
+int test_tamper(char *outpath) {
+   char *key="012345678901234567890123456789012";
+   int keylen = 32;
+   static char data[20000], back[20000];
+   unsigned char page[BLOCK_SIZE], other[BLOCK_SIZE];
+   CSF_CONFIG config;
+   CSF_CTX *csf_ctx;
+   CSF_STATS stats;
+   int fd, i, fails = 0;
+   off_t gap = 3 * sizeof(data);
+
+   for(i = 0; i < sizeof(data); i++)
+       data[i] = rand();
+   csf_config_init(&config);
+   config.cipher = CSF_CIPHER_AES_256_GCM;
+   config.cache_pages = 0;
+
+   // a second file with the same key, then the file under test, with a gap before its last write
+   fd = open(outpath, O_CREAT|O_TRUNC|O_RDWR, S_IRWXU);
+   if(fd < 0) {
+       printf("could not open file: %s %d %s\n", outpath, errno, strerror(errno));
+       exit(0);
+   }
+   csf_ctx_init_ex(&csf_ctx, fd, key, keylen, BLOCK_SIZE, O_RDWR, &config);
+   csf_pwrite(csf_ctx, data, sizeof(data), 0);
+   csf_ctx_destroy(csf_ctx);
+   pread(fd, other, BLOCK_SIZE, HDR_SZ + 2 * BLOCK_SIZE);
+   ftruncate(fd, 0);
+   csf_ctx_init_ex(&csf_ctx, fd, key, keylen, BLOCK_SIZE, O_RDWR, &config);
+   csf_pwrite(csf_ctx, data, sizeof(data), 0);
+   csf_pwrite(csf_ctx, data, 100, gap);
+   csf_ctx_destroy(csf_ctx);
+
+   csf_ctx_init_ex(&csf_ctx, fd, key, keylen, BLOCK_SIZE, O_RDWR, &config);
+   if(csf_pread(csf_ctx, back, sizeof(back), 0) != sizeof(data) || memcmp(back, data, sizeof(data)) != 0) {
+       printf("tamper: read back failed\n");
+       fails++;
+   }
+   memset(data, 0, 100);
+   if(csf_pread(csf_ctx, back, 100, gap - 100) != 100 || memcmp(back, data, 100) != 0) {
+       printf("tamper: gap does not read as zeros\n");
+       fails++;
+   }
+
+   // one bit flipped in the data of page 1: a read of it fails, a read up to it stops short
+   pread(fd, page, BLOCK_SIZE, HDR_SZ + BLOCK_SIZE);
+   page[100] ^= 1;
+   pwrite(fd, page, BLOCK_SIZE, HDR_SZ + BLOCK_SIZE);
+   errno = 0;
+   if((ssize_t)csf_pread(csf_ctx, back, 10, csf_ctx->data_sz + 5) != -1 || errno != EBADMSG) {
+       printf("tamper: changed page read, errno %d\n", errno);
+       fails++;
+   }
+   if(csf_pread(csf_ctx, back, sizeof(back), 0) != csf_ctx->data_sz) {
+       printf("tamper: read across changed page not cut short\n");
+       fails++;
+   }
+   page[100] ^= 1;
+   pwrite(fd, page, BLOCK_SIZE, HDR_SZ + BLOCK_SIZE);
+
+   // page 1 copied over page 3, and page 2 of the other file over page 2
+   pwrite(fd, page, BLOCK_SIZE, HDR_SZ + 3 * BLOCK_SIZE);
+   if((ssize_t)csf_pread(csf_ctx, back, 10, 3 * csf_ctx->data_sz) != -1 || errno != EBADMSG) {
+       printf("tamper: moved page read\n");
+       fails++;
+   }
+   pwrite(fd, other, BLOCK_SIZE, HDR_SZ + 2 * BLOCK_SIZE);
+   errno = 0;
+   if((ssize_t)csf_pread(csf_ctx, back, 10, 2 * csf_ctx->data_sz) != -1 || errno != EBADMSG) {
+       printf("tamper: page of other file read\n");
+       fails++;
+   }
+   if((ssize_t)csf_pwrite(csf_ctx, back, 10, 2 * csf_ctx->data_sz + 1) != -1) {
+       printf("tamper: write over part of a bad page\n");
+       fails++;
+   }
+   csf_get_stats(csf_ctx, &stats);
+   if(stats.auth_failures < 4) {
+       printf("tamper: %llu auth failures\n", (unsigned long long)stats.auth_failures);
+       fails++;
+   }
+   csf_ctx_destroy(csf_ctx);
+   close(fd);
+   printf("tamper test: %s\n", fails ? "FAILED" : "ok");
+   return fails;
+}
+
+/* page IVs derived from the write counter never repeat, across writes, opens and crashes. random_iv files are VERSION_1002 */
+int test_iv(char *outpath) {
+   char *key="012345678901234567890123456789012";
+   int keylen = 32;
+   static char data[5000], back[5000];
+   unsigned char ivs[8][16];
+   CSF_CONFIG config;
+   CSF_CTX *csf_ctx;
+   CSF_FILE_HEADER cfh;
+   CSF_STATS stats;
+   unsigned int epoch;
+   pid_t pid;
+   int fd, i, j, r, status, fails = 0;
+
+   for(i = 0; i < sizeof(data); i++)
+       data[i] = rand();
+   fd = open(outpath, O_CREAT|O_TRUNC|O_RDWR, S_IRWXU);
+   if(fd < 0) {
+       printf("could not open file: %s %d %s\n", outpath, errno, strerror(errno));
+       exit(0);
+   }
+   csf_config_init(&config);
+   // page 0 written three times in each of two opens, the second write going through a batch
+   for(r = 0; r < 2; r++) {
+       csf_ctx_init_ex(&csf_ctx, fd, key, keylen, BLOCK_SIZE, O_RDWR, &config);
+       for(i = 0; i < 3; i++) {
+           csf_pwrite(csf_ctx, data, i == 1 ? sizeof(data) : 100, 0);
+           csf_flush(csf_ctx);
+           pread(fd, ivs[r * 3 + i], 16, HDR_SZ);
+       }
+       csf_ctx_destroy(csf_ctx);
+   }
+   // a process that dies before it flushes had its epoch synced before its page, so the next open starts a later one
+   pid = fork();
+   if(pid == 0) {
+       csf_ctx_init_ex(&csf_ctx, fd, key, keylen, BLOCK_SIZE, O_RDWR, &config);
+       csf_pwrite(csf_ctx, data, 100, 0);
+       csf_get_stats(csf_ctx, &stats);
+       _exit(stats.syncs == 1 ? 0 : 1);
+   }
+   if(waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+       printf("iv: the new epoch was not synced\n");
+       fails++;
+   }
+   pread(fd, ivs[6], 16, HDR_SZ);
+   pread(fd, &cfh, sizeof(cfh), 0);
+   epoch = ntohl(cfh.write_epoch);
+   csf_ctx_init_ex(&csf_ctx, fd, key, keylen, BLOCK_SIZE, O_RDWR, &config);
+   csf_pwrite(csf_ctx, data, 100, 0);
+   csf_ctx_destroy(csf_ctx);
+   pread(fd, ivs[7], 16, HDR_SZ);
+   pread(fd, &cfh, sizeof(cfh), 0);
+   if(ntohl(cfh.write_epoch) <= epoch) {
+       printf("iv: epoch %u after a crash in epoch %u\n", ntohl(cfh.write_epoch), epoch);
+       fails++;
+   }
+   for(i = 0; i < 8; i++)
+       for(j = 0; j < i; j++)
+           if(memcmp(ivs[i], ivs[j], 16) == 0) {
+               printf("iv: write %d of page 0 has the IV of write %d\n", i, j);
+               fails++;
+           }
+   pread(fd, &cfh, sizeof(cfh), 0);
+   if(ntohl(cfh.version) != VERSION_1004 || ntohl(cfh.write_epoch) < 2) {
+       printf("iv: header version %x, epoch %u\n", ntohl(cfh.version), ntohl(cfh.write_epoch));
+       fails++;
+   }
+   csf_ctx_init_ex(&csf_ctx, fd, key, keylen, BLOCK_SIZE, O_RDWR, &config);
+   if(csf_pread(csf_ctx, back, sizeof(back), 0) != sizeof(data) || memcmp(back, data, sizeof(data)) != 0) {
+       printf("iv: read back failed\n");
+       fails++;
+   }
+   csf_ctx_destroy(csf_ctx);
+
+   ftruncate(fd, 0);
+   config.random_iv = 1;
+   csf_ctx_init_ex(&csf_ctx, fd, key, keylen, BLOCK_SIZE, O_RDWR, &config);
+   csf_pwrite(csf_ctx, data, sizeof(data), 0);
+   csf_ctx_destroy(csf_ctx);
+   pread(fd, &cfh, sizeof(cfh), 0);
+   config.random_iv = 0;
+   csf_ctx_init_ex(&csf_ctx, fd, key, keylen, BLOCK_SIZE, O_RDWR, &config);
+   if(ntohl(cfh.version) != VERSION_1002 || csf_pread(csf_ctx, back, sizeof(back), 0) != sizeof(data) || memcmp(back, data, sizeof(data)) != 0) {
+       printf("iv: random IV file, version %x\n", ntohl(cfh.version));
+       fails++;
+   }
+   csf_ctx_destroy(csf_ctx);
+   close(fd);
+   printf("iv test: %s\n", fails ? "FAILED" : "ok");
+   return fails;
+}
+
+/* one key shared by open files of each cipher: files read back with a key of their own, and hold no page buffers or cache between calls */
+int test_keys(char *outpath) {
+   char *key="012345678901234567890123456789012";
+   int keylen = 32;
+   int ciphers[] = { CSF_CIPHER_AES_256_CBC, CSF_CIPHER_AES_256_CTR, CSF_CIPHER_AES_256_XTS, CSF_CIPHER_AES_256_GCM };
+   static char data[20000], back[20000];
+   char path[4][1024];
+   int fds[4];
+   CSF_CTX *ctxs[4];
+   CSF_CONFIG config;
+   CSF_KEY *shared;
+   int c, i, fails = 0;
+
+   for(i = 0; i < sizeof(data); i++)
+       data[i] = rand();
+   shared = csf_key_new((unsigned char *)key, keylen);
+   for(c = 0; c < 4; c++) {
+       snprintf(path[c], sizeof(path[c]), "%s.%d", outpath, c);
+       fds[c] = open(path[c], O_CREAT|O_TRUNC|O_RDWR, S_IRWXU);
+       if(fds[c] < 0) {
+           printf("could not open file: %s %d %s\n", path[c], errno, strerror(errno));
+           exit(0);
+       }
+       csf_config_init(&config);
+       config.cipher = ciphers[c];
+       if(csf_ctx_init_key(&ctxs[c], fds[c], shared, BLOCK_SIZE, O_RDWR, &config) < 0) {
+           printf("keys: cipher %d: init failed\n", ciphers[c]);
+           exit(0);
+       }
+   }
+   // the contexts keep the key alive
+   csf_key_free(shared);
+
+   // interleaved writes, so that the contexts take turns with the pooled buffers
+   for(i = 0; i < sizeof(data); i += 1234) {
+       int n = (sizeof(data) - i < 1234) ? sizeof(data) - i : 1234;
+       for(c = 0; c < 4; c++)
+           csf_pwrite(ctxs[c], data + i, n, i);
+   }
+   for(c = 0; c < 4; c++) {
+       if(ctxs[c]->page_buffer || ctxs[c]->csf_buffer || ctxs[c]->scratch_buffer || ctxs[c]->batch_raw || ctxs[c]->cache_pages != 0) {
+           printf("keys: cipher %d: page buffers or cached pages held between calls\n", ciphers[c]);
+           fails++;
+       }
+       csf_ctx_destroy(ctxs[c]);
+   }
+
+   for(c = 0; c < 4; c++) {
+       csf_config_init(&config);
+       csf_ctx_init_ex(&ctxs[c], fds[c], key, keylen, BLOCK_SIZE, O_RDWR, &config);
+       memset(back, 0, sizeof(back));
+       // a context with a key of its own has the default cache
+       if(ctxs[c]->cache_pages != CSF_CACHE_DEFAULT_PAGES || csf_pread(ctxs[c], back, sizeof(back), 0) != sizeof(data) ||
+          memcmp(back, data, sizeof(data)) != 0) {
+           printf("keys: cipher %d: read back failed\n", ciphers[c]);
+           fails++;
+       }
+       csf_ctx_destroy(ctxs[c]);
+       close(fds[c]);
+       unlink(path[c]);
+   }
+   printf("key test: %s\n", fails ? "FAILED" : "ok");
+   return fails;
+}
+
+#define SHARED_THREADS 4
+#define SHARED_REGION  20000
+#define SHARED_CHUNK   1000
+
+struct shared_arg {
+   CSF_FILE *file;
+   int t;
+   char *data;
+   int fails;
+};
+
+/*
+ * after writer t wrote chunk bytes of data at off, written says how many it was told: read the
+ * chunk back, and read the chunk at other, which another writer may be writing. that one is
+ * seen whole or not at all. who names the writer in messages. returns the number of failures
+ */
+static int chunk_check(CSF_CTX *ctx, char *data, off_t off, off_t other, int chunk, ssize_t written, const char *who, int t) {
+   char back[SHARED_CHUNK];
+   int j, n, fails = 0;
+
+   if(written != chunk || csf_pread(ctx, back, chunk, off) != chunk || memcmp(back, data + off, chunk) != 0) {
+       printf("%s %d: chunk at %lld failed\n", who, t, (long long)off);
+       fails++;
+   }
+   n = csf_pread(ctx, back, chunk, other);
+   for(j = 0; j < n && back[j] == 0; j++);
+   if((n != 0 && n != chunk) || (j < n && memcmp(back, data + other, n) != 0)) {
+       printf("%s %d: torn read of %d bytes at %lld\n", who, t, n, (long long)other);
+       fails++;
+   }
+   return fails;
+}
+
+/* writes its region of the file a chunk at a time through a cursor, and reads chunks of the next region as they are written */
+static void *shared_thread(void *p) {
+   struct shared_arg *arg = p;
+   CSF_CTX *cur;
+   off_t base = (off_t)arg->t * SHARED_REGION, next = (off_t)((arg->t + 1) % SHARED_THREADS) * SHARED_REGION;
+   int i;
+
+   if(csf_cursor_open(&cur, arg->file) < 0) {
+       arg->fails++;
+       return NULL;
+   }
+   for(i = 0; i < SHARED_REGION; i += SHARED_CHUNK) {
+       csf_seek(cur, base + i, SEEK_SET);
+       arg->fails += chunk_check(cur, arg->data, base + i, next + i, SHARED_CHUNK,
+                                 csf_write(cur, arg->data + base + i, SHARED_CHUNK), "shared: thread", arg->t);
+   }
+   csf_ctx_destroy(cur);
+   return NULL;
+}
+
+/* threads read and write one file through cursors of their own, some past the end of file */
+int test_shared(char *outpath) {
+   char *key="012345678901234567890123456789012";
+   int keylen = 32;
+   static char data[SHARED_THREADS * SHARED_REGION], back[SHARED_THREADS * SHARED_REGION];
+   struct shared_arg args[SHARED_THREADS];
+   pthread_t threads[SHARED_THREADS];
+   CSF_KEY *csf_key;
+   CSF_FILE *file;
+   CSF_CTX *csf_ctx;
+   CSF_FILE_HEADER cfh;
+   int fd, i, fails = 0;
+
+   for(i = 0; i < sizeof(data); i++)
+       data[i] = rand() | 1;
+   fd = open(outpath, O_CREAT|O_TRUNC|O_RDWR, S_IRWXU);
+   if(fd < 0) {
+       printf("could not open file: %s %d %s\n", outpath, errno, strerror(errno));
+       exit(0);
+   }
+   csf_key = csf_key_new((unsigned char *)key, keylen);
+   file = csf_file_open(fd, csf_key, BLOCK_SIZE, O_RDWR, NULL);
+   csf_key_free(csf_key);
+   if(file == NULL || csf_cursor_open(&csf_ctx, file) < 0) {
+       printf("shared: open failed\n");
+       exit(0);
+   }
+   // all but the last region are there to start with, so only the last thread writes past the end
+   memset(back, 0, sizeof(back));
+   csf_pwrite(csf_ctx, back, (SHARED_THREADS - 1) * SHARED_REGION, 0);
+   for(i = 0; i < SHARED_THREADS; i++) {
+       args[i].file = file;
+       args[i].t = i;
+       args[i].data = data;
+       args[i].fails = 0;
+       pthread_create(&threads[i], NULL, shared_thread, &args[i]);
+   }
+   for(i = 0; i < SHARED_THREADS; i++) {
+       pthread_join(threads[i], NULL);
+       fails += args[i].fails;
+   }
+   if(csf_file_size(csf_ctx) != sizeof(data)) {
+       printf("shared: size %lld\n", (long long)csf_file_size(csf_ctx));
+       fails++;
+   }
+   csf_ctx_destroy(csf_ctx);
+   csf_file_close(file);
+
+   pread(fd, &cfh, sizeof(cfh), 0);
+   csf_ctx_init_ex(&csf_ctx, fd, key, keylen, BLOCK_SIZE, O_RDWR, NULL);
+   if(!(ntohl(cfh.flags) & CSF_HDR_SIZE_VALID) || csf_pread(csf_ctx, back, sizeof(back), 0) != sizeof(data) ||
+      memcmp(back, data, sizeof(data)) != 0) {
+       printf("shared: read back failed\n");
+       fails++;
+   }
+   csf_ctx_destroy(csf_ctx);
+   close(fd);
+   printf("shared test: %s\n", fails ? "FAILED" : "ok");
+   return fails;
+}
+
+#define MP_CHUNK  40
+
+/* a process writing its region of the file in multi_process mode, and reading the next region as it is written. returns failures */
+static int mp_child(char *outpath, int t, char *data) {
+   char *key="012345678901234567890123456789012";
+   int keylen = 32;
+   off_t base = (off_t)t * SHARED_REGION, next = (off_t)((t + 1) % SHARED_THREADS) * SHARED_REGION;
+   CSF_CONFIG config;
+   CSF_CTX *csf_ctx;
+   int fd = open(outpath, O_RDWR), i, fails = 0;
+
+   csf_config_init(&config);
+   config.multi_process = 1;
+   if(fd < 0 || csf_ctx_init_ex(&csf_ctx, fd, key, keylen, BLOCK_SIZE, O_RDWR, &config) < 0)
+       return 1;
+   for(i = 0; i < SHARED_REGION; i += MP_CHUNK)
+       fails += chunk_check(csf_ctx, data, base + i, next + i, MP_CHUNK,
+                            csf_pwrite(csf_ctx, data + base + i, MP_CHUNK, base + i), "multi process: process", t);
+   csf_ctx_destroy(csf_ctx);
+   close(fd);
+   return fails;
+}
+
+/* processes read and write one file in multi_process mode, some past the end of file. a reader's cached pages follow their changes */
+int test_multi_process(char *outpath) {
+   char *key="012345678901234567890123456789012";
+   int keylen = 32;
+   static char data[SHARED_THREADS * SHARED_REGION], back[SHARED_THREADS * SHARED_REGION];
+   pid_t pids[SHARED_THREADS];
+   CSF_CONFIG config;
+   CSF_CTX *csf_ctx;
+   CSF_STATS stats;
+   CSF_FILE_HEADER cfh;
+   int fd, i, status, fails = 0;
+
+   for(i = 0; i < sizeof(data); i++)
+       data[i] = rand() | 1;
+   fd = open(outpath, O_CREAT|O_TRUNC|O_RDWR, S_IRWXU);
+   if(fd < 0) {
+       printf("could not open file: %s %d %s\n", outpath, errno, strerror(errno));
+       exit(0);
+   }
+   csf_config_init(&config);
+   config.multi_process = 1;
+   config.cache_pages = 256;
+   csf_ctx_init_ex(&csf_ctx, fd, key, keylen, BLOCK_SIZE, O_RDWR, &config);
+   // all but the last region are there to start with, and read into the cache
+   memset(back, 0, sizeof(back));
+   csf_pwrite(csf_ctx, back, (SHARED_THREADS - 1) * SHARED_REGION, 0);
+   csf_pread(csf_ctx, back, SHARED_REGION, 0);
+   for(i = 0; i < SHARED_THREADS; i++) {
+       pids[i] = fork();
+       if(pids[i] == 0)
+           _exit(mp_child(outpath, i, data) ? 1 : 0);
+   }
+   for(i = 0; i < SHARED_THREADS; i++) {
+       if(waitpid(pids[i], &status, 0) != pids[i] || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+           printf("multi process: process %d failed\n", i);
+           fails++;
+       }
+   }
+   if(csf_file_size(csf_ctx) != sizeof(data) || csf_pread(csf_ctx, back, sizeof(back), 0) != sizeof(data) ||
+      memcmp(back, data, sizeof(data)) != 0) {
+       printf("multi process: read back after the others failed\n");
+       fails++;
+   }
+   csf_get_stats(csf_ctx, &stats);
+   if(stats.remote_changes == 0) {
+       printf("multi process: changes by the others not seen\n");
+       fails++;
+   }
+   csf_ctx_destroy(csf_ctx);
+
+   pread(fd, &cfh, sizeof(cfh), 0);
+   csf_ctx_init_ex(&csf_ctx, fd, key, keylen, BLOCK_SIZE, O_RDWR, NULL);
+   if(!(ntohl(cfh.flags) & CSF_HDR_SIZE_VALID) || csf_pread(csf_ctx, back, sizeof(back), 0) != sizeof(data) ||
+      memcmp(back, data, sizeof(data)) != 0) {
+       printf("multi process: read back failed\n");
+       fails++;
+   }
+   csf_ctx_destroy(csf_ctx);
+   close(fd);
+   printf("multi process test: %s\n", fails ? "FAILED" : "ok");
+   return fails;
+}
+
+#define DURABLE_WRITES 20
+#define JOURNAL_OLD    1500
+#define JOURNAL_AT     300
+#define JOURNAL_NEW    2000
+
+struct durable_arg {
+   CSF_FILE *file;
+   int t;
+   char *data;
+   int fails;
+   CSF_STATS stats;
+};
+
+/* writes its region of the file a chunk at a time through a cursor, each write durable when it returns */
+static void *durable_thread(void *p) {
+   struct durable_arg *arg = p;
+   CSF_CTX *cur;
+   off_t base = (off_t)arg->t * SHARED_REGION;
+   int i;
+
+   if(csf_cursor_open(&cur, arg->file) < 0) {
+       arg->fails++;
+       return NULL;
+   }
+   for(i = 0; i < SHARED_REGION; i += SHARED_CHUNK) {
+       if(csf_pwrite(cur, arg->data + base + i, SHARED_CHUNK, base + i) != SHARED_CHUNK) {
+           printf("durable: thread %d: chunk at %d failed\n", arg->t, i);
+           arg->fails++;
+       }
+   }
+   csf_get_stats(cur, &arg->stats);
+   csf_ctx_destroy(cur);
+   return NULL;
+}
+
+/* a multi-page write through the journal by a process that then dies without closing the file */
+static int journal_child(char *outpath, char *jpath, char *data) {
+   char *key="012345678901234567890123456789012";
+   int keylen = 32;
+   CSF_CONFIG config;
+   CSF_CTX *csf_ctx;
+   int fd = open(outpath, O_RDWR), jfd = open(jpath, O_RDWR);
+
+   csf_config_init(&config);
+   config.journal_fd = jfd;
+   if(fd < 0 || jfd < 0 || csf_ctx_init_ex(&csf_ctx, fd, key, keylen, BLOCK_SIZE, O_RDWR, &config) < 0 ||
+      csf_pwrite(csf_ctx, data, JOURNAL_NEW, JOURNAL_AT) != JOURNAL_NEW)
+       return 1;
+   return 0;
+}
+
+/*
+ * open outpath with the journal, and read it back against expect, of expect_sz bytes. replays is what
+ * the journal should have held. the journal is empty after
+ */
+static int journal_check(char *outpath, char *jpath, char *expect, int expect_sz, int replays, const char *what) {
+   char *key="012345678901234567890123456789012";
+   int keylen = 32;
+   static char back[JOURNAL_AT + JOURNAL_NEW + 1];
+   CSF_CONFIG config;
+   CSF_CTX *csf_ctx;
+   CSF_STATS stats;
+   struct stat st;
+   int fd = open(outpath, O_RDWR), jfd = open(jpath, O_RDWR), fails = 0;
+
+   csf_config_init(&config);
+   config.journal_fd = jfd;
+   if(csf_ctx_init_ex(&csf_ctx, fd, key, keylen, BLOCK_SIZE, O_RDWR, &config) < 0) {
+       printf("durable: %s: open failed: %s\n", what, strerror(errno));
+       return 1;
+   }
+   csf_get_stats(csf_ctx, &stats);
+   if(stats.journal_replays != replays || fstat(jfd, &st) < 0 || st.st_size != 0) {
+       printf("durable: %s: %llu writes replayed, journal of %lld bytes left\n", what, (unsigned long long)stats.journal_replays, (long long)st.st_size);
+       fails++;
+   }
+   if(csf_pread(csf_ctx, back, sizeof(back), 0) != expect_sz || memcmp(back, expect, expect_sz) != 0) {
+       printf("durable: %s: read back failed\n", what);
+       fails++;
+   }
+   csf_ctx_destroy(csf_ctx);
+   close(jfd);
+   close(fd);
+   return fails;
+}
+
+/* put back the pages of outpath from raw, of raw_sz bytes, leaving the header, as a crash before they were written would */
+static void journal_undo(char *outpath, char *raw, int raw_sz) {
+   int fd = open(outpath, O_RDWR);
+
+   pwrite(fd, raw + HDR_SZ, raw_sz - HDR_SZ, HDR_SZ);
+   ftruncate(fd, raw_sz);
+   close(fd);
+}
+
+/* writes durable when they return, alone and in group commits, and multi-page writes that survive a crash whole or not at all */
+int test_durable(char *outpath) {
+   char *key="012345678901234567890123456789012";
+   int keylen = 32;
+   static char data[SHARED_THREADS * SHARED_REGION], back[SHARED_THREADS * SHARED_REGION];
+   static char expect[JOURNAL_AT + JOURNAL_NEW], raw[16384];
+   char jpath[1024];
+   struct durable_arg args[SHARED_THREADS];
+   pthread_t threads[SHARED_THREADS];
+   CSF_CONFIG config;
+   CSF_KEY *csf_key;
+   CSF_FILE *file;
+   CSF_CTX *csf_ctx;
+   CSF_STATS stats;
+   uint64_t syncs = 0;
+   pid_t pid;
+   int fd, jfd, i, status, raw_sz, fails = 0;
+
+   for(i = 0; i < sizeof(data); i++)
+       data[i] = rand() | 1;
+   fd = open(outpath, O_CREAT|O_TRUNC|O_RDWR, S_IRWXU);
+   if(fd < 0) {
+       printf("could not open file: %s %d %s\n", outpath, errno, strerror(errno));
+       exit(0);
+   }
+
+   // the writes of all the cursors share syncs
+   csf_config_init(&config);
+   config.durability = CSF_DURABLE_GROUP;
+   config.group_commit_us = 2000;
+   csf_key = csf_key_new((unsigned char *)key, keylen);
+   file = csf_file_open(fd, csf_key, BLOCK_SIZE, O_RDWR, &config);
+   csf_key_free(csf_key);
+   if(file == NULL) {
+       printf("durable: open failed\n");
+       exit(0);
+   }
+   for(i = 0; i < SHARED_THREADS; i++) {
+       args[i].file = file;
+       args[i].t = i;
+       args[i].data = data;
+       args[i].fails = 0;
+       pthread_create(&threads[i], NULL, durable_thread, &args[i]);
+   }
+   for(i = 0; i < SHARED_THREADS; i++) {
+       pthread_join(threads[i], NULL);
+       fails += args[i].fails;
+       syncs += args[i].stats.syncs;
+   }
+   if(syncs == 0 || syncs >= SHARED_THREADS * (SHARED_REGION / SHARED_CHUNK)) {
+       printf("durable: %llu syncs for %d group commit writes\n", (unsigned long long)syncs, SHARED_THREADS * (SHARED_REGION / SHARED_CHUNK));
+       fails++;
+   }
+   csf_file_close(file);
+
+   // each write syncs, and csf_sync takes the modes it knows
+   csf_config_init(&config);
+   config.durability = CSF_DURABLE_WRITE;
+   csf_ctx_init_ex(&csf_ctx, fd, key, keylen, BLOCK_SIZE, O_RDWR, &config);
+   if(csf_pread(csf_ctx, back, sizeof(back), 0) != sizeof(data) || memcmp(back, data, sizeof(data)) != 0) {
+       printf("durable: group commit read back failed\n");
+       fails++;
+   }
+   csf_pwrite(csf_ctx, data, 10, 0);
+   csf_reset_stats(csf_ctx);
+   for(i = 0; i < DURABLE_WRITES; i++)
+       csf_pwrite(csf_ctx, data + i * 10, 10, i * 10);
+   csf_get_stats(csf_ctx, &stats);
+   if(stats.syncs != DURABLE_WRITES || csf_sync(csf_ctx, CSF_SYNC_FULL) != 0 || csf_sync(csf_ctx, 7) != -1 || errno != EINVAL) {
+       printf("durable: %llu syncs for %d writes, or csf_sync failed\n", (unsigned long long)stats.syncs, DURABLE_WRITES);
+       fails++;
+   }
+   csf_ctx_destroy(csf_ctx);
+   close(fd);
+
+   // a multi-page write goes through the journal, a write of one page does not
+   snprintf(jpath, sizeof(jpath), "%s.journal", outpath);
+   fd = open(outpath, O_CREAT|O_TRUNC|O_RDWR, S_IRWXU);
+   jfd = open(jpath, O_CREAT|O_TRUNC|O_RDWR, S_IRWXU);
+   csf_config_init(&config);
+   config.journal_fd = jfd;
+   csf_ctx_init_ex(&csf_ctx, fd, key, keylen, BLOCK_SIZE, O_RDWR, &config);
+   csf_pwrite(csf_ctx, data, JOURNAL_OLD, 0);
+   csf_pwrite(csf_ctx, data, 10, 0);
+   csf_get_stats(csf_ctx, &stats);
+   if(stats.journal_writes != 1) {
+       printf("durable: %llu writes went through the journal\n", (unsigned long long)stats.journal_writes);
+       fails++;
+   }
+   csf_ctx_destroy(csf_ctx);
+   close(jfd);
+   raw_sz = pread(fd, raw, sizeof(raw), 0);
+   close(fd);
+   memcpy(expect, data, JOURNAL_AT);
+   memcpy(expect + JOURNAL_AT, data + JOURNAL_OLD, JOURNAL_NEW);
+
+   // a crash after the write was committed, but before any of it made it to the file: it is made at the next open
+   pid = fork();
+   if(pid == 0)
+       _exit(journal_child(outpath, jpath, data + JOURNAL_OLD));
+   if(waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+       printf("durable: journal writer failed\n");
+       fails++;
+   }
+   journal_undo(outpath, raw, raw_sz);
+   fails += journal_check(outpath, jpath, expect, sizeof(expect), 1, "replay");
+
+   // a crash while the record was being written: the file stays as it was
+   fd = open(outpath, O_RDWR);
+   raw_sz = pread(fd, raw, sizeof(raw), 0);
+   close(fd);
+   pid = fork();
+   if(pid == 0)
+       _exit(journal_child(outpath, jpath, data));
+   waitpid(pid, &status, 0);
+   journal_undo(outpath, raw, raw_sz);
+   jfd = open(jpath, O_RDWR);
+   pwrite(jfd, "", 1, lseek(jfd, 0, SEEK_END) - 1);
+   close(jfd);
+   fails += journal_check(outpath, jpath, expect, sizeof(expect), 0, "partial record");
+   unlink(jpath);
+
+   printf("durable test: %s\n", fails ? "FAILED" : "ok");
+   return fails;
+}
 
 int main(int argc, char **argv) {
    if(argc<2) {
-     printf("test [-u] filename\n");
+     printf("test [-u|-b|-w|-l|-a|-c|-t|-i|-k|-s|-p|-y] filename\n");
      return -1;
    }
+   if(argc==3 && strcmp(argv[1], "-b")==0) { // encrypt the input file in write back mode, and save with .Z extension
+       CSF_CONFIG config;
+       char *out = malloc(strlen(argv[2])+3);
+       // small sequential writes: let csfio coalesce them and encrypt each page once
+       csf_config_init(&config);
+       config.write_back = 1;
+       strcpy(out, argv[2]);
+       strcat(out, ".Z");
+       printf("new file: %s\n", out);
+       test_enc(argv[2], out, &config);
+       free(out);
+       return 0;
+   }
+   if(argc==3 && strcmp(argv[1], "-w")==0) { // decrypt the input file on worker threads, reading ahead, and save with .W extension
+       CSF_CONFIG config;
+       char *out = malloc(strlen(argv[2])+3);
+       // 64K reads span many pages: decrypt them on worker threads, and read the next ones ahead
+       csf_config_init(&config);
+       config.workers = 2;
+       config.readahead_pages = 256;
+       strcpy(out, argv[2]);
+       strcat(out, ".W");
+       printf("new file: %s\n", out);
+       test_dec(argv[2], out, &config);
+       free(out);
+       return 0;
+   }
+   if(argc==3 && strcmp(argv[1], "-l")==0) { // round trip reads past 2^31 and 2^32 in a new file
+       return test_large(argv[2]);
+   }
+   if(argc==3 && strcmp(argv[1], "-a")==0) { // asynchronous writes and reads in a new file
+       return test_aio(argv[2]);
+   }
+   if(argc==3 && strcmp(argv[1], "-c")==0) { // each page cipher in a new file
+       return test_ciphers(argv[2]);
+   }
+   if(argc==3 && strcmp(argv[1], "-t")==0) { // GCM pages that were tampered with
+       return test_tamper(argv[2]);
+   }
+   if(argc==3 && strcmp(argv[1], "-i")==0) { // derived page IVs
+       return test_iv(argv[2]);
+   }
+   if(argc==3 && strcmp(argv[1], "-k")==0) { // a key shared between open files
+       return test_keys(argv[2]);
+   }
+   if(argc==3 && strcmp(argv[1], "-s")==0) { // threads sharing one file
+       return test_shared(argv[2]);
+   }
+   if(argc==3 && strcmp(argv[1], "-p")==0) { // processes sharing one file
+       return test_multi_process(argv[2]);
+   }
+   if(argc==3 && strcmp(argv[1], "-y")==0) { // durable writes, group commits and the journal
+       return test_durable(argv[2]);
+   }
    if(argc==2) { // encrypt the input file and save with .Z extension
        char *infile = argv[1];
        char *out = malloc(strlen(infile)+3);
        strcpy(out, infile);
        strcat(out, ".Z");
        printf("new file: %s\n", out);
-       test_enc(infile, out);
+       test_enc(infile, out, NULL);
    } else if(argc==3) { // decrypt the input file and save with .U extension
        char *infile = argv[2];
        char *out = malloc(strlen(infile)+3);
        strcpy(out, infile);
        strcat(out, ".U");
        printf("new file: %s\n", out);
-       test_dec(infile, out);
+       test_dec(infile, out, NULL);
    }
 }